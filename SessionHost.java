@@ -0,0 +1,332 @@
+/* -*- Mode: Java -*- */
+/**
+ * Resident JVM for ./main -J (needs java 16 or newer)
+ *
+ *   $ java -Djava.security.manager=allow SessionHost.java SOCKET DIR CLASS
+ *
+ * Started once by the server. It listens on the unix socket SOCKET
+ * (in a directory only the server's user can enter), writes "ready"
+ * on stdout and closes it, and the server connects once per client and relays the client's
+ * bytes. Each session runs CLASS's main in its own thread, with its
+ * own class loader (so statics aren't shared between students), and
+ * with System.in/out/err bound to that session's connection.
+ *
+ * The server starts a session with "ARG\0ARG\0...\0\0" (the
+ * args it gathered from the client, maybe none).
+ * The JVM exits when its stdin (a pipe from the server) closes.
+ * Without a security manager (java 24 and newer) one System.exit
+ * would stop every session, so the host exits instead of starting,
+ * and the server execs the program per client.
+ */
+
+import java.io.BufferedOutputStream;
+import java.io.FileDescriptor;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.io.PrintStream;
+import java.lang.reflect.InvocationTargetException;
+import java.lang.reflect.Method;
+import java.net.StandardProtocolFamily;
+import java.net.URL;
+import java.net.URLClassLoader;
+import java.net.UnixDomainSocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.ServerSocketChannel;
+import java.nio.channels.SocketChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.security.Permission;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.Locale;
+
+public class SessionHost {
+    /* the session a thread belongs to (threads it starts inherit it) */
+    static final InheritableThreadLocal<Session> current = new InheritableThreadLocal<>();
+
+    /* System.exit from a session ends only that session */
+    static class SessionExit extends SecurityException {
+        final int status;
+        SessionExit(int status) {
+            super("System.exit(" + status + ")");
+            this.status = status;
+        }
+    }
+
+    /* the server closed the session's connection (the client left, or
+       the -o total was reached). PrintStream swallows IOExceptions, a
+       program printing in a loop would never notice, so this unwinds it */
+    static class SessionGone extends Error {
+        SessionGone() {
+            super("session closed");
+        }
+    }
+
+    /* raw reads on the channel, it has separate read and write
+       locks so a thread can print while another one reads */
+    static class ChannelIn extends InputStream {
+        private final SocketChannel ch;
+        ChannelIn(SocketChannel ch) { this.ch = ch; }
+        public int read() throws IOException {
+            byte[] b = new byte[1];
+            return (1 == read(b, 0, 1)) ? (b[0] & 0xff) : -1;
+        }
+        public int read(byte[] b, int off, int len) throws IOException {
+            if (0 == len) {
+                return 0;
+            }
+            return ch.read(ByteBuffer.wrap(b, off, len));
+        }
+    }
+
+    static class ChannelOut extends OutputStream {
+        private final SocketChannel ch;
+        ChannelOut(SocketChannel ch) { this.ch = ch; }
+        public void write(int b) throws IOException {
+            write(new byte[] { (byte) b }, 0, 1);
+        }
+        public void write(byte[] b, int off, int len) throws IOException {
+            ByteBuffer buf = ByteBuffer.wrap(b, off, len);
+            try {
+                while (buf.hasRemaining()) {
+                    ch.write(buf);
+                }
+            } catch (IOException e) {
+                throw new SessionGone();
+            }
+        }
+    }
+
+    /* one client's connection. Its own PrintStreams, a PrintStream
+       holds its lock while it writes, and a session blocked on its
+       client (or the -o throttle) mustn't hold up the others */
+    static class Session {
+        final SocketChannel ch;
+        final InputStream in;
+        final PrintStream out;
+        final PrintStream err;
+        Session(SocketChannel ch) {
+            this.ch = ch;
+            this.in = new ChannelIn(ch);
+            this.out = new PrintStream(new BufferedOutputStream(new ChannelOut(ch), 8192), true);
+            this.err = new PrintStream(new BufferedOutputStream(new ChannelOut(ch), 8192), true);
+        }
+    }
+
+    /* System.in, reads from the current thread's session */
+    static class SessionIn extends InputStream {
+        private final InputStream host;
+        SessionIn(InputStream host) { this.host = host; }
+        private InputStream in() {
+            Session s = current.get();
+            return (null == s) ? host : s.in;
+        }
+        public int read() throws IOException { return in().read(); }
+        public int read(byte[] b, int off, int len) throws IOException {
+            return in().read(b, off, len);
+        }
+        public int available() throws IOException { return in().available(); }
+    }
+
+    /* System.out and System.err, hand every call to the current
+       thread's session's PrintStream. Nothing here takes a lock */
+    static class SessionPrint extends PrintStream {
+        private final PrintStream host;
+        private final boolean err;
+        SessionPrint(PrintStream host, boolean err) {
+            super(host, true);
+            this.host = host;
+            this.err = err;
+        }
+        private PrintStream ps() {
+            Session s = current.get();
+            return (null == s) ? host : (err ? s.err : s.out);
+        }
+        public void write(int b) { ps().write(b); }
+        public void write(byte[] b, int off, int len) { ps().write(b, off, len); }
+        public void write(byte[] b) throws IOException { ps().write(b); }
+        public void writeBytes(byte[] b) { ps().writeBytes(b); }
+        public void flush() { ps().flush(); }
+        public void close() { ps().close(); }
+        public boolean checkError() { return ps().checkError(); }
+        public void print(boolean b) { ps().print(b); }
+        public void print(char c) { ps().print(c); }
+        public void print(int i) { ps().print(i); }
+        public void print(long l) { ps().print(l); }
+        public void print(float f) { ps().print(f); }
+        public void print(double d) { ps().print(d); }
+        public void print(char[] s) { ps().print(s); }
+        public void print(String s) { ps().print(s); }
+        public void print(Object o) { ps().print(o); }
+        public void println() { ps().println(); }
+        public void println(boolean b) { ps().println(b); }
+        public void println(char c) { ps().println(c); }
+        public void println(int i) { ps().println(i); }
+        public void println(long l) { ps().println(l); }
+        public void println(float f) { ps().println(f); }
+        public void println(double d) { ps().println(d); }
+        public void println(char[] s) { ps().println(s); }
+        public void println(String s) { ps().println(s); }
+        public void println(Object o) { ps().println(o); }
+        public PrintStream printf(String format, Object... args) {
+            ps().printf(format, args);
+            return this;
+        }
+        public PrintStream printf(Locale l, String format, Object... args) {
+            ps().printf(l, format, args);
+            return this;
+        }
+        public PrintStream format(String format, Object... args) {
+            ps().format(format, args);
+            return this;
+        }
+        public PrintStream format(Locale l, String format, Object... args) {
+            ps().format(l, format, args);
+            return this;
+        }
+        public PrintStream append(CharSequence csq) {
+            ps().append(csq);
+            return this;
+        }
+        public PrintStream append(CharSequence csq, int start, int end) {
+            ps().append(csq, start, end);
+            return this;
+        }
+        public PrintStream append(char c) {
+            ps().append(c);
+            return this;
+        }
+    }
+
+    /** readHeader
+        the fields the server sent, up to the empty one.
+        null if the connection closed first */
+    static List<String> readHeader(InputStream in) throws IOException {
+        List<String> fields = new ArrayList<>();
+        StringBuilder field = new StringBuilder();
+        int c;
+        while (-1 != (c = in.read())) {
+            if (0 != c) {
+                field.append((char) c);
+            } else if (0 == field.length()) {
+                return fields;
+            } else {
+                fields.add(field.toString());
+                field.setLength(0);
+            }
+        }
+        return null;
+    }
+
+    /** runSession
+        runs in the session's thread */
+    static void runSession(SocketChannel ch, Path dir, String cls) {
+        Session s = new Session(ch);
+        current.set(s);
+        try {
+            List<String> args = readHeader(s.in);
+            if (null == args) {
+                return;
+            }
+
+            /* a fresh loader per session, the host's classes aren't visible */
+            URLClassLoader loader = new URLClassLoader(new URL[] { dir.toUri().toURL() },
+                                                       ClassLoader.getPlatformClassLoader());
+            Method main = Class.forName(cls, true, loader).getMethod("main", String[].class);
+            main.invoke(null, (Object) args.toArray(new String[0]));
+        } catch (InvocationTargetException e) {
+            Throwable t = e.getCause();
+            if (!(t instanceof SessionExit) && !(t instanceof SessionGone)) {
+                System.err.print("Exception in thread \"main\" ");
+                t.printStackTrace();
+            }
+        } catch (SessionExit | SessionGone e) {
+            /* exited during class initialization, or the connection closed */
+        } catch (Throwable t) {
+            t.printStackTrace();
+        } finally {
+            try {
+                System.out.flush();
+                System.err.flush();
+            } catch (SessionGone e) {
+            }
+            try {
+                ch.close();
+            } catch (IOException e) {
+            }
+        }
+    }
+
+    /** watchServer
+        exit when the server closes our stdin */
+    static void watchServer(InputStream server, Path sock) {
+        try {
+            while (-1 != server.read()) {
+            }
+        } catch (IOException e) {
+        }
+        try {
+            Files.deleteIfExists(sock);
+        } catch (IOException e) {
+        }
+        Runtime.getRuntime().halt(0);
+    }
+
+    /** trapExit
+        false if System.exit can't be trapped on this JVM */
+    @SuppressWarnings("removal")
+    static boolean trapExit() {
+        try {
+            System.setSecurityManager(new SecurityManager() {
+                    public void checkPermission(Permission p) {
+                    }
+                    public void checkPermission(Permission p, Object context) {
+                    }
+                    public void checkExit(int status) {
+                        if (null != current.get()) {
+                            throw new SessionExit(status);
+                        }
+                    }
+                });
+        } catch (UnsupportedOperationException | SecurityException e) {
+            return false;
+        }
+        return true;
+    }
+
+    public static void main(String[] argv) throws IOException {
+        Path sock = Paths.get(argv[0]);
+        Path dir = Paths.get(argv[1]).toAbsolutePath();
+        String cls = argv[2];
+
+        /* stdout is the server's "ready" pipe, the host's own output goes to stderr */
+        FileOutputStream ready = new FileOutputStream(FileDescriptor.out);
+        InputStream server = System.in;
+        System.setIn(new SessionIn(server));
+        PrintStream host = new PrintStream(new FileOutputStream(FileDescriptor.err), true);
+        System.setOut(new SessionPrint(host, false));
+        System.setErr(new SessionPrint(host, true));
+        if (!trapExit()) {
+            System.err.println("SessionHost: no security manager on this JVM, System.exit can't be trapped");
+            Runtime.getRuntime().halt(2);
+        }
+
+        Thread watch = new Thread(() -> watchServer(server, sock), "watch");
+        watch.setDaemon(true);
+        watch.start();
+
+        Files.deleteIfExists(sock);
+        ServerSocketChannel ss = ServerSocketChannel.open(StandardProtocolFamily.UNIX);
+        ss.bind(UnixDomainSocketAddress.of(sock));
+        ready.write("ready\n".getBytes(StandardCharsets.US_ASCII));
+        ready.close();
+        while (true) {
+            SocketChannel ch = ss.accept();
+            new Thread(() -> runSession(ch, dir, cls), "main").start();
+        }
+    }
+}
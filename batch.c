@@ -0,0 +1,504 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains batch grading (-B). Instead of serving
+ * clients, the program is run over every case in a manifest and
+ * each result is printed as soon as it is known, then a summary:
+ * throughput, and the wall and CPU time of the whole run.
+ *
+ * The manifest has one case a line, blank lines and lines that
+ * start with # are skipped:
+ *
+ *   NAME  STDIN  EXPECTED  [ARG ...]
+ *
+ * STDIN is the file the program reads (- for none), EXPECTED the
+ * file its stdout must match byte for byte (- to only run it).
+ * A case passes if the output matches and the program exits 0.
+ * stderr is discarded.
+ *
+ * The cases are run by -j worker threads (one per CPU by default),
+ * each starting the program with posix_spawn (the same file and
+ * argv as -s spawn) and waiting for it. Every worker starts with
+ * an even share of the cases in a deque of its own and takes them
+ * from the bottom. A worker that runs out steals from the top of
+ * another's, so a few slow cases don't leave the other CPUs idle.
+ * Nothing adds cases once the run starts, so a worker that finds
+ * every deque empty is done.
+ *
+ * With -K a case whose program, args and stdin are in the result
+ * cache (cache.c) isn't run, its output and exit status from
+ * then are checked instead, and every case that ran to the end
+ * is added to it.
+ *
+ */
+
+#define _GNU_SOURCE  /* pipe2 */
+#include "batch.h"
+
+static prog_t *g_batch_prog = NULL;
+static batch_case_t *g_batch_cases = NULL;
+static int g_batch_ncases = 0;
+static batch_worker_t *g_batch_workers = NULL;
+static int g_batch_nworkers = 0;
+static int g_batch_limit = BATCH_LIMIT;      /* seconds a case may run */
+static pthread_mutex_t g_batch_lock = PTHREAD_MUTEX_INITIALIZER; /* below, and stdout */
+static int g_batch_passed = 0;
+static int g_batch_failed = 0;
+static double g_batch_cpu = 0;               /* seconds, every case */
+static int g_batch_cache = 0;                /* -K, results are looked up first */
+
+/** _batch_secs
+    seconds from start to now */
+double _batch_secs (struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** _batch_slurp
+    all of path, malloc'd and '\0' terminated, its length in *len.
+    NULL if it can't be read */
+char *_batch_slurp (char *path, int *len) {
+  struct stat st;
+  char *buf;
+  int fd, n;
+  if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+    return NULL;
+  }
+  if (-1 == fstat(fd, &st) || NULL == (buf = (char *)malloc(st.st_size + 1))) {
+    close(fd);
+    return NULL;
+  }
+  *len = 0;
+  while (*len < st.st_size && 0 < (n = read(fd, buf + *len, st.st_size - *len))) {
+    *len += n;
+  }
+  close(fd);
+  buf[*len] = '\0';
+  return buf;
+}
+
+/** _batch_parse
+    split the manifest (text, changed in place) into cases.
+    Returns how many, -1 on a line that isn't a case */
+int _batch_parse (char *text, batch_case_t **cases) {
+  char *line, *next, *tok[MAX_A + 4];
+  int n = 0, cap = 0, lineno = 0, ntok;
+  batch_case_t *c;
+
+  *cases = NULL;
+  for (line = text; NULL != line && '\0' != *line; line = next) {
+    lineno++;
+    if (NULL != (next = strchr(line, '\n'))) {
+      *next++ = '\0';
+    }
+    ntok = 0;
+    for (tok[0] = strtok(line, " \t\r"); NULL != tok[ntok] && '#' != tok[0][0];
+	 tok[ntok] = strtok(NULL, " \t\r")) {
+      if (MAX_A + 4 == ++ntok) {
+	dprintf(STDERR_FILENO, "manifest line %d: more than %d args\n", lineno, MAX_A);
+	return -1;
+      }
+    }
+    if (0 == ntok) {
+      continue; /* blank, or a comment */
+    }
+    if (3 > ntok) {
+      dprintf(STDERR_FILENO, "manifest line %d: NAME STDIN EXPECTED [ARG ...]\n", lineno);
+      return -1;
+    }
+    if (n == cap) {
+      cap = cap ? 2 * cap : 64;
+      if (NULL == (c = (batch_case_t *)realloc(*cases, cap * sizeof(batch_case_t)))) {
+	return -1;
+      }
+      *cases = c;
+    }
+    c = &((*cases)[n++]);
+    c->name = tok[0];
+    c->in = (0 == strcmp(tok[1], "-")) ? NULL : tok[1];
+    c->expect = (0 == strcmp(tok[2], "-")) ? NULL : tok[2];
+    for (c->nargs = 0; c->nargs + 3 < ntok; c->nargs++) {
+      c->args[c->nargs] = tok[c->nargs + 3];
+    }
+    c->args[c->nargs] = NULL;
+  }
+  return n;
+}
+
+/** _batch_spawn
+    start file with argv for c, stdout on the pipe out.
+    Returns its pid, or -1 */
+pid_t _batch_spawn (batch_case_t *c, char *file, char **argv, int out) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t dflt, none;
+  pid_t pid = -1;
+  extern char **environ;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, (NULL != c->in) ? c->in : "/dev/null",
+				   O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+  posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  sigemptyset(&dflt);
+  sigaddset(&dflt, SIGPIPE);
+  sigemptyset(&none);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigdefault(&attr, &dflt);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+  if (0 != posix_spawnp(&pid, file, &fa, &attr, argv, environ)) {
+    pid = -1;
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  return pid;
+}
+
+/** _batch_collect
+    read pid's stdout from fd into *out (malloc'd, length in *len)
+    until it ends and pid exits, or the time limit. Returns 0, or
+    BATCH_SLOW or BATCH_LOUD if pid had to be killed (the time
+    limit, more than BATCH_OUTPUT) */
+int _batch_collect (pid_t pid, int fd, char **out, int *len, struct timespec *start) {
+  struct pollfd pfd[2];
+  siginfo_t info;
+  int pidfd, cap = 0, n, left, killed = 0, exited = 0;
+  char *buf;
+
+  *out = NULL;
+  *len = 0;
+  /* readable once pid has exited, so a program that closes its
+     stdout and goes on running still gets its time limit */
+#ifdef SYS_pidfd_open
+  pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  pidfd = -1;
+#endif
+  pfd[0].fd = fd;
+  pfd[1].fd = pidfd;
+  pfd[0].events = pfd[1].events = POLLIN;
+  while (-1 != pfd[0].fd || !exited) {
+    left = (int)((g_batch_limit - _batch_secs(start)) * 1000);
+    if (0 >= left) {
+      killed = BATCH_SLOW;
+      break;
+    }
+    if (-1 == pidfd && -1 == pfd[0].fd) {
+      /* no pidfd: look for the exit every BATCH_POLL ms (not
+         reaped, _batch_exec's wait4 wants its rusage) */
+      info.si_pid = 0;
+      if (-1 == waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) || 0 != info.si_pid) {
+	exited = 1;
+	continue;
+      }
+      if (BATCH_POLL < left) {
+	left = BATCH_POLL;
+      }
+    }
+    if (0 > poll(pfd, 2, left)) {
+      if (EINTR == errno) {
+	continue;
+      }
+      break;
+    }
+    if (0 != pfd[1].revents) {
+      pfd[1].fd = -1;
+      exited = 1;
+    }
+    if (0 == pfd[0].revents) {
+      continue;
+    }
+    if (cap - *len < BATCH_READ) {
+      cap = cap ? 2 * cap : BATCH_READ;
+      if (BATCH_OUTPUT < cap || NULL == (buf = (char *)realloc(*out, cap + 1))) {
+	killed = BATCH_LOUD;
+	break;
+      }
+      *out = buf;
+    }
+    n = read(fd, *out + *len, cap - *len);
+    if (0 >= n) {
+      pfd[0].fd = -1; /* its stdout is closed */
+    } else {
+      *len += n;
+    }
+  }
+  if (killed) {
+    kill(pid, SIGKILL);
+  }
+  if (-1 != pidfd) {
+    close(pidfd);
+  }
+  return killed;
+}
+
+/** _batch_compare
+    where out differs from the expected output, in words, or NULL
+    if it doesn't */
+char *_batch_compare (char *out, int len, char *expect, int elen, char *why, int size) {
+  int i, line = 1;
+  for (i = 0; i < len && i < elen && out[i] == expect[i]; i++) {
+    if ('\n' == out[i]) {
+      line++;
+    }
+  }
+  if (i == len && i == elen) {
+    return NULL;
+  }
+  if (i == len) {
+    snprintf(why, size, "output ends early, at line %d", line);
+  } else if (i == elen) {
+    snprintf(why, size, "more output than expected, from line %d", line);
+  } else {
+    snprintf(why, size, "output differs at line %d", line);
+  }
+  return why;
+}
+
+/** _batch_exec
+    run c (file with argv) to the end, its output in *out and
+    *len, how it ended in *status, *cpu and *killed (see
+    _batch_collect). Returns NULL, or why it couldn't be run */
+char *_batch_exec (batch_case_t *c, char *file, char **argv, char **out, int *len,
+		   int *status, double *cpu, int *killed, struct timespec *start) {
+  struct rusage ru;
+  int fds[2];
+  pid_t pid;
+  if (-1 == pipe2(fds, O_CLOEXEC)) {
+    return "no pipe";
+  }
+  /* the read end is close-on-exec, cases spawned by the other
+     workers mustn't hold it open */
+  pid = _batch_spawn(c, file, argv, fds[1]);
+  close(fds[1]);
+  if (0 < pid) {
+    *killed = _batch_collect(pid, fds[0], out, len, start);
+  }
+  close(fds[0]);
+  if (0 >= pid) {
+    return "unable to start the program";
+  }
+  if (-1 == wait4(pid, status, 0, &ru)) {
+    return "lost track of the program";
+  }
+  *cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+  return NULL;
+}
+
+/** _batch_case
+    run case number i (or, with -K, find how it went last time)
+    and print how it went */
+void _batch_case (int i) {
+  batch_case_t *c = &(g_batch_cases[i]);
+  struct timespec start;
+  char why[128], *out = NULL, *expect = NULL, *fail = NULL, *in = NULL, *file;
+  char **argv = NULL, **exec_argv = NULL;
+  int len = 0, elen = 0, inlen = 0, status = 0, killed = 0, cached = 0;
+  double wall, cpu = 0;
+  uint8_t key[32];
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (NULL != c->expect && NULL == (expect = _batch_slurp(c->expect, &elen))) {
+    snprintf(why, sizeof(why), "can't read %s", c->expect);
+    fail = why;
+  } else if (NULL != c->in && 0 != access(c->in, R_OK)) {
+    snprintf(why, sizeof(why), "can't read %s", c->in);
+    fail = why;
+  } else if (NULL == (argv = get_args_for_exec(g_batch_prog->name, g_batch_prog->interpreter,
+					       c->args, c->nargs))) {
+    fail = "out of memory";
+  } else if (g_batch_cache && NULL != c->in && NULL == (in = _batch_slurp(c->in, &inlen))) {
+    snprintf(why, sizeof(why), "can't read %s", c->in);
+    fail = why;
+  } else {
+    if (g_batch_cache) {
+      cache_key(key, argv, in, inlen);
+      cached = cache_get(key, &out, &len, &status);
+    }
+    if (!cached) {
+      exec_argv = argv;
+      file = exec_file(g_batch_prog->exec_fn, g_batch_prog->abs_path, &exec_argv);
+      fail = _batch_exec(c, file, exec_argv, &out, &len, &status, &cpu, &killed, &start);
+      if (NULL == fail && !killed && g_batch_cache) {
+	cache_put(key, out, len, status);
+      }
+      if (exec_argv != argv) {
+	free(exec_argv);
+      }
+    }
+  }
+  if (NULL != fail) {
+    /* it didn't run */
+  } else if (BATCH_LOUD == killed) {
+    snprintf(why, sizeof(why), "more than %dMB of output", BATCH_OUTPUT >> 20);
+    fail = why;
+  } else if (BATCH_SLOW == killed) {
+    snprintf(why, sizeof(why), "still running after %ds", g_batch_limit);
+    fail = why;
+  } else if (WIFSIGNALED(status)) {
+    snprintf(why, sizeof(why), "killed by signal %d", WTERMSIG(status));
+    fail = why;
+  } else if (NULL != expect) {
+    fail = _batch_compare(out, len, expect, elen, why, sizeof(why));
+  }
+  if (NULL == fail && 0 != WEXITSTATUS(status)) {
+    snprintf(why, sizeof(why), "exited with %d", WEXITSTATUS(status));
+    fail = why;
+  }
+  wall = _batch_secs(&start);
+
+  pthread_mutex_lock(&g_batch_lock);
+  if (NULL == fail) {
+    g_batch_passed++;
+    dprintf(STDOUT_FILENO, "PASS  %-24s %8.3fs wall %8.3fs cpu%s\n", c->name, wall, cpu,
+	    cached ? "  (cached)" : "");
+  } else {
+    g_batch_failed++;
+    dprintf(STDOUT_FILENO, "FAIL  %-24s %8.3fs wall %8.3fs cpu  %s%s\n", c->name, wall, cpu, fail,
+	    cached ? " (cached)" : "");
+  }
+  g_batch_cpu += cpu;
+  pthread_mutex_unlock(&g_batch_lock);
+  free(argv);
+  free(in);
+  free(out);
+  free(expect);
+}
+
+/** _batch_next
+    the next case for w: its own newest, or one stolen from the
+    oldest end of another worker's deque. -1 once there are none */
+int _batch_next (batch_worker_t *w) {
+  batch_deque_t *d = &(w->deque);
+  int job = -1, k;
+
+  pthread_mutex_lock(&(d->lock));
+  if (d->bottom > d->top) {
+    job = d->jobs[--(d->bottom)];
+  }
+  pthread_mutex_unlock(&(d->lock));
+  /* the victims are tried in turn from the next worker on, so
+     thieves don't all line up on the same one */
+  for (k = 1; -1 == job && k < g_batch_nworkers; k++) {
+    d = &(g_batch_workers[(w->id + k) % g_batch_nworkers].deque);
+    pthread_mutex_lock(&(d->lock));
+    if (d->bottom > d->top) {
+      job = d->jobs[(d->top)++];
+      w->stolen++;
+    }
+    pthread_mutex_unlock(&(d->lock));
+  }
+  return job;
+}
+
+/** _batch_worker
+    a worker thread, runs cases until there are none left */
+void *_batch_worker (void *arg) {
+  batch_worker_t *w = (batch_worker_t *)arg;
+  int job;
+  while (-1 != (job = _batch_next(w))) {
+    _batch_case(job);
+    w->ran++;
+  }
+  return NULL;
+}
+
+int batch_run (prog_t *prog, char *manifest, int jobs, int limit, char *cache) {
+  struct timespec start;
+  char *text, **argv, **exec_argv, *file;
+  int len, i, j, from, to, started, stolen = 0, hits, misses;
+  double wall;
+
+  if (NULL == (text = _batch_slurp(manifest, &len))) {
+    dprintf(STDERR_FILENO, "Unable to read the manifest %s\n", manifest);
+    return -1;
+  }
+  if (0 >= (g_batch_ncases = _batch_parse(text, &g_batch_cases))) {
+    dprintf(STDERR_FILENO, "No cases in %s\n", manifest);
+    free(text);
+    return -1;
+  }
+  if (0 >= jobs && 0 >= (jobs = (int)sysconf(_SC_NPROCESSORS_ONLN))) {
+    jobs = 1;
+  }
+  if (jobs > g_batch_ncases) {
+    jobs = g_batch_ncases;
+  }
+  g_batch_prog = prog;
+  if (NULL != cache && 0 == cache_open(cache, 0)) {
+    /* the program is hashed once, it is the same for every case */
+    argv = exec_argv = get_args_for_exec(prog->name, prog->interpreter, NULL, 0);
+    file = (NULL != argv) ? exec_file(prog->exec_fn, prog->abs_path, &exec_argv) : NULL;
+    g_batch_cache = (NULL != file && 0 == cache_program(prog->abs_path, file));
+    if (!g_batch_cache) {
+      dprintf(STDERR_FILENO, "Unable to read %s, not caching\n", prog->abs_path);
+    }
+    if (exec_argv != argv) {
+      free(exec_argv);
+    }
+    free(argv);
+  }
+  g_batch_limit = (0 < limit) ? limit : BATCH_LIMIT;
+  g_batch_nworkers = jobs;
+  g_batch_workers = (batch_worker_t *)calloc(jobs, sizeof(batch_worker_t));
+  if (NULL == g_batch_workers) {
+    free(g_batch_cases);
+    free(text);
+    return -1;
+  }
+
+  /* worker i gets the i'th slice, reversed so it takes them in
+     manifest order and thieves take its last ones */
+  for (i = 0; i < jobs; i++) {
+    batch_worker_t *w = &(g_batch_workers[i]);
+    from = (int)((long)g_batch_ncases * i / jobs);
+    to = (int)((long)g_batch_ncases * (i + 1) / jobs);
+    w->id = i;
+    w->deque.jobs = (int *)malloc((to - from) * sizeof(int));
+    pthread_mutex_init(&(w->deque.lock), NULL);
+    for (j = to - 1; NULL != w->deque.jobs && j >= from; j--) {
+      w->deque.jobs[w->deque.bottom++] = j;
+    }
+  }
+
+  dprintf(STDOUT_FILENO, "%d cases, %d workers\n", g_batch_ncases, jobs);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (started = 0; started < jobs; started++) {
+    if (0 != pthread_create(&(g_batch_workers[started].thread), NULL, _batch_worker,
+			    (void *)&(g_batch_workers[started]))) {
+      break; /* the ones running steal the rest */
+    }
+  }
+  if (0 == started) {
+    _batch_worker((void *)&(g_batch_workers[0]));
+  }
+  for (i = 0; i < jobs; i++) {
+    if (i < started) {
+      pthread_join(g_batch_workers[i].thread, NULL);
+    }
+    stolen += g_batch_workers[i].stolen;
+  }
+  wall = _batch_secs(&start);
+
+  dprintf(STDOUT_FILENO, "%d passed, %d failed in %.3fs: %.1f cases/s, %.3fs cpu (%.1fx), %d stolen\n",
+	  g_batch_passed, g_batch_failed, wall, g_batch_ncases / wall,
+	  g_batch_cpu, g_batch_cpu / wall, stolen);
+  if (NULL != cache) {
+    cache_close(&hits, &misses);
+  }
+  if (g_batch_cache) {
+    dprintf(STDOUT_FILENO, "%d from the cache, %d run\n", hits, misses);
+  }
+
+  for (i = 0; i < jobs; i++) {
+    pthread_mutex_destroy(&(g_batch_workers[i].deque.lock));
+    free(g_batch_workers[i].deque.jobs);
+  }
+  free(g_batch_workers);
+  free(g_batch_cases);
+  free(text);
+  return (0 == g_batch_failed && g_batch_passed == g_batch_ncases) ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "defs.h"
+#include "set_up.h"
+
+/* one test case from the manifest */
+typedef struct batch_case {
+  char *name;
+  char *in;                  /* file for its stdin, NULL = none */
+  char *expect;              /* file its stdout must match, NULL = don't check */
+  char *args[MAX_A + 1];
+  int nargs;
+} batch_case_t;
+
+/* a worker's share of the cases: it takes from the bottom,
+   idle workers steal from the top */
+typedef struct batch_deque {
+  pthread_mutex_t lock;
+  int *jobs;                 /* case numbers */
+  int top;
+  int bottom;
+} batch_deque_t;
+
+/* one worker thread */
+typedef struct batch_worker {
+  pthread_t thread;
+  int id;
+  batch_deque_t deque;
+  int ran;
+  int stolen;                /* cases taken from other workers */
+} batch_worker_t;
+
+/** batch_run
+    run prog over every case in manifest, jobs at a time (0 = one
+    per CPU), printing each result as it finishes and a summary.
+    A case still running after limit seconds (0 = BATCH_LIMIT)
+    is killed. With a cache file (-K, NULL = none) runs seen
+    before aren't repeated. Returns 0 if every case passed, 1 if
+    any failed, -1 if the manifest can't be read */
+int batch_run (prog_t *prog, char *manifest, int jobs, int limit, char *cache) ;
+
+#endif /* BATCH_H */
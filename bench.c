@@ -0,0 +1,516 @@
+/* -*- Mode: C -*- */
+/**
+ * A load generator for the server (make bench). For each example
+ * program (ex1.c, ex1.py, ex1.java) and each way of starting
+ * sessions it starts ./main on localhost, then runs many scripted
+ * clients at once: each answers the "arg N: " prompts (-a) and,
+ * once the program says something, the name prompt, and reads
+ * until the program ends. A session passed if the program greeted
+ * the name back.
+ *
+ * Reported per run: sessions completed per second, and the
+ * p50/p99/p999 of first output (connect to the program's first
+ * byte) and of the whole session (connect to EOF), in ms.
+ *
+ *    $ ./benchmark                         # everything that can run here
+ *    $ ./benchmark -r ex1.py -s zygote     # one program, one strategy
+ *    $ ./benchmark -n 5000 -c 1000 -a 0
+ *
+ * Parameters (-r and -s may be repeated)
+ *    [-r PROG]      example program (ex1.c, ex1.py and ex1.java by default)
+ *    [-s STRATEGY]  fork, spawn, vfork, pool, zygote (.py) or jvm (.java)
+ *                     (fork, spawn, vfork and pool by default)
+ *    [-n SESSIONS]  sessions per run (2000 by default)
+ *    [-c CONNS]     clients connected at once (500 by default)
+ *    [-a NUM_ARGS]  args answered per session (2 by default)
+ */
+
+#define _GNU_SOURCE  /* memmem */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "defs.h"
+
+#define BENCH_N        2000  /* sessions per run */
+#define BENCH_C         500  /* clients at once */
+#define BENCH_A           2  /* args answered */
+#define BENCH_OUT      4096  /* program output kept per client */
+#define BENCH_TIMEOUT    30  /* seconds a session may take */
+#define BENCH_START      20  /* seconds to wait for the server's port */
+#define BENCH_NAME  "bench"  /* answered at the name prompt */
+
+/* what a client is doing */
+#define CLI_FREE          0
+#define CLI_CONNECTING    1
+#define CLI_ARGS          2  /* answering "arg N: " prompts */
+#define CLI_RUNNING       3  /* talking to the program */
+
+/* one scripted client */
+typedef struct cli {
+  int fd;
+  int state;
+  int prompts;                 /* arg prompts answered */
+  int named;                   /* name sent */
+  int heard;                   /* the server has sent something (it accepted) */
+  struct timespec start;       /* connect() */
+  double first;                /* seconds to the program's first byte, -1 = none yet */
+  int len;
+  char out[BENCH_OUT];
+} cli_t;
+
+/* a way of starting sessions, and the server flags for it */
+typedef struct strategy {
+  char *name;
+  char *flags[3];
+  char *only;                  /* program extension it is for, NULL = any */
+} strategy_t;
+
+static strategy_t g_strategies[] = {
+  { "fork",   { NULL },                 NULL },
+  { "spawn",  { "-s", "spawn", NULL },  NULL },
+  { "vfork",  { "-s", "vfork", NULL },  NULL },
+  { "pool",   { "-P", "32", NULL },     NULL },   /* most of MAX_POOL */
+  { "zygote", { "-z", NULL },           ".py" },
+  { "jvm",    { "-J", NULL },           ".java" }
+};
+#define N_STRATEGIES (sizeof(g_strategies) / sizeof(strategy_t))
+
+/* the results of one run */
+typedef struct result {
+  int ok;
+  int failed;
+  double secs;
+  double *first;               /* per passing session */
+  double *done;
+} result_t;
+
+/** secs_since
+    seconds since start */
+double secs_since (struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** ends_with
+    1 if s ends with suffix */
+int ends_with (char *s, char *suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && 0 == strcmp(s + n - m, suffix);
+}
+
+/** runnable
+    can the server run prog here? Returns NULL if so,
+    otherwise why not */
+char *runnable (char *prog) {
+  char file[PATH_MAX];
+  struct stat st;
+  if (0 != stat(prog, &st)) {
+    return "missing";
+  }
+  if (ends_with(prog, ".c")) {
+    snprintf(file, sizeof(file), "%.*s", (int)strlen(prog) - 2, prog);
+    return (0 == access(file, X_OK)) ? NULL : "not compiled";
+  }
+  if (ends_with(prog, ".java")) {
+    snprintf(file, sizeof(file), "%.*s.class", (int)strlen(prog) - 5, prog);
+    if (0 != system("command -v java >/dev/null 2>&1")) {
+      return "no java";
+    }
+    return (0 == access(file, R_OK)) ? NULL : "not compiled (javac)";
+  }
+  return NULL;
+}
+
+/** start_server
+    ./main -r prog with the strategy's flags, its log going to
+    logname. Returns the server's pid, *port is where it listens */
+pid_t start_server (char *prog, strategy_t *s, int conns, int nargs, char *logname, int *port) {
+  char *argv[32];
+  char c[16], a[16], buf[4096], *at;
+  struct timespec start;
+  int i = 0, j, fd, len;
+  pid_t pid;
+
+  snprintf(c, sizeof(c), "%d", conns);
+  snprintf(a, sizeof(a), "%d", nargs);
+  argv[i++] = "./main";
+  argv[i++] = "-r";
+  argv[i++] = prog;
+  argv[i++] = "-c";
+  argv[i++] = c;
+  argv[i++] = "-w";
+  argv[i++] = "1024";
+  argv[i++] = "-q";
+  argv[i++] = "25";
+  argv[i++] = "-t";
+  argv[i++] = "30m";
+  if (0 < nargs) {
+    argv[i++] = "-a";
+    argv[i++] = a;
+  }
+  for (j = 0; NULL != s->flags[j]; j++) {
+    argv[i++] = s->flags[j];
+  }
+  argv[i] = NULL;
+
+  if (-1 == (fd = open(logname, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR))) {
+    return -1;
+  }
+  if (0 > (pid = fork())) {
+    close(fd);
+    return -1;
+  }
+  if (0 == pid) {
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    execv(argv[0], argv);
+    _exit(12);
+  }
+
+  /* wait for "PORT # connect to server with netcat" */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (BENCH_START > secs_since(&start)) {
+    len = pread(fd, buf, sizeof(buf)-1, 0);
+    buf[(0 < len) ? len : 0] = '\0';
+    if (NULL != (at = strstr(buf, " # connect"))) {
+      while (at > buf && ' ' != at[-1]) {
+	at--;
+      }
+      *port = atoi(at);
+      close(fd);
+      usleep(100000); /* let the zygote, pool or JVM come up */
+      return pid;
+    }
+    if (0 < waitpid(pid, NULL, WNOHANG)) {
+      break;
+    }
+    usleep(20000);
+  }
+  close(fd);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+/** stop_server
+    SIGALRM is the server's clean shutdown */
+void stop_server (pid_t pid) {
+  kill(pid, SIGALRM);
+  waitpid(pid, NULL, 0);
+}
+
+/** cli_start
+    connect a new client */
+int cli_start (int ep, cli_t *c, int port) {
+  struct sockaddr_in addr;
+  struct epoll_event ev;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (-1 == c->fd) {
+    return -1;
+  }
+  c->state = CLI_CONNECTING;
+  c->prompts = 0;
+  c->named = 0;
+  c->heard = 0;
+  c->first = -1;
+  c->len = 0;
+  clock_gettime(CLOCK_MONOTONIC, &(c->start));
+  if (-1 == connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) && EINPROGRESS != errno) {
+    close(c->fd);
+    return -1;
+  }
+  bzero(&ev, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.ptr = c;
+  if (-1 == epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev)) {
+    close(c->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/** cli_end
+    the session is over, record it. Passed if the
+    program greeted the name back */
+void cli_end (cli_t *c, result_t *r, int timed_out) {
+  if (!timed_out && c->named && NULL != memmem(c->out, c->len, BENCH_NAME, strlen(BENCH_NAME))) {
+    r->first[r->ok] = c->first;
+    r->done[r->ok] = secs_since(&(c->start));
+    r->ok++;
+  } else {
+    r->failed++;
+  }
+  close(c->fd);
+  c->state = CLI_FREE;
+}
+
+/** cli_send
+    scripted input, small enough for the socket buffer */
+void cli_send (cli_t *c, char *s) {
+  send(c->fd, s, strlen(s), MSG_NOSIGNAL);
+}
+
+/** cli_read
+    read what's there, answering prompts.
+    Returns -1 once the session is over */
+int cli_read (cli_t *c, int nargs) {
+  char buf[BENCH_OUT], line[32];
+  int bytes, i;
+  while (0 < (bytes = recv(c->fd, buf, sizeof(buf), 0))) {
+    c->heard = 1;
+    i = 0;
+    /* "arg N: \0" prompts from the server, one answer each */
+    for (; i < bytes && CLI_ARGS == c->state; i++) {
+      if ('\0' == buf[i]) {
+	c->prompts++;
+	snprintf(line, sizeof(line), "a%d\n", c->prompts);
+	cli_send(c, line);
+	if (c->prompts == nargs) {
+	  c->state = CLI_RUNNING;
+	}
+      }
+    }
+    if (i == bytes) {
+      continue;
+    }
+    /* the program */
+    if (0 > c->first) {
+      c->first = secs_since(&(c->start));
+    }
+    if (!c->named) {
+      cli_send(c, BENCH_NAME "\n");
+      c->named = 1;
+    }
+    bytes -= i;
+    if (bytes > BENCH_OUT - c->len) {
+      bytes = BENCH_OUT - c->len;
+    }
+    memcpy(c->out + c->len, buf + i, bytes);
+    c->len += bytes;
+  }
+  return (0 == bytes || (EAGAIN != errno && EINTR != errno)) ? -1 : 0;
+}
+
+/** run_clients
+    n sessions against port, conns at a time.
+    At most MAX_Q clients are left unanswered (connecting, or not
+    accepted yet): the server's listen queue is no bigger, and with
+    SYN cookies a handshake that overflows it can look complete to
+    the client while the server never sees it. Such a client would
+    wait for a prompt forever, as nc would */
+void run_clients (int port, int n, int conns, int nargs, result_t *r) {
+  struct epoll_event evs[EV_BATCH];
+  struct timespec start;
+  cli_t *clis = (cli_t *)calloc(conns, sizeof(cli_t));
+  cli_t *c;
+  int heard;
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  int started = 0, active = 0, unheard = 0, i, k, err;
+  socklen_t len;
+
+  if (NULL == clis || -1 == ep) {
+    dprintf(STDERR_FILENO, "Unable to run the clients\n");
+    r->failed = n;
+    free(clis);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (started < n || 0 < active) {
+    for (i = 0; i < conns && started < n && MAX_Q > unheard; i++) {
+      if (CLI_FREE == clis[i].state) {
+	started++;
+	if (-1 == cli_start(ep, &(clis[i]), port)) {
+	  r->failed++;
+	  continue;
+	}
+	active++;
+	unheard++;
+      }
+    }
+    k = epoll_wait(ep, evs, EV_BATCH, 100);
+    for (i = 0; i < k; i++) {
+      c = (cli_t *)evs[i].data.ptr;
+      if (CLI_CONNECTING == c->state) {
+	len = sizeof(err);
+	getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (0 != err) {
+	  cli_end(c, r, 0);
+	  active--;
+	  unheard--;
+	  continue;
+	}
+	evs[i].events = EPOLLIN;
+	epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &(evs[i]));
+	c->state = (0 < nargs) ? CLI_ARGS : CLI_RUNNING;
+      }
+      heard = c->heard;
+      if (-1 == cli_read(c, nargs)) {
+	unheard -= !c->heard;
+	cli_end(c, r, 0);
+	active--;
+      }
+      unheard -= (!heard && c->heard);
+    }
+    for (i = 0; i < conns; i++) {
+      if (CLI_FREE != clis[i].state && BENCH_TIMEOUT < secs_since(&(clis[i].start))) {
+	unheard -= !clis[i].heard;
+	cli_end(&(clis[i]), r, 1);
+	active--;
+      }
+    }
+  }
+  r->secs = secs_since(&start);
+  close(ep);
+  free(clis);
+}
+
+/** cmp_double
+    for qsort */
+int cmp_double (const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/** pct
+    the p'th percentile of sorted v, in ms */
+double pct (double *v, int n, double p) {
+  int i = (int)(p * n);
+  if (0 == n) {
+    return 0;
+  }
+  return 1000 * v[(i < n) ? i : n-1];
+}
+
+/** bench
+    one program, one strategy */
+void bench (char *prog, strategy_t *s, int n, int conns, int nargs) {
+  char logname[64];
+  result_t r;
+  pid_t pid;
+  int port = 0;
+
+  bzero(&r, sizeof(r));
+  snprintf(logname, sizeof(logname), "bench_server_log_%d", (int)getpid());
+  if (-1 == (pid = start_server(prog, s, conns, nargs, logname, &port))) {
+    dprintf(STDOUT_FILENO, "%-10s %-7s server didn't start, see %s\n", prog, s->name, logname);
+    return;
+  }
+  r.first = (double *)malloc(n * sizeof(double));
+  r.done = (double *)malloc(n * sizeof(double));
+  if (NULL != r.first && NULL != r.done) {
+    run_clients(port, n, conns, nargs, &r);
+  }
+  stop_server(pid);
+  qsort(r.first, r.ok, sizeof(double), cmp_double);
+  qsort(r.done, r.ok, sizeof(double), cmp_double);
+  dprintf(STDOUT_FILENO, "%-10s %-7s %6d %6d %8.1f   %7.2f %7.2f %7.2f   %7.2f %7.2f %7.2f\n",
+	  prog, s->name, r.ok, r.failed, r.ok / (r.secs ? r.secs : 1),
+	  pct(r.first, r.ok, .5), pct(r.first, r.ok, .99), pct(r.first, r.ok, .999),
+	  pct(r.done, r.ok, .5), pct(r.done, r.ok, .99), pct(r.done, r.ok, .999));
+  if (0 == r.failed) {
+    unlink(logname);
+  }
+  free(r.first);
+  free(r.done);
+}
+
+/** arg_int
+    -X N or -XN */
+int arg_int (char **argv, int *i, int argc, int min, int max, int dflt) {
+  char *s = ('\0' != argv[*i][2]) ? &(argv[*i][2]) : ((*i)+1 < argc ? argv[++(*i)] : "");
+  int val = atoi(s);
+  return (val < min || val > max) ? dflt : val;
+}
+
+int main (int argc, char **argv) {
+  char *progs[16];
+  strategy_t *strats[N_STRATEGIES];
+  char *why;
+  int nprogs = 0, nstrats = 0;
+  int n = BENCH_N, conns = BENCH_C, nargs = BENCH_A;
+  int i, j, k;
+  struct rlimit rl;
+
+  for (i = 1; i < argc; i++) {
+    if (0 == strncmp(argv[i], "-r", 2) && i+1 < argc && nprogs < 16) {
+      progs[nprogs++] = argv[++i];
+    } else if (0 == strncmp(argv[i], "-s", 2) && i+1 < argc) {
+      for (k = 0; k < N_STRATEGIES && 0 != strcmp(argv[i+1], g_strategies[k].name); k++)
+	;
+      if (k < N_STRATEGIES && nstrats < N_STRATEGIES) {
+	strats[nstrats++] = &(g_strategies[k]);
+      } else {
+	dprintf(STDERR_FILENO, "unknown strategy %s\n", argv[i+1]);
+      }
+      i++;
+    } else if (0 == strncmp(argv[i], "-n", 2)) {
+      n = arg_int(argv, &i, argc, 1, 1000000, BENCH_N);
+    } else if (0 == strncmp(argv[i], "-c", 2)) {
+      conns = arg_int(argv, &i, argc, 1, MAX_C, BENCH_C);
+    } else if (0 == strncmp(argv[i], "-a", 2)) {
+      nargs = arg_int(argv, &i, argc, MIN_A, MAX_A, BENCH_A);
+    } else {
+      dprintf(STDERR_FILENO, "Usage: ./benchmark [-r PROG]... [-s STRATEGY]... [-n SESSIONS] [-c CONNS] [-a NUMARGS]\n");
+      return 1;
+    }
+  }
+  if (0 == nprogs) {
+    progs[nprogs++] = "ex1.c";
+    progs[nprogs++] = "ex1.py";
+    progs[nprogs++] = "ex1.java";
+  }
+  if (0 == nstrats) {
+    for (k = 0; k < 4; k++) {
+      strats[nstrats++] = &(g_strategies[k]);
+    }
+  }
+
+  /* a client is one fd here, and one (briefly) in the server */
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  if (conns + 64 > rl.rlim_cur) {
+    conns = rl.rlim_cur - 64;
+    dprintf(STDERR_FILENO, "only %d clients at once, the fd limit is %d\n", conns, (int)rl.rlim_cur);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  dprintf(STDOUT_FILENO, "%d sessions, %d at once, %d args\n", n, conns, nargs);
+  dprintf(STDOUT_FILENO, "%-10s %-7s %6s %6s %8s   %-23s   %-23s\n",
+	  "program", "start", "ok", "failed", "sess/s",
+	  "first byte p50/p99/p999", "session p50/p99/p999 ms");
+  for (i = 0; i < nprogs; i++) {
+    if (NULL != (why = runnable(progs[i]))) {
+      dprintf(STDOUT_FILENO, "%-10s skipped (%s)\n", progs[i], why);
+      continue;
+    }
+    for (j = 0; j < nstrats; j++) {
+      if (NULL == strats[j]->only || ends_with(progs[i], strats[j]->only)) {
+	bench(progs[i], strats[j], n, conns, nargs);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,326 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the result cache (-K) for batch grading.
+ * The same program is often run over the same cases again and
+ * again (a re-run after a typo in one test, a demo). A run whose
+ * program, argv and stdin have all been seen before is given the
+ * output and exit status it had then, without starting anything.
+ *
+ * The key is a SHA-256 of the program's file (the source, or the
+ * binary for C; not what it imports), the file that is exec'd,
+ * the argv get_args_for_exec builds, and the whole stdin. A
+ * program that isn't deterministic (time, randomness) shouldn't
+ * be cached.
+ *
+ * The cache is one file, mapped shared, so it outlives the server
+ * and any number of runs can use it at once (flock, and a mutex
+ * for the -j threads of one run). After the header is a table of
+ * slots (open addressing, a key looks at CACHE_PROBE slots from
+ * its home and no further), then a log the outputs are appended
+ * to, wrapping at the end. An output the log has since wrapped
+ * over is gone, its slot is simply reused; when a key's slots
+ * are all taken the oldest is. So the file never grows, and the
+ * most recent results are the ones kept.
+ *
+ */
+
+#include "cache.h"
+
+#define CACHE_MAGIC "TACACHE1"
+
+static int g_cache_fd = -1;
+static cache_head_t *g_cache = NULL;       /* the mapped file */
+static cache_slot_t *g_cache_slots = NULL;
+static char *g_cache_log = NULL;
+static uint8_t g_cache_prog[32];           /* digest of the program and its file */
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_cache_hits = 0;               /* this run */
+static int g_cache_misses = 0;
+
+/* SHA-256 (FIPS 180-4) */
+typedef struct sha256 {
+  uint32_t h[8];
+  uint8_t buf[64];
+  uint64_t len;
+} sha256_t;
+
+static const uint32_t g_sha_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/** _sha_init */
+void _sha_init (sha256_t *s) {
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(s->h, h0, sizeof(h0));
+  s->len = 0;
+}
+
+/** _sha_block
+    one 64 byte block */
+void _sha_block (sha256_t *s, const uint8_t *p) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) |
+      ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+  }
+  for (; i < 64; i++) {
+    w[i] = w[i-16] + (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+      w[i-7] + (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10));
+  }
+  a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+  e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+  for (i = 0; i < 64; i++) {
+    t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + g_sha_k[i] + w[i];
+    t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+  s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+/** _sha_update */
+void _sha_update (sha256_t *s, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  size_t fill = s->len % 64, n;
+  s->len += len;
+  while (0 < len) {
+    n = (64 - fill < len) ? 64 - fill : len;
+    memcpy(s->buf + fill, p, n);
+    fill += n;
+    p += n;
+    len -= n;
+    if (64 == fill) {
+      _sha_block(s, s->buf);
+      fill = 0;
+    }
+  }
+}
+
+/** _sha_final
+    the digest, 32 bytes */
+void _sha_final (sha256_t *s, uint8_t *out) {
+  uint64_t bits = s->len * 8;
+  uint8_t pad = 0x80, zero = 0, len[8];
+  int i;
+  _sha_update(s, &pad, 1);
+  while (56 != s->len % 64) {
+    _sha_update(s, &zero, 1);
+  }
+  for (i = 0; i < 8; i++) {
+    len[i] = (uint8_t)(bits >> (56 - 8*i));
+  }
+  _sha_update(s, len, 8);
+  for (i = 0; i < 32; i++) {
+    out[i] = (uint8_t)(s->h[i/4] >> (24 - 8*(i%4)));
+  }
+}
+
+/** _cache_hash_file
+    add the contents of path to s. Returns -1 if it can't be read */
+int _cache_hash_file (sha256_t *s, char *path) {
+  char buf[CACHE_READ];
+  int fd, n;
+  if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+    return -1;
+  }
+  while (0 < (n = read(fd, buf, sizeof(buf)))) {
+    _sha_update(s, buf, n);
+  }
+  close(fd);
+  return (0 > n) ? -1 : 0;
+}
+
+/** _cache_lock, _cache_unlock
+    the other threads of this run, and other runs */
+void _cache_lock () {
+  pthread_mutex_lock(&g_cache_lock);
+  flock(g_cache_fd, LOCK_EX);
+}
+void _cache_unlock () {
+  flock(g_cache_fd, LOCK_UN);
+  pthread_mutex_unlock(&g_cache_lock);
+}
+
+/** _cache_live
+    slot's output is still in the log */
+int _cache_live (cache_slot_t *slot) {
+  static const uint8_t empty[32];
+  return 0 != memcmp(slot->key, empty, 32) &&
+    slot->off + g_cache->data_size >= g_cache->head;
+}
+
+/** _cache_home
+    the first slot key may be in */
+uint64_t _cache_home (uint8_t *key) {
+  uint64_t h = 0;
+  memcpy(&h, key, sizeof(h));
+  return h % g_cache->nslots;
+}
+
+int cache_open (char *path, int mb) {
+  uint64_t size = (uint64_t)((0 < mb) ? mb : CACHE_MB) << 20;
+  uint64_t nslots;
+  cache_head_t head;
+  struct stat st;
+  void *map;
+
+  if (-1 == (g_cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600))) {
+    dprintf(STDERR_FILENO, "Unable to open the cache %s\n", path);
+    return -1;
+  }
+  flock(g_cache_fd, LOCK_EX);
+  if (sizeof(head) == pread(g_cache_fd, &head, sizeof(head), 0) &&
+      0 == memcmp(head.magic, CACHE_MAGIC, 8) && 0 < head.size) {
+    /* a cache keeps the size it was made with, another run may
+       have it mapped */
+    size = head.size;
+  } else if (0 == fstat(g_cache_fd, &st) && 0 < st.st_size) {
+    dprintf(STDERR_FILENO, "%s isn't a cache, not using it\n", path);
+    flock(g_cache_fd, LOCK_UN);
+    close(g_cache_fd);
+    g_cache_fd = -1;
+    return -1;
+  }
+  nslots = size / CACHE_SLOT_BYTES;
+  if (-1 == fstat(g_cache_fd, &st) ||
+      ((uint64_t)st.st_size != size && -1 == ftruncate(g_cache_fd, size)) ||
+      MAP_FAILED == (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, g_cache_fd, 0))) {
+    dprintf(STDERR_FILENO, "Unable to map the cache %s\n", path);
+    flock(g_cache_fd, LOCK_UN);
+    close(g_cache_fd);
+    g_cache_fd = -1;
+    return -1;
+  }
+  g_cache = (cache_head_t *)map;
+  if (0 != memcmp(g_cache->magic, CACHE_MAGIC, 8) || size != g_cache->size) {
+    /* new */
+    bzero(map, sizeof(cache_head_t) + nslots * sizeof(cache_slot_t));
+    g_cache->size = size;
+    g_cache->nslots = nslots;
+    g_cache->data_size = size - sizeof(cache_head_t) - nslots * sizeof(cache_slot_t);
+    g_cache->head = 0;
+    memcpy(g_cache->magic, CACHE_MAGIC, 8);
+  }
+  g_cache_slots = (cache_slot_t *)(g_cache + 1);
+  g_cache_log = (char *)(g_cache_slots + g_cache->nslots);
+  flock(g_cache_fd, LOCK_UN);
+  return 0;
+}
+
+int cache_program (char *path, char *file) {
+  char class[PATH_MAX];
+  sha256_t s;
+  _sha_init(&s);
+  snprintf(class, sizeof(class), "%s.class", path);
+  if (-1 == _cache_hash_file(&s, path) && -1 == _cache_hash_file(&s, class)) {
+    return -1;
+  }
+  _sha_update(&s, file, strlen(file) + 1);
+  _sha_final(&s, g_cache_prog);
+  return 0;
+}
+
+void cache_key (uint8_t *key, char **argv, char *in, int len) {
+  sha256_t s;
+  uint32_t n = 0;
+  int i;
+  _sha_init(&s);
+  _sha_update(&s, g_cache_prog, sizeof(g_cache_prog));
+  for (i = 0; NULL != argv[i]; i++) {
+    _sha_update(&s, argv[i], strlen(argv[i]) + 1);
+  }
+  n = (uint32_t)i; /* so argv and stdin can't run into each other */
+  _sha_update(&s, &n, sizeof(n));
+  _sha_update(&s, in, len);
+  _sha_final(&s, key);
+  key[0] |= 1; /* never all zeros, that's an empty slot */
+}
+
+int cache_get (uint8_t *key, char **out, int *len, int *status) {
+  cache_slot_t *slot;
+  uint64_t i, home;
+  int hit = 0;
+  if (NULL == g_cache) {
+    return 0;
+  }
+  _cache_lock();
+  home = _cache_home(key);
+  for (i = 0; i < CACHE_PROBE; i++) {
+    slot = &(g_cache_slots[(home + i) % g_cache->nslots]);
+    if (0 == memcmp(slot->key, key, 32) && _cache_live(slot) &&
+	NULL != (*out = (char *)malloc(slot->len + 1))) {
+      memcpy(*out, g_cache_log + slot->off % g_cache->data_size, slot->len);
+      *len = slot->len;
+      *status = slot->status;
+      hit = 1;
+      break;
+    }
+  }
+  if (hit) {
+    g_cache->hits++;
+    g_cache_hits++;
+  } else {
+    g_cache->misses++;
+    g_cache_misses++;
+  }
+  _cache_unlock();
+  return hit;
+}
+
+void cache_put (uint8_t *key, char *out, int len, int status) {
+  cache_slot_t *slot, *victim = NULL;
+  uint64_t i, home, at;
+  if (NULL == g_cache || (uint64_t)len > g_cache->data_size / 4) {
+    return;
+  }
+  _cache_lock();
+  home = _cache_home(key);
+  for (i = 0; i < CACHE_PROBE; i++) {
+    slot = &(g_cache_slots[(home + i) % g_cache->nslots]);
+    if (0 == memcmp(slot->key, key, 32) || !_cache_live(slot)) {
+      victim = slot; /* its own old slot, or a free one */
+      break;
+    }
+    if (NULL == victim || slot->off < victim->off) {
+      victim = slot;
+    }
+  }
+  /* an output never wraps, it starts over at the front instead */
+  at = g_cache->head;
+  if (at % g_cache->data_size + len > g_cache->data_size) {
+    at += g_cache->data_size - at % g_cache->data_size;
+  }
+  memcpy(g_cache_log + at % g_cache->data_size, out, len);
+  g_cache->head = at + len;
+  memcpy(victim->key, key, 32);
+  victim->off = at;
+  victim->len = len;
+  victim->status = status;
+  _cache_unlock();
+}
+
+void cache_close (int *hits, int *misses) {
+  *hits = g_cache_hits;
+  *misses = g_cache_misses;
+  if (NULL != g_cache) {
+    munmap(g_cache, g_cache->size);
+    g_cache = NULL;
+  }
+  if (-1 != g_cache_fd) {
+    close(g_cache_fd);
+    g_cache_fd = -1;
+  }
+}
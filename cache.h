@@ -0,0 +1,66 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* the start of the cache file */
+typedef struct cache_head {
+  char magic[8];             /* CACHE_MAGIC */
+  uint64_t size;             /* of the whole file */
+  uint64_t nslots;
+  uint64_t data_size;        /* the output log */
+  uint64_t head;             /* where the next output goes, counting from
+				the first one ever written (not wrapped) */
+  uint64_t hits;
+  uint64_t misses;
+} cache_head_t;
+
+/* one run's result, 48 bytes */
+typedef struct cache_slot {
+  uint8_t key[32];           /* SHA-256, zero = empty */
+  uint64_t off;              /* its output in the log, like head */
+  uint32_t len;
+  int32_t status;            /* wait status */
+} cache_slot_t;
+
+/** cache_open
+    use (or make) the cache file at path, mb MB in all
+    (0 = CACHE_MB). A cache that is already there keeps its
+    size. Returns -1 if it can't be used (or path is some
+    other file, it is left alone) */
+int cache_open (char *path, int mb) ;
+/** cache_program
+    the program the keys are for: its file (path, or path.class
+    for java, whose path has no extension) is hashed, with file,
+    what is exec'd. Returns -1 if neither can be read */
+int cache_program (char *path, char *file) ;
+/** cache_key
+    the key (32 bytes) for a run of the program with argv and
+    all of its stdin in in */
+void cache_key (uint8_t *key, char **argv, char *in, int len) ;
+/** cache_get
+    the output (malloc'd, *len bytes) and wait status of the run
+    with key. Returns 1 if it is cached, 0 if not */
+int cache_get (uint8_t *key, char **out, int *len, int *status) ;
+/** cache_put
+    remember a run. Output over a quarter of the log isn't kept */
+void cache_put (uint8_t *key, char *out, int len, int status) ;
+/** cache_close
+    unmap the file, returns the hits and misses of this run */
+void cache_close (int *hits, int *misses) ;
+
+#endif /* CACHE_H */
@@ -0,0 +1,269 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the AppCDS (class data sharing) support for
+ * .java programs. At startup, and whenever the .class files change,
+ * a background build packs the classes into a jar (CDS skips classes
+ * loaded from directories) and does one training run of the program
+ * with -XX:ArchiveClassesAtExit. Once the archive exists every exec
+ * of java uses it with -XX:SharedArchiveFile, which cuts JVM startup
+ * and lets the sessions share the archived classes' memory.
+ *
+ * Each build is named after a hash of the .class files' names, sizes
+ * and mtimes (to the nanosecond), so a class recompiled within the
+ * same second, or removed, still means a new build, and a session
+ * never sees a half written jar or archive. The classes are hashed
+ * before every session, a session started after they change runs
+ * them from the directory until their archive is built. If java
+ * can't make an archive, the program is exec'd exactly as before.
+ *
+ */
+
+#include "cds.h"
+#include "evloop.h"
+#include "logger.h"
+
+static cds_t *g_cds = NULL; /* used by cds_java_argv in the child, one per program */
+
+/** _cds_fnv
+    FNV-1a of len bytes at p, continuing from h */
+uint64_t _cds_fnv (uint64_t h, void *p, int len) {
+  unsigned char *b = (unsigned char *)p;
+  while (0 < len--) {
+    h = (h ^ *b++) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/** _cds_classes
+    hash of the names, sizes and mtimes of the .class files in
+    dir, 0 if there are none. Each file's hash is summed, so the
+    order readdir returns them in doesn't matter */
+uint64_t _cds_classes (char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  struct stat st;
+  uint64_t h, sum = 0;
+  int64_t v[3];
+  int len, n = 0;
+  if (NULL == d) {
+    return 0;
+  }
+  while (NULL != (ent = readdir(d))) {
+    len = strlen(ent->d_name);
+    if (6 < len && 0 == strcmp(&(ent->d_name[len-6]), ".class") &&
+	0 == fstatat(dirfd(d), ent->d_name, &st, 0)) {
+      v[0] = st.st_size;
+      v[1] = st.st_mtim.tv_sec;
+      v[2] = st.st_mtim.tv_nsec;
+      h = _cds_fnv(14695981039346656037ULL, ent->d_name, len+1);
+      sum += _cds_fnv(h, v, sizeof(v));
+      n++;
+    }
+  }
+  closedir(d);
+  return (0 == n) ? 0 : (0 == sum) ? 1 : sum; /* 0 is "none" */
+}
+
+/** _cds_paths
+    jar and archive names for generation gen.
+    returns -1 if they don't fit */
+int _cds_paths (cds_t *c, uint64_t gen, char *jar, char *jsa) {
+  if (PATH_MAX <= snprintf(jar, PATH_MAX, "%s/%s-%016llx.jar", c->cache, c->cls,
+			   (unsigned long long)gen) ||
+      PATH_MAX <= snprintf(jsa, PATH_MAX, "%s/%s-%016llx.jsa", c->cache, c->cls,
+			   (unsigned long long)gen)) {
+    return -1;
+  }
+  return 0;
+}
+
+/** _cds_run
+    run argv with stdin/stdout/stderr on /dev/null, wait for it.
+    It is killed after CDS_TRAIN_SECS */
+int _cds_run (char **argv) {
+  int status = -1;
+  pid_t chid = fork ();
+  if (0 > chid) {
+    return -1;
+  }
+  if (0 == chid) {
+    int fd = open("/dev/null", O_RDWR);
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    alarm(CDS_TRAIN_SECS);
+    execvp(argv[0], argv);
+    _exit(12);
+  }
+  waitpid(chid, &status, 0);
+  return status;
+}
+
+/** _cds_build
+    runs in the background build process.
+    jar the classes, then a training run to dump the archive */
+void _cds_build (cds_t *c, uint64_t gen) {
+  char jar[PATH_MAX], jsa[PATH_MAX];
+  char tmp[PATH_MAX+24], opt[PATH_MAX+48];
+  char *argv[3 + 3*CDS_MAX_CLASSES + 1];
+  char names[CDS_MAX_CLASSES][NAME_MAX+1];
+  struct dirent *ent;
+  int n = 0, k = 0, len, keep;
+  DIR *d;
+
+  if (-1 == _cds_paths(c, gen, jar, jsa)) {
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", jar, (int)getpid()); /* -n acceptors may build too */
+
+  /* jar cf TMP -C DIR a.class -C DIR b.class ... */
+  if (NULL == (d = opendir(c->dir))) {
+    return;
+  }
+  argv[n++] = "jar";
+  argv[n++] = "cf";
+  argv[n++] = tmp;
+  while (NULL != (ent = readdir(d)) && k < CDS_MAX_CLASSES) {
+    len = strlen(ent->d_name);
+    if (6 < len && 0 == strcmp(&(ent->d_name[len-6]), ".class")) {
+      strncpy(names[k], ent->d_name, NAME_MAX);
+      names[k][NAME_MAX] = '\0';
+      argv[n++] = "-C";
+      argv[n++] = c->dir;
+      argv[n++] = names[k++];
+    }
+  }
+  closedir(d);
+  argv[n] = NULL;
+  if (0 == k || 0 != _cds_run(argv) || -1 == rename(tmp, jar)) {
+    unlink(tmp);
+    return;
+  }
+
+  /* java -XX:ArchiveClassesAtExit=TMP -cp JAR CLASS, with no input */
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", jsa, (int)getpid());
+  if (sizeof(opt) <= snprintf(opt, sizeof(opt), "-XX:ArchiveClassesAtExit=%s", tmp)) {
+    return;
+  }
+  char *train[] = { "java", opt, "-Xlog:disable", "-cp", jar, c->cls, NULL };
+  _cds_run(train);
+  if (-1 == rename(tmp, jsa)) {
+    unlink(tmp);
+    unlink(jar);
+    return;
+  }
+
+  /* remove older builds */
+  if (NULL == (d = opendir(c->cache))) {
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s-%016llx.", c->cls, (unsigned long long)gen);
+  len = strlen(c->cls);
+  while (NULL != (ent = readdir(d))) {
+    keep = 0 != strncmp(ent->d_name, c->cls, len) || '-' != ent->d_name[len] ||
+      0 == strncmp(ent->d_name, tmp, strlen(tmp));
+    if (!keep) {
+      unlinkat(dirfd(d), ent->d_name, 0);
+    }
+  }
+  closedir(d);
+}
+
+/** _cds_start_build
+    double fork, so the build never looks like a session ending */
+void _cds_start_build (cds_t *c, uint64_t gen) {
+  int status;
+  pid_t chid = fork ();
+  if (0 > chid) {
+    return;
+  }
+  if (0 == chid) {
+    if (0 != fork ()) {
+      _exit(0);
+    }
+    ev_child_reset();
+    _cds_build(c, gen);
+    _exit(0);
+  }
+  waitpid(chid, &status, 0);
+}
+
+cds_t *cds_create (char *abs_path) {
+  cds_t *c = (cds_t *)calloc(1, sizeof(cds_t));
+  char *slash;
+  if (NULL == c) {
+    return NULL;
+  }
+  strncpy(c->dir, abs_path, sizeof(c->dir)-1);
+  if (NULL == (slash = strrchr(c->dir, '/'))) {
+    free(c);
+    return NULL;
+  }
+  *slash = '\0';
+  strncpy(c->cls, slash+1, sizeof(c->cls)-1);
+  if (sizeof(c->cache) <= snprintf(c->cache, sizeof(c->cache), "%s/.ta_cds", c->dir) ||
+      (-1 == mkdir(c->cache, S_IRWXU) && EEXIST != errno)) {
+    log_msg("Unable to create %s, not using CDS", c->cache);
+    free(c);
+    return NULL;
+  }
+  c->next = g_cds;
+  g_cds = c;
+  cds_refresh(c);
+  return c;
+}
+
+void cds_refresh (cds_t *c) {
+  time_t now = time(NULL);
+  uint64_t gen = _cds_classes(c->dir);
+  struct stat st;
+  if (gen != c->gen) {
+    /* new classes (or the first look): this session runs them
+       from the directory until there is an archive for them */
+    c->gen = gen;
+    c->ready = 0;
+    if (0 != gen && -1 == _cds_paths(c, gen, c->jar, c->jsa)) {
+      c->gen = gen = 0;
+    }
+  }
+  if (c->ready || 0 == gen) {
+    return;
+  }
+  c->ready = (0 == stat(c->jsa, &st) && 0 == stat(c->jar, &st));
+  if (!c->ready && gen != c->building && CDS_BUILD_SECS <= now - c->started) {
+    /* a recompile writes the classes one by one, at most one build
+       is started every CDS_BUILD_SECS, for the classes as they are then */
+    c->building = gen;
+    c->started = now;
+    _cds_start_build(c, gen);
+  }
+}
+
+char **cds_java_argv (char **argv) {
+  static char opt[PATH_MAX+32];
+  char **cds_argv;
+  cds_t *c;
+  int n = 0, i = 0;
+  while (NULL != argv[n]) {
+    n++;
+  }
+  /* argv[0] is "-m", argv[1] the class, then the client's args */
+  for (c = g_cds; 2 <= n && NULL != c && 0 != strcmp(c->cls, argv[1]); c = c->next)
+    ;
+  if (2 > n || NULL == c || !c->ready ||
+      NULL == (cds_argv = (char **)malloc((n+6)*sizeof(char *)))) {
+    return argv;
+  }
+  snprintf(opt, sizeof(opt), "-XX:SharedArchiveFile=%s", c->jsa);
+  cds_argv[i++] = argv[0];
+  cds_argv[i++] = opt;
+  cds_argv[i++] = "-Xshare:auto";
+  cds_argv[i++] = "-Xlog:cds*=off"; /* a stale archive is skipped quietly */
+  cds_argv[i++] = "-cp";
+  cds_argv[i++] = c->jar;
+  for (n = 1; NULL != argv[n]; n++) {
+    cds_argv[i++] = argv[n];
+  }
+  cds_argv[i] = NULL;
+  return cds_argv;
+}
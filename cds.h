@@ -0,0 +1,52 @@
+#ifndef CDS_H
+#define CDS_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* AppCDS archive for a .java program run fork-per-client */
+typedef struct cds {
+  char dir[PATH_MAX];    /* where the .class files are */
+  char cls[NAME_MAX+1];  /* main class */
+  char cache[PATH_MAX];  /* DIR/.ta_cds, the jar and archive go here */
+  char jar[PATH_MAX];    /* the classes, CDS only archives classes from jars */
+  char jsa[PATH_MAX];    /* the archive */
+  uint64_t gen;          /* hash of the .class files the archive is for (0 = none) */
+  uint64_t building;     /* the gen a build was last started for */
+  time_t started;        /* when it was started */
+  int ready;             /* jar and jsa exist for gen */
+  struct cds *next;      /* another program's (-C) */
+} cds_t;
+
+/** cds_create
+    set up the archive for the program at abs_path (DIR/CLASS)
+    and start the first training run in the background */
+cds_t *cds_create (char *abs_path) ;
+/** cds_refresh
+    called before each spawn. Looks at the .class files (one
+    readdir): if they changed the archive isn't used until one is
+    built for them, a build is started (at most one every
+    CDS_BUILD_SECS), and it notices when a build has finished */
+void cds_refresh (cds_t *c) ;
+/** cds_java_argv
+    the argv for execvp("java", ...). If the archive for the
+    class in argv[1] is ready
+    the options to use it are added (and -cp the jar),
+    otherwise argv is returned as is */
+char **cds_java_argv (char **argv) ;
+
+#endif /* CDS_H */
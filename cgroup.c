@@ -0,0 +1,404 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the per-session resource limits (-g).
+ * One student's infinite loop or runaway malloc used to slow
+ * down every other session on the machine. Now each session
+ * gets a cgroup v2 leaf of its own, ta_PID/s_ACCEPTOR_N under
+ * the server's cgroup, with cpu.max, memory.max and pids.max
+ * set, so the CPU is shared fairly and a blowup only kills
+ * itself. The leaf is made before the session's process starts,
+ * and the process moves into it before it execs (a fork bomb in
+ * its first milliseconds is still counted). When the session ends what it
+ * used is read back from the leaf (cpu.stat, memory.peak) into
+ * the log and the metrics, and the leaf is removed, taking
+ * anything the program left running with it (cgroup.kill is
+ * asynchronous, the rmdir is retried from the timer wheel until
+ * the leaf is empty).
+ *
+ * The cgroup rules: a cgroup with processes can't hand its
+ * controllers down, so if the server's own cgroup won't enable
+ * them the server moves into a leaf of its own (ta_PID_srv)
+ * first, and moves back at exit. Without cgroup v2, or without a controller, the limit
+ * falls back to what a single process can be given: RLIMIT_AS
+ * for memory, a lower priority for CPU, nothing for pids.
+ *
+ */
+
+#define _GNU_SOURCE  /* prlimit */
+#include "cgroup.h"
+#include "logger.h"
+#include "metrics.h"
+
+#define CG_CPU 0
+#define CG_MEMORY 1
+#define CG_PIDS 2
+#define CG_NCTL 3
+
+#define CG_PATH (PATH_MAX + NAME_MAX + 2) /* g_cg_dir/leaf */
+
+static const char *g_cg_ctl[CG_NCTL] = { "cpu", "memory", "pids" };
+
+static limits_t g_cg_lim;                /* -g, zeroed = no limits */
+static int g_cg_on = 0;                  /* cgroup_init was called */
+static int g_cg_use = 0;                 /* controllers enabled for the leaves, 1 << CG_ */
+static char g_cg_dir[PATH_MAX];          /* .../ta_PID, "" = no cgroup v2 */
+static char g_cg_self[PATH_MAX - 32];    /* the server's own cgroup */
+static char g_cg_srv[CG_PATH];           /* ta_PID_srv if the server moved there, else "" */
+static int g_cg_moved = 0;               /* controllers its cgroup was given after the move */
+static unsigned int g_cg_seq = 0;        /* leaves made by this acceptor */
+static cgleaf_t *g_cg_pids[CG_HASH];     /* leaves of the running sessions, by pid */
+
+/** _cg_write
+    write str to the file dir/name. Returns -1 (errno set) if it fails */
+int _cg_write (char *dir, char *name, char *str) {
+  char path[CG_PATH];
+  int fd, len = strlen(str), saved;
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (0 > (fd = open(path, O_WRONLY | O_CLOEXEC))) {
+    return -1;
+  }
+  if (len != write(fd, str, len)) {
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/** _cg_read
+    the file dir/name into buf (NUL terminated). Returns -1 if it can't */
+int _cg_read (char *dir, char *name, char *buf, int len) {
+  char path[CG_PATH];
+  int fd, bytes;
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (0 > (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+    return -1;
+  }
+  bytes = read(fd, buf, len-1);
+  close(fd);
+  if (0 > bytes) {
+    return -1;
+  }
+  buf[bytes] = '\0';
+  return 0;
+}
+
+/** _cg_key
+    the number after "key " in a flat keyed file's text, 0 if it isn't there */
+uint64_t _cg_key (char *text, char *key) {
+  int len = strlen(key);
+  char *line;
+  for (line = text; NULL != line && '\0' != *line; line = strchr(line, '\n')) {
+    if ('\n' == *line) {
+      line++;
+    }
+    if (0 == strncmp(line, key, len) && ' ' == line[len]) {
+      return strtoull(line+len+1, NULL, 10);
+    }
+  }
+  return 0;
+}
+
+/** _cg_self
+    the directory of the server's cgroup v2 (mount point plus the
+    "0::" line of /proc/self/cgroup) into dir. Returns -1 if there isn't one */
+int _cg_self (char *dir, int len) {
+  char line[PATH_MAX], mnt[PATH_MAX], path[PATH_MAX];
+  FILE *f;
+  mnt[0] = path[0] = '\0';
+  if (NULL != (f = fopen("/proc/self/mountinfo", "r"))) {
+    while (NULL != fgets(line, sizeof(line), f)) {
+      if (NULL != strstr(line, " - cgroup2 ") &&
+	  1 == sscanf(line, "%*d %*d %*s %*s %s", mnt)) {
+	break;
+      }
+      mnt[0] = '\0';
+    }
+    fclose(f);
+  }
+  if (NULL != (f = fopen("/proc/self/cgroup", "r"))) {
+    while (NULL != fgets(line, sizeof(line), f)) {
+      if (0 == strncmp(line, "0::", 3)) {
+	strncpy(path, line+3, sizeof(path)-1);
+	path[strcspn(path, "\n")] = '\0';
+	break;
+      }
+    }
+    fclose(f);
+  }
+  if ('\0' == mnt[0] || '/' != path[0]) {
+    return -1;
+  }
+  snprintf(dir, len, "%s%s", mnt, ('/' == path[0] && '\0' == path[1]) ? "" : path);
+  return 0;
+}
+
+/** _cg_enable
+    hand the controllers in want down from dir to its children.
+    Returns the ones that were */
+int _cg_enable (char *dir, int want) {
+  char str[16];
+  int i, got = 0;
+  for (i = 0; i < CG_NCTL; i++) {
+    snprintf(str, sizeof(str), "+%s", g_cg_ctl[i]);
+    if ((want & (1 << i)) && 0 == _cg_write(dir, "cgroup.subtree_control", str)) {
+      got |= 1 << i;
+    }
+  }
+  return got;
+}
+
+int cgroup_init (limits_t *lim) {
+  char *self = g_cg_self, leaf[CG_PATH], buf[256];
+  int want = 0, i, got;
+
+  g_cg_lim = *lim;
+  g_cg_on = 1;
+  g_cg_dir[0] = '\0';
+  if (-1 == _cg_self(self, sizeof(g_cg_self))) {
+    /* RLIMIT_NPROC counts every process of the user, not the session's */
+    log_msg("No cgroup v2, session limits are rlimits%s",
+	    lim->pids ? " (no process limit)" : "");
+    return -1;
+  }
+  snprintf(g_cg_dir, sizeof(g_cg_dir), "%s/ta_%d", self, (int)getpid());
+  if (-1 == mkdir(g_cg_dir, 0755) && EEXIST != errno) {
+    log_msg("Unable to create %s, session limits are rlimits", g_cg_dir);
+    g_cg_dir[0] = '\0';
+    return -1;
+  }
+
+  /* the controllers the limits need, that the server's cgroup has */
+  if (-1 == _cg_read(self, "cgroup.controllers", buf, sizeof(buf))) {
+    buf[0] = '\0';
+  }
+  for (i = 0; i < CG_NCTL; i++) {
+    int limit = (CG_CPU == i) ? lim->cpu : (CG_MEMORY == i) ? lim->mem : lim->pids;
+    char *at = strstr(buf, g_cg_ctl[i]);
+    int len = strlen(g_cg_ctl[i]);
+    if (0 < limit && NULL != at && (at == buf || ' ' == at[-1]) &&
+	(' ' == at[len] || '\n' == at[len] || '\0' == at[len])) {
+      want |= 1 << i;
+    }
+  }
+  got = _cg_enable(self, want);
+  if (got != want) {
+    /* the server's cgroup has processes (the server), move it to a leaf */
+    snprintf(leaf, sizeof(leaf), "%s_srv", g_cg_dir);
+    if ((0 == mkdir(leaf, 0755) || EEXIST == errno) && 0 == _cg_write(leaf, "cgroup.procs", "0")) {
+      memcpy(g_cg_srv, leaf, sizeof(g_cg_srv));
+      g_cg_moved = _cg_enable(self, want & ~got);
+      got |= g_cg_moved;
+    }
+  }
+  g_cg_use = _cg_enable(g_cg_dir, got);
+
+  for (i = 0; i < CG_NCTL; i++) {
+    int limit = (CG_CPU == i) ? lim->cpu : (CG_MEMORY == i) ? lim->mem : lim->pids;
+    if (0 < limit && !(g_cg_use & (1 << i))) {
+      log_msg("No %s controller for the sessions, %s", g_cg_ctl[i],
+	      (CG_CPU == i) ? "they run at a lower priority instead" :
+	      (CG_MEMORY == i) ? "limiting their address space instead" : "no process limit");
+    }
+  }
+  return 0;
+}
+
+/** _cg_fallback
+    the limits there is no controller for, on the process itself */
+void _cg_fallback (pid_t pid) {
+  struct rlimit rl;
+  if (0 < g_cg_lim.mem && !(g_cg_use & (1 << CG_MEMORY))) {
+    rl.rlim_cur = rl.rlim_max = (rlim_t)g_cg_lim.mem * 1024 * 1024;
+    prlimit(pid, RLIMIT_AS, &rl, NULL);
+  }
+  if (0 < g_cg_lim.cpu && !(g_cg_use & (1 << CG_CPU))) {
+    setpriority(PRIO_PROCESS, pid, CG_NICE);
+  }
+}
+
+cgleaf_t *cgroup_leaf () {
+  char str[64];
+  cgleaf_t *leaf;
+  if (!g_cg_on || NULL == (leaf = (cgleaf_t *)calloc(1, sizeof(cgleaf_t)))) {
+    return NULL;
+  }
+  if ('\0' == g_cg_dir[0]) {
+    return leaf; /* fallbacks only */
+  }
+  /* the pid isn't known yet, and a cgroup v2 leaf can't be renamed */
+  snprintf(leaf->path, sizeof(leaf->path), "%.*s/s_%d_%u", PATH_MAX - 32, g_cg_dir,
+	   (int)getpid(), g_cg_seq++);
+  if (-1 == mkdir(leaf->path, 0755)) {
+    leaf->path[0] = '\0';
+    return leaf;
+  }
+  if (g_cg_use & (1 << CG_CPU)) {
+    snprintf(str, sizeof(str), "%d %d", g_cg_lim.cpu * CG_PERIOD / 100, CG_PERIOD);
+    _cg_write(leaf->path, "cpu.max", str);
+  }
+  if (g_cg_use & (1 << CG_MEMORY)) {
+    snprintf(str, sizeof(str), "%llu", (unsigned long long)g_cg_lim.mem * 1024 * 1024);
+    _cg_write(leaf->path, "memory.max", str);
+    _cg_write(leaf->path, "memory.swap.max", "0"); /* not there without swap accounting */
+  }
+  if (g_cg_use & (1 << CG_PIDS)) {
+    snprintf(str, sizeof(str), "%d", g_cg_lim.pids);
+    _cg_write(leaf->path, "pids.max", str);
+  }
+  return leaf;
+}
+
+void cgroup_enter (char *path) {
+  if (!g_cg_on) {
+    return;
+  }
+  _cg_fallback(0);
+  if (NULL != path && '\0' != path[0]) {
+    _cg_write(path, "cgroup.procs", "0");
+  }
+}
+
+void cgroup_attach (cgleaf_t *leaf, pid_t pid) {
+  char str[64];
+  if (NULL == leaf) {
+    return;
+  }
+  if (0 >= pid) {
+    if ('\0' != leaf->path[0]) {
+      rmdir(leaf->path);
+    }
+    free(leaf);
+    return;
+  }
+  _cg_fallback(pid); /* the zygote's children can't, in python */
+  if ('\0' != leaf->path[0]) {
+    snprintf(str, sizeof(str), "%d", (int)pid);
+    _cg_write(leaf->path, "cgroup.procs", str); /* already there, or gone */
+  }
+  leaf->pid = pid;
+  leaf->next = g_cg_pids[pid % CG_HASH];
+  g_cg_pids[pid % CG_HASH] = leaf;
+}
+
+/** _cg_take
+    the leaf of the session in pid, out of the table. NULL if it has none */
+cgleaf_t *_cg_take (pid_t pid) {
+  cgleaf_t **at;
+  cgleaf_t *leaf;
+  for (at = &g_cg_pids[pid % CG_HASH]; NULL != *at; at = &((*at)->next)) {
+    if (pid == (*at)->pid) {
+      leaf = *at;
+      *at = leaf->next;
+      return leaf;
+    }
+  }
+  return NULL;
+}
+
+/** _cg_rmdir
+    timer wheel handler: remove the leaf of an ended session once
+    what it left running is gone, CG_RMDIR_TRIES times at most */
+void _cg_rmdir (wtimer_t *t) {
+  cgleaf_t *l = (cgleaf_t *)t;
+  if (-1 == rmdir(l->path) && EBUSY == errno && 0 < --(l->tries)) {
+    wheel_add(t, CG_RMDIR_SECS);
+    return;
+  }
+  free(l); /* gone, or left for cgroup_close */
+}
+
+void cgroup_release (pid_t pid, struct rusage *ru) {
+  char leaf[PATH_MAX], buf[1024];
+  uint64_t cpu_us = 0, throttled_us = 0, peak = 0, ooms = 0;
+  int counted = 0;
+  cgleaf_t *l;
+  if (!g_cg_on || 0 >= pid) {
+    return;
+  }
+  leaf[0] = '\0';
+  if (NULL != (l = _cg_take(pid))) {
+    memcpy(leaf, l->path, sizeof(leaf));
+  }
+  if ('\0' != leaf[0] && 0 == _cg_read(leaf, "cpu.stat", buf, sizeof(buf))) {
+    counted = 1;
+    cpu_us = _cg_key(buf, "usage_usec");
+    throttled_us = _cg_key(buf, "throttled_usec");
+    if (0 == _cg_read(leaf, "memory.peak", buf, sizeof(buf))) {
+      peak = strtoull(buf, NULL, 10);
+    }
+    if (0 == _cg_read(leaf, "memory.events", buf, sizeof(buf))) {
+      ooms = _cg_key(buf, "oom_kill");
+    }
+    _cg_write(leaf, "cgroup.kill", "1"); /* whatever the program left running */
+    if (-1 == rmdir(leaf) && EBUSY == errno && NULL != l) {
+      l->tries = CG_RMDIR_TRIES; /* the kill hasn't finished */
+      l->timer.fn = _cg_rmdir;
+      if (0 == wheel_init()) {
+	wheel_add(&(l->timer), CG_RMDIR_SECS);
+	l = NULL;
+      }
+    }
+  }
+  free(l);
+  if (NULL != ru) {
+    if (!counted) {
+      cpu_us = ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec +
+	ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+    }
+    if (0 == peak) {
+      peak = ru->ru_maxrss * 1024ULL; /* the largest process, not the total */
+    }
+  } else if (!counted) {
+    return; /* nothing to go on (a zygote session without a leaf) */
+  }
+  if (0 < peak) {
+    log_msg("session %d used %.2fs CPU%s, %.1fMB peak%s", (int)pid, cpu_us / 1e6,
+	    (0 < throttled_us) ? " (throttled)" : "", peak / (1024.0 * 1024.0),
+	    (0 < ooms) ? ", out of memory" : "");
+  } else {
+    log_msg("session %d used %.2fs CPU%s", (int)pid, cpu_us / 1e6,
+	    (0 < throttled_us) ? " (throttled)" : ""); /* no memory.peak, no rusage */
+  }
+  metrics_usage(cpu_us, throttled_us, peak, ooms);
+}
+
+void cgroup_close () {
+  char leaf[CG_PATH], str[16];
+  DIR *d;
+  struct dirent *e;
+  int i;
+  if (!g_cg_on || '\0' == g_cg_dir[0]) {
+    return;
+  }
+  /* leaves whose rmdir failed while their processes were dying,
+     the last acceptor out removes ta_PID */
+  if (NULL != (d = opendir(g_cg_dir))) {
+    while (NULL != (e = readdir(d))) {
+      if (0 == strncmp(e->d_name, "s_", 2)) {
+	snprintf(leaf, sizeof(leaf), "%s/%s", g_cg_dir, e->d_name);
+	rmdir(leaf);
+      }
+    }
+    closedir(d);
+  }
+  if ((-1 == rmdir(g_cg_dir) && ENOENT != errno) || '\0' == g_cg_srv[0]) {
+    return;
+  }
+  /* the server's cgroup takes processes again once the controllers
+     it was given for ta_PID are off, then ta_PID_srv can go (once
+     the other acceptors have left it too) */
+  for (i = 0; i < CG_NCTL; i++) {
+    snprintf(str, sizeof(str), "-%s", g_cg_ctl[i]);
+    if (g_cg_moved & (1 << i)) {
+      _cg_write(g_cg_self, "cgroup.subtree_control", str);
+    }
+  }
+  if (0 == _cg_write(g_cg_self, "cgroup.procs", "0")) {
+    for (i = 0; i < CG_RMDIR_TRIES && -1 == rmdir(g_cg_srv) && EBUSY == errno; i++) {
+      usleep(CG_CLOSE_WAIT);
+    }
+  }
+}
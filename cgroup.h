@@ -0,0 +1,72 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "wheel.h"
+
+/* what each session may use (-g), 0 = no limit */
+typedef struct limits {
+  int cpu;      /* percent of one CPU (cpu.max) */
+  int mem;      /* MB (memory.max) */
+  int pids;     /* processes and threads (pids.max) */
+} limits_t;
+
+/* a session's leaf, made before its process starts */
+typedef struct cgleaf {
+  wtimer_t timer;        /* first, the rmdir retry once the session ended */
+  int tries;             /* rmdirs left */
+  pid_t pid;             /* the session in it, 0 until it has started */
+  char path[PATH_MAX];   /* .../ta_PID/s_ACCEPTOR_N, "" = no cgroup v2 */
+  struct cgleaf *next;   /* in its bucket of the pid table */
+} cgleaf_t;
+
+/** cgroup_init
+    each session will get a cgroup v2 leaf of its own, under
+    ta_PID in the server's cgroup, with the limits. The limits
+    whose controller isn't there fall back to rlimits (memory:
+    RLIMIT_AS, cpu: a lower priority, pids: none). Call before
+    anything else is started (zygote, JVM, acceptors), the server
+    may have to move into a leaf of its own first.
+    Returns -1 if there is no cgroup v2 to use (fallbacks only) */
+int cgroup_init (limits_t *lim) ;
+/** cgroup_leaf
+    make the leaf for a session about to start, with the limits
+    set. The process joins it with cgroup_enter before it execs,
+    so nothing it starts escapes the limits. NULL without -g */
+cgleaf_t *cgroup_leaf () ;
+/** cgroup_enter
+    in the session's process, before exec: move into the leaf at
+    path (NULL or "" for none) and take the fallback limits.
+    Only system calls, safe in a vfork child */
+void cgroup_enter (char *path) ;
+/** cgroup_attach
+    the session in leaf started as pid (-1 if it never did, the
+    leaf is removed). Moves pid in too, in case it couldn't */
+void cgroup_attach (cgleaf_t *leaf, pid_t pid) ;
+/** cgroup_release
+    the session in pid ended, log what it used (from its leaf,
+    or from ru, the rusage wait4 gave, if it has none) and remove
+    the leaf, killing anything it left behind (the rmdir is
+    retried from the timer wheel until the kill is done). ru may
+    be NULL */
+void cgroup_release (pid_t pid, struct rusage *ru) ;
+/** cgroup_close
+    remove ta_PID once the last acceptor is done with it, and
+    move the server back out of ta_PID_srv and remove that */
+void cgroup_close () ;
+
+#endif /* CGROUP_H */
@@ -26,10 +26,158 @@
 #define MIN_A             0
 #define MAX_A            20
 #define MAX_STRLEN_ARG   64 /* length of each arg should not exceed this */
+#define MAX_GATHERING   256 /* clients answering the arg prompts at once, then the oldest goes */
+#define GATHER_SECS     120 /* a client at a prompt (or the -C menu) is closed after this */
+#define MAX_PACKED_ARGS (MAX_A*MAX_STRLEN_ARG) /* args sent to a session, see gather_pack */
 
 
 
-#define MAX_CONNECTIONS  35  /* maximum number of clients */
+#define MAX_CONNECTIONS  35  /* maximum number of clients (default for -c) */
+#define MIN_C             1
+#define MAX_C          4096
+#define SESSION_AVG_N    16  /* sessions averaged for the wait estimate */
+
+
+/* programs hosted by one server (-C) */
+#define MAX_PROGS        32
+#define MAX_CONF_ARGS    64  /* words on one line of the file */
+#define MENU_MAX       4096  /* the menu sent to clients, bytes */
+
+
+/* clients waiting for a slot instead of getting "Server Busy" (-w) */
+#define DEFAULT_W        64
+#define MIN_W             0
+#define MAX_W          1024
+#define WAIT_TICK         1  /* seconds between checks of the waiting room */
+#define WAIT_UPDATE      15  /* seconds between wait estimates sent to a client */
 #define DEFAULT_BG        0  /* make a background process? */
 
+
+/* number of workers parked in the session pool (0 = fork per client) */
+#define DEFAULT_POOL      0
+#define MIN_POOL          0
+#define MAX_POOL  MAX_CONNECTIONS
+#define POOL_PARK_FD      3  /* a parked python worker's socket (zygote.py --park) */
+
+
+/* acceptor processes, each with a SO_REUSEPORT listener (-n) */
+#define DEFAULT_N         1
+#define MIN_N             1
+#define MAX_N            64
+
+
+/* event loop backends */
+#define EV_SELECT         0
+#define EV_EPOLL          1
+#define EV_URING          2
+#define DEFAULT_E  EV_EPOLL
+#define EV_BATCH         64  /* events handled per wakeup */
+#define URING_ENTRIES   256  /* submissions queued per round (-e uring) */
+#define ACCEPT_BATCH     64  /* clients accepted per wakeup, the rest wait for the next one */
+
+
+/* relayed sessions (-T, -v, -o, -J), the server pumps the bytes */
+#define RELAY_BUF     16384  /* bytes buffered in each direction */
+#define PTY_ROWS         24  /* window size the program sees with -T */
+#define PTY_COLS         80
+
+
+/* what a session's program may send the client (-o KBPS[,MB][,drop]) */
+#define MAX_O_RATE  1048576  /* KB a second */
+#define MAX_O_MB      65536  /* total */
+#define CAP_TICK_MS      50  /* throttled relays get tokens back this often */
+
+
+/* the framed protocol, many sessions on one connection (-x) */
+#define DEFAULT_X        -1  /* port, -1 = no framed protocol */
+#define MUX_HDR           8  /* frame header: stream (4), type, 0, length (2) */
+#define MUX_PAYLOAD   16384  /* largest frame payload */
+#define MUX_CREDIT    65536  /* bytes each way a stream may have in flight */
+#define MUX_OBUF     262144  /* a connection's unsent frames, past it nothing more is read */
+#define MUX_STREAMS      16  /* sessions open on one connection */
+
+
+/* running the program over a manifest of cases (-B, -j) */
+#define BATCH_LIMIT      10  /* seconds a case may run, unless -I says */
+#define BATCH_READ    65536  /* a case's output is read this much at a time */
+#define BATCH_OUTPUT (64 << 20) /* output a case may write */
+#define BATCH_POLL       10  /* ms between checks for a case's exit, without pidfd_open */
+#define BATCH_SLOW        1  /* why a case was killed */
+#define BATCH_LOUD        2
+#define DEFAULT_J         0  /* cases at once, 0 = one per CPU */
+#define MIN_J             0
+#define MAX_J           256
+
+
+/* results of earlier -B runs (-K) */
+#define CACHE_MB         64  /* size of the cache file */
+#define CACHE_SLOT_BYTES 4096  /* a slot (48 bytes) for each this much of the file */
+#define CACHE_PROBE       8  /* slots a key may be in */
+#define CACHE_READ    65536  /* the program is hashed this much at a time */
+
+
+/* how a session's process is created */
+#define SPAWN_FORK        0  /* fork, the child gathers args and execs */
+#define SPAWN_POSIX       1  /* posix_spawn */
+#define SPAWN_VFORK       2  /* clone(CLONE_VM|CLONE_VFORK) */
+#define DEFAULT_S  SPAWN_FORK
+#define SPAWN_STACK   65536  /* stack for the vfork child, only used until exec */
+
+
+/* the log (logger.c) */
+#define LOG_SLOTS      1024  /* lines the ring buffer holds */
+#define LOG_LINE        256  /* longest line, longer ones are cut */
+#define LOG_BATCH        64  /* lines per writev */
+#define LOG_SCRIPT_CHUNK 65536 /* most a transcript (-v) is written in one splice */
+#define DEFAULT_L         0  /* rotate the -bg log file at this many MB (0 = never) */
+#define MIN_L             0
+#define MAX_L          1024
+
+
+/* the metrics (-M) */
+#define MET_BUCKETS      13  /* histogram buckets, see metrics.c */
+#define MET_SIGNALS      65  /* signals counted by number */
+
+
+/* connections per minute from one address (-L), all acceptors together */
+#define DEFAULT_RATE      0  /* no limit */
+#define MIN_RATE          0
+#define MAX_RATE      60000
+#define RATE_SLOTS     4096  /* hash table slots, a power of two (< 65535) */
+#define RATE_MAX       3072  /* addresses remembered, the least recent is forgotten */
+
+/* per-session resources (-g cpu=PCT,mem=MB,pids=N) */
+#define MAX_G_CPU      6400  /* percent of one CPU */
+#define MAX_G_MEM     65536  /* MB */
+#define MAX_G_PIDS    32768
+#define CG_PERIOD    100000  /* cpu.max period, microseconds */
+#define CG_NICE          10  /* priority of the sessions without a cpu controller */
+#define CG_HASH         256  /* buckets of the pid -> leaf table */
+#define CG_RMDIR_SECS     1  /* between rmdirs of a leaf still being killed */
+#define CG_RMDIR_TRIES   10  /* then it is left for cgroup_close */
+#define CG_CLOSE_WAIT 10000  /* usecs between rmdirs of ta_PID_srv at exit */
+
+/* per-session limits (-i, -I) and the timer wheel they run on */
+#define DEFAULT_IDLE      0  /* seconds a session may go without input (0 = forever) */
+#define DEFAULT_LIFE      0  /* seconds a session may last (0 = forever) */
+#define EXPIRE_GRACE     60  /* seconds between the warning and the kill */
+#define EXPIRE_HASH     256  /* buckets of the pid -> session table */
+#define WHEEL_TICK        1  /* seconds per tick */
+#define WHEEL_BITS        8
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)  /* slots per level */
+#define WHEEL_LEVELS      3  /* 2^24 ticks (194 days) reachable */
+
+/* the resident JVM (-J) */
+#define JVM_START_SECS   30  /* how long the host may take to start listening */
+
+/* AppCDS archive for .java programs */
+#define CDS_BUILD_SECS    5  /* at most one build started this often (a recompile writes many classes) */
+#define CDS_TRAIN_SECS   60  /* the training run is killed after this */
+#define CDS_MAX_CLASSES 256  /* .class files put in the jar */
+
+/* the program's image, exec'd by fd */
+#define IMAGE_SHEBANG   256  /* longest #! line read (the kernel's limit) */
+#define IMAGE_COPY    65536  /* bytes copied into the memfd at a time */
+#define IMAGE_EVENTS   4096  /* inotify events read at a time */
+
 #endif /* DEFS_H */
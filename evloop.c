@@ -0,0 +1,430 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the event loop the server runs in.
+ * Any fd (the listening socket, and later signals, timers,
+ * child pipes) can be registered with a handler. The loop
+ * is backed by epoll, with the original select loop kept
+ * as a fallback (-e select).
+ *
+ * With -e uring the loop runs on io_uring instead (uring.c).
+ * Each registered fd gets a one-shot poll, re-armed after its
+ * handler runs, so readiness is level-triggered like epoll's,
+ * and the listener gets a multishot accept that hands over the
+ * clients directly. Arming, changing and cancelling are queued
+ * and submitted with the wait, one io_uring_enter per round
+ * instead of an epoll_ctl for every change, and no accept4 calls.
+ * Kernels without it fall back to epoll.
+ *
+ * SIGALRM and SIGCHLD are blocked except while the loop
+ * waits, so a signal can't slip in between checking the
+ * stop flag and going to sleep. A signal given to ev_signal
+ * stays blocked and is read from a signalfd instead.
+ * SIGPIPE is ignored, the server writes to clients that may
+ * have gone away.
+ */
+
+#define _GNU_SOURCE  /* accept4 */
+#include "evloop.h"
+#include "logger.h"
+#include "uring.h"
+
+/* what the loop knows about a registered fd */
+typedef struct ev_entry {
+  ev_fn_t fn;     /* NULL if the fd isn't registered */
+  void *data;
+  int events;
+  ev_accept_fn_t accept; /* a listener (ev_accept) */
+  unsigned gen;   /* registrations of this fd so far, an event for an
+		     earlier one (the fd was closed and reused) is dropped */
+  unsigned waited;/* select: gen when the fd was put in the sets */
+  uint64_t armed; /* uring: the poll (or accept) waiting in the ring, 0 = none */
+} ev_entry_t;
+
+/* uring: what a completion is for (top bits of user_data),
+   the rest is the fd and its gen when it was armed */
+#define EV_UD_POLL      0ULL
+#define EV_UD_ACCEPT    1ULL
+#define EV_UD_CANCEL    2ULL
+#define EV_UD(kind, gen, fd) (((kind) << 62) | ((uint64_t)((gen) & 0x3fffffff) << 32) | (unsigned)(fd))
+
+/* epoll: the fd and its gen in epoll_data */
+#define EV_EPOLL_DATA(gen, fd) (((uint64_t)(gen) << 32) | (unsigned)(fd))
+
+static int g_ev_backend = EV_SELECT;
+static int g_ev_epfd = -1;
+static ev_entry_t *g_ev_tab = NULL;  /* indexed by fd */
+static int g_ev_tab_len = 0;
+static int g_ev_maxfd = -1;          /* highest registered fd (select) */
+static sigset_t g_ev_origmask;       /* mask before ev_init, children get this */
+static sigset_t g_ev_waitmask;       /* mask to use while waiting */
+static uring_t g_ev_ring;
+static int g_ev_accept_multi = 1;    /* uring: multishot accept works (5.19) */
+
+/** _ev_grow
+    make sure the table has room for fd */
+int _ev_grow (int fd) {
+  if (fd < g_ev_tab_len) {
+    return 0;
+  }
+  int len = g_ev_tab_len ? g_ev_tab_len : 64;
+  while (len <= fd) {
+    len *= 2;
+  }
+  ev_entry_t *tab = (ev_entry_t *)realloc(g_ev_tab, len*sizeof(ev_entry_t));
+  if (NULL == tab) {
+    return -1;
+  }
+  memset(&(tab[g_ev_tab_len]), 0, (len - g_ev_tab_len)*sizeof(ev_entry_t));
+  g_ev_tab = tab;
+  g_ev_tab_len = len;
+  return 0;
+}
+
+/** _ev_uring_arm
+    queue the poll (or the listener's accept) for fd */
+int _ev_uring_arm (int fd) {
+  ev_entry_t *e = &(g_ev_tab[fd]);
+  struct io_uring_sqe *sqe = uring_sqe(&g_ev_ring);
+  if (NULL == sqe) {
+    return -1;
+  }
+  sqe->fd = fd;
+  if (NULL != e->accept && g_ev_accept_multi) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = EV_UD(EV_UD_ACCEPT, e->gen, fd);
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = ((EV_READ & e->events) ? POLLIN : 0) |
+      ((EV_WRITE & e->events) ? POLLOUT : 0);
+    sqe->user_data = EV_UD(EV_UD_POLL, e->gen, fd);
+  }
+  e->armed = sqe->user_data;
+  return 0;
+}
+
+/** _ev_uring_disarm
+    cancel what's waiting in the ring for fd, its
+    completion (if any still comes) will be stale */
+void _ev_uring_disarm (int fd) {
+  ev_entry_t *e = &(g_ev_tab[fd]);
+  struct io_uring_sqe *sqe;
+  if (0 != e->armed && NULL != (sqe = uring_sqe(&g_ev_ring))) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = e->armed;
+    sqe->user_data = EV_UD(EV_UD_CANCEL, 0, fd);
+  }
+  e->armed = 0;
+  e->gen++;
+}
+
+/** _ev_epoll_bits
+    convert EV_ bits to epoll bits */
+unsigned int _ev_epoll_bits (int events) {
+  unsigned int e = 0;
+  if (EV_READ & events) e |= EPOLLIN;
+  if (EV_WRITE & events) e |= EPOLLOUT;
+  return e;
+}
+
+int ev_init (int backend) {
+  sigset_t block;
+  sigemptyset(&block);
+  sigaddset(&block, SIGALRM);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &g_ev_origmask);
+  memcpy(&g_ev_waitmask, &g_ev_origmask, sizeof(sigset_t));
+  signal(SIGPIPE, SIG_IGN);
+
+  g_ev_backend = EV_SELECT;
+  if (EV_URING == backend) {
+    if (-1 == uring_init(&g_ev_ring, URING_ENTRIES)) {
+      log_msg("io_uring unavailable, using epoll");
+      backend = EV_EPOLL;
+    } else {
+      g_ev_backend = EV_URING;
+    }
+  }
+  if (EV_EPOLL == backend) {
+    if (-1 == (g_ev_epfd = epoll_create1(EPOLL_CLOEXEC))) {
+      log_msg("epoll unavailable, using select");
+    } else {
+      g_ev_backend = EV_EPOLL;
+    }
+  }
+  return g_ev_backend;
+}
+
+int ev_add (int fd, int events, ev_fn_t fn, void *data) {
+  if (0 > fd || -1 == _ev_grow(fd)) {
+    return -1;
+  }
+  if (EV_SELECT == g_ev_backend && FD_SETSIZE <= fd) {
+    log_msg("fd %d is too large for select", fd);
+    return -1;
+  }
+  if (EV_EPOLL == g_ev_backend) {
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = _ev_epoll_bits(events);
+    ev.data.u64 = EV_EPOLL_DATA(g_ev_tab[fd].gen + 1, fd);
+    if (-1 == epoll_ctl(g_ev_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      return -1;
+    }
+  }
+  g_ev_tab[fd].fn = fn;
+  g_ev_tab[fd].data = data;
+  g_ev_tab[fd].events = events;
+  g_ev_tab[fd].gen++;
+  if (EV_URING == g_ev_backend) {
+    if (-1 == _ev_uring_arm(fd)) {
+      g_ev_tab[fd].fn = NULL;
+      return -1;
+    }
+  }
+  if (fd > g_ev_maxfd) {
+    g_ev_maxfd = fd;
+  }
+  return 0;
+}
+
+int ev_mod (int fd, int events) {
+  if (0 > fd || fd >= g_ev_tab_len || NULL == g_ev_tab[fd].fn) {
+    return -1;
+  }
+  if (EV_EPOLL == g_ev_backend && events != g_ev_tab[fd].events) {
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = _ev_epoll_bits(events);
+    ev.data.u64 = EV_EPOLL_DATA(g_ev_tab[fd].gen, fd);
+    if (-1 == epoll_ctl(g_ev_epfd, EPOLL_CTL_MOD, fd, &ev)) {
+      return -1;
+    }
+  }
+  if (EV_URING == g_ev_backend && events != g_ev_tab[fd].events && 0 != g_ev_tab[fd].armed) {
+    /* re-armed with the new events (if it isn't armed its handler
+       is running, and it is re-armed after) */
+    g_ev_tab[fd].events = events;
+    _ev_uring_disarm(fd);
+    return _ev_uring_arm(fd);
+  }
+  g_ev_tab[fd].events = events;
+  return 0;
+}
+
+int ev_del (int fd) {
+  if (0 > fd || fd >= g_ev_tab_len || NULL == g_ev_tab[fd].fn) {
+    return -1;
+  }
+  if (EV_EPOLL == g_ev_backend) {
+    epoll_ctl(g_ev_epfd, EPOLL_CTL_DEL, fd, NULL);
+  }
+  if (EV_URING == g_ev_backend) {
+    _ev_uring_disarm(fd);
+  }
+  g_ev_tab[fd].fn = NULL;
+  g_ev_tab[fd].data = NULL;
+  g_ev_tab[fd].events = 0;
+  g_ev_tab[fd].accept = NULL;
+  while (0 <= g_ev_maxfd && NULL == g_ev_tab[g_ev_maxfd].fn) {
+    g_ev_maxfd--;
+  }
+  return 0;
+}
+
+/** _ev_accept_ready
+    the listener is readable: accept up to ACCEPT_BATCH
+    clients, a burst shouldn't overflow the listen backlog */
+void _ev_accept_ready (int fd, int events, void *data) {
+  ev_accept_fn_t fn = g_ev_tab[fd].accept;
+  int clientfd, n, accepted = 0;
+  if (EV_ERR & events && !(EV_READ & events)) {
+    fn(fd, -1, data); /* the listener is broken */
+    return;
+  }
+  for (n = 0; n < ACCEPT_BATCH && fn == g_ev_tab[fd].accept; n++) {
+    clientfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (0 > clientfd) {
+      if (EINTR == errno || ECONNABORTED == errno) {
+	continue;
+      }
+      break; /* EAGAIN: queue is empty, anything else: try next wakeup */
+    }
+    fn(fd, clientfd, data);
+    accepted++;
+  }
+  if (0 < accepted && fn == g_ev_tab[fd].accept) {
+    fn(fd, EV_ACCEPT_DONE, data);
+  }
+  errno = 0;
+}
+
+int ev_accept (int fd, ev_accept_fn_t fn, void *data) {
+  if (0 > fd || -1 == _ev_grow(fd)) {
+    return -1;
+  }
+  g_ev_tab[fd].accept = fn;
+  if (-1 == ev_add(fd, EV_READ, _ev_accept_ready, data)) {
+    g_ev_tab[fd].accept = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int ev_signal (int signo, ev_fn_t fn, void *data) {
+  sigset_t mask;
+  int fd;
+  sigemptyset(&mask);
+  sigaddset(&mask, signo);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  if (-1 == (fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC))) {
+    return -1;
+  }
+  if (-1 == ev_add(fd, EV_READ, fn, data)) {
+    close(fd);
+    return -1;
+  }
+  sigaddset(&g_ev_waitmask, signo);
+  return fd;
+}
+
+/** _ev_dispatch
+    call the handler for fd, if it is still the registration gen
+    (an earlier handler in the same batch may have removed it, or
+    closed it and had the number reused by an accept) */
+void _ev_dispatch (int fd, unsigned gen, int events) {
+  if (fd < g_ev_tab_len && NULL != g_ev_tab[fd].fn && gen == g_ev_tab[fd].gen) {
+    g_ev_tab[fd].fn(fd, events, g_ev_tab[fd].data);
+  }
+}
+
+/** _ev_wait_epoll
+    one round of epoll_pwait, then dispatch */
+void _ev_wait_epoll () {
+  struct epoll_event evs[EV_BATCH];
+  int i, n, events;
+  n = epoll_pwait(g_ev_epfd, evs, EV_BATCH, -1, &g_ev_waitmask);
+  for (i = 0; i < n; i++) {
+    events = 0;
+    if (EPOLLIN & evs[i].events) events |= EV_READ;
+    if (EPOLLOUT & evs[i].events) events |= EV_WRITE;
+    if ((EPOLLERR | EPOLLHUP) & evs[i].events) events |= EV_ERR;
+    _ev_dispatch((int)(evs[i].data.u64 & 0xffffffff), (unsigned)(evs[i].data.u64 >> 32), events);
+  }
+}
+
+/** _ev_uring_done
+    a completion for fd: run the handler (or hand over the
+    accepted client), then re-arm fd unless the handler
+    removed it or changed its events */
+void _ev_uring_done (struct io_uring_cqe *cqe) {
+  uint64_t kind = cqe->user_data >> 62;
+  int fd = (int)(unsigned)cqe->user_data;
+  unsigned gen = (cqe->user_data >> 32) & 0x3fffffff;
+  ev_entry_t *e = (fd < g_ev_tab_len) ? &(g_ev_tab[fd]) : NULL;
+  int events = 0;
+
+  if (EV_UD_CANCEL == kind) {
+    return;
+  }
+  if (NULL == e || NULL == e->fn || gen != (e->gen & 0x3fffffff)) {
+    /* stale, fd was removed (or re-added) since */
+    if (EV_UD_ACCEPT == kind && 0 <= cqe->res) {
+      close(cqe->res);
+    }
+    return;
+  }
+  gen = e->gen;
+  if (EV_UD_ACCEPT == kind) {
+    if (!(IORING_CQE_F_MORE & cqe->flags)) {
+      e->armed = 0;
+    }
+    if (0 <= cqe->res) {
+      e->accept(fd, cqe->res, e->data);
+    } else if (-EINVAL == cqe->res) {
+      g_ev_accept_multi = 0; /* older kernel, poll and accept4 */
+    }
+  } else {
+    e->armed = 0;
+    if (0 > cqe->res) {
+      events = EV_ERR;
+    } else {
+      if (POLLIN & cqe->res) events |= EV_READ;
+      if (POLLOUT & cqe->res) events |= EV_WRITE;
+      if ((POLLERR | POLLHUP) & cqe->res) events |= EV_ERR;
+    }
+    e->fn(fd, events, e->data);
+  }
+  e = &(g_ev_tab[fd]); /* a handler may have grown the table */
+  if (NULL != e->fn && gen == e->gen && 0 == e->armed) {
+    _ev_uring_arm(fd);
+  }
+}
+
+/** _ev_wait_uring
+    submit what's queued and wait, in one io_uring_enter,
+    then handle the completions */
+void _ev_wait_uring () {
+  struct io_uring_cqe cqe;
+  if (-1 == uring_enter(&g_ev_ring, 1, &g_ev_waitmask) && EINTR != errno) {
+    log_msg("io_uring_enter failed");
+  }
+  while (uring_cqe(&g_ev_ring, &cqe)) {
+    _ev_uring_done(&cqe);
+  }
+}
+
+/** _ev_wait_select
+    one round of pselect, then dispatch.
+    The fd_sets have to be rebuilt every time */
+void _ev_wait_select () {
+  fd_set r, w, e;
+  int fd, events;
+  FD_ZERO (&r);
+  FD_ZERO (&w);
+  FD_ZERO (&e);
+  for (fd = 0; fd <= g_ev_maxfd; fd++) {
+    if (NULL == g_ev_tab[fd].fn) {
+      continue;
+    }
+    if (EV_READ & g_ev_tab[fd].events) FD_SET (fd, &r);
+    if (EV_WRITE & g_ev_tab[fd].events) FD_SET (fd, &w);
+    FD_SET (fd, &e);
+    g_ev_tab[fd].waited = g_ev_tab[fd].gen;
+  }
+  int maxfd = g_ev_maxfd;
+  if (0 >= pselect (maxfd+1, &r, &w, &e, NULL, &g_ev_waitmask)) {
+    return; /* EINTR */
+  }
+  for (fd = 0; fd <= maxfd; fd++) {
+    events = 0;
+    if (FD_ISSET(fd, &r)) events |= EV_READ;
+    if (FD_ISSET(fd, &w)) events |= EV_WRITE;
+    if (FD_ISSET(fd, &e)) events |= EV_ERR;
+    if (events) {
+      _ev_dispatch(fd, g_ev_tab[fd].waited, events);
+    }
+  }
+}
+
+void ev_run (volatile sig_atomic_t *stop) {
+  while (!*stop) {
+    if (EV_URING == g_ev_backend) {
+      _ev_wait_uring();
+    } else if (EV_EPOLL == g_ev_backend) {
+      _ev_wait_epoll();
+    } else {
+      _ev_wait_select();
+    }
+  }
+}
+
+void ev_child_reset () {
+  signal(SIGPIPE, SIG_DFL);
+  sigprocmask(SIG_SETMASK, &g_ev_origmask, NULL);
+}
+
+void ev_child_sigmask (sigset_t *mask) {
+  memcpy(mask, &g_ev_origmask, sizeof(sigset_t));
+}
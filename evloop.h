@@ -0,0 +1,72 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* bits passed to ev_add/ev_mod and handed back to the handler */
+#define EV_READ    0x1
+#define EV_WRITE   0x2
+#define EV_ERR     0x4
+
+/* the clientfd an accept handler gets once a wakeup's clients are accepted */
+#define EV_ACCEPT_DONE -2
+
+/* handler invoked when fd is ready, events holds the EV_ bits */
+typedef void (*ev_fn_t)(int fd, int events, void *data);
+/* handler for a listener, clientfd was just accepted
+   (-1 if the listening socket broke, EV_ACCEPT_DONE after a batch) */
+typedef void (*ev_accept_fn_t)(int fd, int clientfd, void *data);
+
+/** ev_init
+    set up the event loop with the requested backend
+    (EV_URING, EV_EPOLL or EV_SELECT). Falls back to epoll if
+    io_uring is unavailable, and to select if epoll is.
+    Returns the backend actually in use */
+int ev_init (int backend) ;
+/** ev_add
+    watch fd for events, calling fn(fd, events, data) when ready */
+int ev_add (int fd, int events, ev_fn_t fn, void *data) ;
+/** ev_mod
+    change the events being watched on fd */
+int ev_mod (int fd, int events) ;
+/** ev_del
+    stop watching fd (call before closing it) */
+int ev_del (int fd) ;
+/** ev_accept
+    accept clients on the listening socket fd, calling
+    fn(fd, clientfd, data) for each (the client is blocking,
+    close-on-exec), then fn(fd, EV_ACCEPT_DONE, data) once for
+    the wakeup if any were. ev_del stops it */
+int ev_accept (int fd, ev_accept_fn_t fn, void *data) ;
+/** ev_signal
+    deliver signo through the loop instead of a handler: it stays
+    blocked (even while waiting) and fn runs when the returned
+    signalfd is readable. fn must read the signalfd_siginfo's */
+int ev_signal (int signo, ev_fn_t fn, void *data) ;
+/** ev_run
+    dispatch events until *stop becomes non-zero */
+void ev_run (volatile sig_atomic_t *stop) ;
+/** ev_child_reset
+    a forked child must call this before exec, it restores
+    the signal mask and SIGPIPE the loop changed */
+void ev_child_reset () ;
+/** ev_child_sigmask
+    the signal mask a child should exec with
+    (for spawn backends that can't call ev_child_reset) */
+void ev_child_sigmask (sigset_t *mask) ;
+
+#endif /* EVLOOP_H */
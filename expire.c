@@ -0,0 +1,213 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the per-session limits (-i, -I). A session
+ * may sit idle (nothing typed by the client) for x->idle seconds
+ * and last x->life seconds in all (its program's, see -C). Each session has
+ * one timer on the wheel (wheel.c), set for the nearest of its
+ * two deadlines. When it fires the session is checked: if it is
+ * past a limit the client is warned and has EXPIRE_GRACE seconds
+ * (typing something clears an idle warning), then the socket is
+ * shut down and the session's process killed.
+ *
+ * Idleness is read from the kernel (TCP_INFO), so it doesn't
+ * matter who reads the socket: the program, a relay or the JVM.
+ * A stream on a -x connection is measured on the connection, and
+ * is only killed (its client can't be sent a line, and the
+ * connection has other streams).
+ *
+ */
+
+#include "expire.h"
+#include "logger.h"
+
+#define EXPIRE_IDLE 1
+#define EXPIRE_LIFE 2
+
+static int g_expire_on = 0;      /* the wheel is running */
+static expiry_t *g_expire_pids[EXPIRE_HASH]; /* sessions by pid */
+
+/** _expire_now
+    CLOCK_MONOTONIC seconds */
+time_t _expire_now () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/** _expire_idle
+    seconds since the client last sent anything */
+long _expire_idle (expiry_t *x) {
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  bzero(&info, sizeof(info));
+  if (-1 == getsockopt(x->fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+    return 0; /* not TCP, it is never idle */
+  }
+  return info.tcpi_last_data_recv / 1000;
+}
+
+/** _expire_tell
+    a line to the client, it is never waited on */
+void _expire_tell (expiry_t *x, char *msg) {
+  send(x->fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/** _expire_hash
+    the pid's chain */
+expiry_t **_expire_hash (pid_t pid) {
+  return &(g_expire_pids[(unsigned)pid % EXPIRE_HASH]);
+}
+
+/** _expire_unhash
+    take x out of the pid table */
+void _expire_unhash (expiry_t *x) {
+  expiry_t **p;
+  if (0 >= x->pid) {
+    return;
+  }
+  for (p = _expire_hash(x->pid); NULL != *p; p = &((*p)->hnext)) {
+    if (x == *p) {
+      *p = x->hnext;
+      break;
+    }
+  }
+  x->pid = 0;
+}
+
+/** _expire_fire
+    the timer of a session went off, warn it,
+    end it, or set the timer for its next deadline */
+void _expire_fire (wtimer_t *t) {
+  expiry_t *x = (expiry_t *)t;  /* timer is the first member */
+  long age = _expire_now() - x->start;
+  long idle = _expire_idle(x);
+  long next = 0;
+  int over = 0;
+  char msg[128];
+
+  if (0 < x->life && age >= x->life) {
+    over = EXPIRE_LIFE;
+  } else if (0 < x->idle && idle >= x->idle) {
+    over = EXPIRE_IDLE;
+  }
+
+  if (over && (over == x->warned || x->quiet)) {
+    /* the grace period is over */
+    log_msg("session %d ended, %s", (int)x->pid,
+	    (EXPIRE_LIFE == over) ? "too long" : "idle");
+    if (!x->quiet) {
+      _expire_tell(x, "\n*** Session ended ***\n");
+      shutdown(x->fd, SHUT_RDWR);
+    }
+    if (0 < x->pid) {
+      kill(x->pid, SIGKILL);
+    }
+    /* ended when it is reaped (or its relay closes), check again if not */
+    wheel_add(&(x->timer), EXPIRE_GRACE);
+    return;
+  }
+  if (over) {
+    if (EXPIRE_LIFE == over) {
+      snprintf(msg, sizeof(msg), "\n*** Time limit reached, this session ends in %d seconds ***\n",
+	       EXPIRE_GRACE);
+    } else {
+      snprintf(msg, sizeof(msg), "\n*** Idle for %ld %s, this session ends in %d seconds"
+	       " unless you type something ***\n", (60 <= idle) ? idle / 60 : idle,
+	       (60 <= idle) ? "minutes" : "seconds", EXPIRE_GRACE);
+    }
+    _expire_tell(x, msg);
+    x->warned = over;
+    wheel_add(&(x->timer), EXPIRE_GRACE);
+    return;
+  }
+
+  /* in time, until the nearer deadline */
+  x->warned = 0;
+  if (0 < x->life) {
+    next = x->life - age;
+  }
+  if (0 < x->idle && (0 == next || x->idle - idle < next)) {
+    next = x->idle - idle;
+  }
+  wheel_add(&(x->timer), next);
+}
+
+int expire_init () {
+  if (-1 == wheel_init()) {
+    return -1;
+  }
+  g_expire_on = 1;
+  return 0;
+}
+
+/** _expire_begin
+    expire_start, quiet for a -x stream */
+expiry_t *_expire_begin (int sock, int idle, int life, int quiet) {
+  expiry_t *x;
+  if (!g_expire_on || (0 == idle && 0 == life)) {
+    return NULL;
+  }
+  x = (expiry_t *)calloc(1, sizeof(expiry_t));
+  if (NULL == x) {
+    return NULL;
+  }
+  x->fd = fcntl(sock, F_DUPFD_CLOEXEC, 0);
+  if (0 > x->fd) {
+    free(x);
+    return NULL;
+  }
+  x->start = _expire_now();
+  x->idle = idle;
+  x->life = life;
+  x->quiet = quiet;
+  x->timer.fn = _expire_fire;
+  _expire_fire(&(x->timer)); /* sets the first deadline */
+  return x;
+}
+
+expiry_t *expire_start (int sock, int idle, int life) {
+  return _expire_begin(sock, idle, life, 0);
+}
+
+expiry_t *expire_stream (int sock, int idle, int life) {
+  return _expire_begin(sock, idle, life, 1);
+}
+
+void expire_pid (expiry_t *x, pid_t pid) {
+  expiry_t **p;
+  if (NULL == x) {
+    return;
+  }
+  if (0 > pid) {
+    expire_end(x);
+    return;
+  }
+  _expire_unhash(x);
+  x->pid = pid;
+  p = _expire_hash(pid);
+  x->hnext = *p;
+  *p = x;
+}
+
+void expire_end (expiry_t *x) {
+  if (NULL == x) {
+    return;
+  }
+  wheel_del(&(x->timer));
+  _expire_unhash(x);
+  close(x->fd);
+  free(x);
+}
+
+void expire_end_pid (pid_t pid) {
+  expiry_t *x;
+  if (0 >= pid) {
+    return;
+  }
+  for (x = *_expire_hash(pid); NULL != x; x = x->hnext) {
+    if (pid == x->pid) {
+      expire_end(x);
+      return;
+    }
+  }
+}
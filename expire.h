@@ -0,0 +1,64 @@
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "wheel.h"
+
+/* the deadlines of one session */
+typedef struct expiry {
+  wtimer_t timer;           /* first, expire.c gets from one to the other */
+  int fd;                   /* the client socket (a dup) */
+  pid_t pid;                /* the session's process, 0 = not known */
+  time_t start;             /* CLOCK_MONOTONIC seconds */
+  int idle;                 /* its limits, seconds (0 = none) */
+  int life;
+  int warned;               /* EXPIRE_IDLE or EXPIRE_LIFE, 0 = not yet */
+  int quiet;                /* a -x connection's stream: no warning, no shutdown */
+  struct expiry *hnext;     /* pid hash chain */
+} expiry_t;
+
+/** expire_init
+    start the timers, if any program has limits (each program
+    can have its own, -C). Needs the event loop. Returns -1 if
+    the timers can't run */
+int expire_init () ;
+/** expire_start
+    a session is starting on the client socket sock, it may go
+    idle for idle seconds and last life (0 = no limit). The socket
+    is dup'd, it is how idleness is measured (TCP_INFO, no matter
+    who reads it) and how the session is warned and ended.
+    Returns NULL if there are no limits (or no timers) */
+expiry_t *expire_start (int sock, int idle, int life) ;
+/** expire_stream
+    like expire_start, for a stream on a -x connection (sock is
+    the connection, idleness is the whole connection's). The
+    client isn't warned and the connection isn't shut down (it
+    has other streams, and a line would break its frames): the
+    session's process is killed, the client gets its MUX_EXIT */
+expiry_t *expire_stream (int sock, int idle, int life) ;
+/** expire_pid
+    the session runs in pid (killed when it expires).
+    pid -1 means it never started: x is ended */
+void expire_pid (expiry_t *x, pid_t pid) ;
+/** expire_end
+    the session ended (x may be NULL) */
+void expire_end (expiry_t *x) ;
+/** expire_end_pid
+    the session running in pid ended, if it had deadlines */
+void expire_end_pid (pid_t pid) ;
+
+#endif /* EXPIRE_H */
@@ -0,0 +1,232 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the -a argument dialogue. It used to run
+ * in the forked child with blocking reads, so a student sitting
+ * at the "arg 1: " prompt held a process and a connection slot.
+ * Now the server asks from the event loop: each client gets a
+ * small gather_t, its answers are parsed a line at a time, and
+ * the session is only started once every arg is in.
+ *
+ * Lines are peeked before they are read, so anything typed after
+ * the last arg stays in the socket for the program.
+ *
+ * The program menu (-C, more than one program on a port) is one
+ * more question asked the same way, before the args.
+ *
+ * A client gets GATHER_SECS (on the timer wheel) to answer, and
+ * when MAX_GATHERING are answering the oldest is closed for the
+ * newcomer, so idle connections can't lock everyone else out.
+ *
+ */
+
+#include "gather.h"
+#include "evloop.h"
+
+static int g_gathering = 0;         /* clients still answering */
+static int g_gather_timed = 0;      /* the prompts have deadlines */
+static gather_t *g_gather_head = NULL; /* oldest */
+static gather_t *g_gather_tail = NULL;
+
+/** _gather_free
+    the client is done with (or gone), free the args */
+void _gather_free (gather_t *g) {
+  int i;
+  g_gathering--;
+  wheel_del(&(g->timer));
+  if (NULL != g->prev) {
+    g->prev->next = g->next;
+  } else {
+    g_gather_head = g->next;
+  }
+  if (NULL != g->next) {
+    g->next->prev = g->prev;
+  } else {
+    g_gather_tail = g->prev;
+  }
+  for (i = 0; i < g->nargs; i++) {
+    free(g->args[i]);
+  }
+  free(g);
+}
+
+/** _gather_drop
+    the client went away while answering */
+void _gather_drop (gather_t *g) {
+  ev_del(g->fd);
+  close(g->fd);
+  _gather_free(g);
+}
+
+/** _gather_close
+    end a client that didn't answer, telling it why */
+void _gather_close (gather_t *g, char *why) {
+  send(g->fd, why, strlen(why), MSG_DONTWAIT | MSG_NOSIGNAL);
+  _gather_drop(g);
+}
+
+/** _gather_expired
+    timer wheel callback, the client sat at the prompt too long */
+void _gather_expired (wtimer_t *t) {
+  _gather_close((gather_t *)t, "\n*** No answer, connection closed ***\n");
+}
+
+/** _gather_prompt
+    "arg N: " (with its '\0', same as it always was), or the menu.
+    The socket buffer is empty at this point, so a short
+    write means the client is gone */
+int _gather_prompt (gather_t *g) {
+  char buf[32];
+  int len;
+  if (NULL != g->prompt) {
+    len = strlen(g->prompt);
+    return (len == send(g->fd, g->prompt, len, MSG_DONTWAIT | MSG_NOSIGNAL)) ? 0 : -1;
+  }
+  len = 1 + snprintf(buf, sizeof(buf), "arg %d: ", 1 + g->nargs);
+  return (len == send(g->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)) ? 0 : -1;
+}
+
+/** _gather_line
+    read the next line into g->line without reading past it.
+    Returns 1 for a whole line, 0 if it isn't all here yet,
+    -1 if the client is gone */
+int _gather_line (gather_t *g) {
+  int bytes, take;
+  char *nl;
+  for (;;) {
+    bytes = recv(g->fd, g->line + g->len, sizeof(g->line)-1 - g->len,
+		 MSG_PEEK | MSG_DONTWAIT);
+    if (0 > bytes && EINTR == errno) {
+      continue;
+    }
+    if (0 > bytes) {
+      return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+    }
+    if (0 == bytes) {
+      return -1;
+    }
+    nl = memchr(g->line + g->len, '\n', bytes);
+    take = (NULL == nl) ? bytes : 1 + (nl - (g->line + g->len));
+    if (take != recv(g->fd, g->line + g->len, take, MSG_DONTWAIT)) {
+      return -1;
+    }
+    g->len += take;
+    if (NULL != nl || sizeof(g->line)-1 == g->len) {
+      /* a full buffer ends the arg, like read_cli did */
+      g->line[g->len - (NULL != nl)] = '\0';
+      g->len = 0;
+      return 1;
+    }
+  }
+}
+
+/** _gather_read
+    event loop handler for a client that is answering */
+void _gather_read (int fd, int events, void *data) {
+  gather_t *g = (gather_t *)data;
+  int got;
+  while (1 == (got = _gather_line(g))) {
+    if ('\0' == g->line[0]) {
+      break; /* no more args */
+    }
+    if (NULL == (g->args[g->nargs] = strdup(g->line))) {
+      got = -1;
+      break;
+    }
+    g->nargs++;
+    if (g->nargs == g->want) {
+      break;
+    }
+    if (-1 == _gather_prompt(g)) {
+      got = -1;
+      break;
+    }
+  }
+  if (-1 == got) {
+    _gather_drop(g);
+  } else if (1 == got) {
+    ev_del(fd);
+    g->args[g->nargs] = NULL;
+    g->done(fd, g->args, g->nargs, g->data);
+    _gather_free(g);
+  }
+}
+
+/** _gather_begin
+    take the client on, asking for up to want answers */
+int _gather_begin (int clientfd, int want, char *prompt, gather_fn_t done, void *data) {
+  gather_t *g;
+  if (MAX_GATHERING <= g_gathering && NULL != g_gather_head) {
+    _gather_close(g_gather_head, "\n*** Too many clients at the prompt, connection closed ***\n");
+  }
+  if (NULL == (g = (gather_t *)calloc(1, sizeof(gather_t)))) {
+    return -1;
+  }
+  g->fd = clientfd;
+  g->want = (MAX_A < want) ? MAX_A : want;
+  g->prompt = prompt;
+  g->done = done;
+  g->data = data;
+  if (-1 == ev_add(clientfd, EV_READ, _gather_read, (void *)g)) {
+    free(g);
+    return -1;
+  }
+  g_gathering++;
+  g->prev = g_gather_tail;
+  if (NULL != g_gather_tail) {
+    g_gather_tail->next = g;
+  } else {
+    g_gather_head = g;
+  }
+  g_gather_tail = g;
+  g->timer.fn = _gather_expired;
+  if (g_gather_timed) {
+    wheel_add(&(g->timer), GATHER_SECS);
+  }
+  if (-1 == _gather_prompt(g)) {
+    _gather_drop(g);
+  }
+  return 0;
+}
+
+int gather_init () {
+  if (-1 == wheel_init()) {
+    return -1;
+  }
+  g_gather_timed = 1;
+  return 0;
+}
+
+int gather_start (int clientfd, int num_args, gather_fn_t done, void *data) {
+  return _gather_begin(clientfd, num_args, NULL, done, data);
+}
+
+int gather_menu (int clientfd, char *menu, gather_fn_t done, void *data) {
+  return _gather_begin(clientfd, 1, menu, done, data);
+}
+
+int gather_count () {
+  return g_gathering;
+}
+
+int gather_pack (char **args, int nargs, char *buf, int size) {
+  int i, n, len = 0;
+  for (i = 0; i < nargs; i++) {
+    n = 1 + strlen(args[i]);
+    if (size < len + n) {
+      break;
+    }
+    memcpy(buf + len, args[i], n);
+    len += n;
+  }
+  return len;
+}
+
+int gather_unpack (char *buf, int len, char **args, int max) {
+  int n = 0, off = 0;
+  while (off < len && n < max) {
+    args[n++] = buf + off;
+    off += 1 + strnlen(buf + off, len - off);
+  }
+  args[n] = NULL;
+  return n;
+}
@@ -0,0 +1,64 @@
+#ifndef GATHER_H
+#define GATHER_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "wheel.h"
+
+/* called once the client has answered, the args are only
+   valid until it returns (copy them, or exec/send them) */
+typedef void (*gather_fn_t)(int clientfd, char **args, int nargs, void *data);
+
+/* a client answering the "arg N: " prompts */
+typedef struct gather {
+  wtimer_t timer;            /* first, its GATHER_SECS deadline */
+  int fd;                    /* client socket */
+  int want;                  /* -a NUM_ARGS */
+  int nargs;                 /* answered so far */
+  char *args[MAX_A+1];
+  char line[MAX_STRLEN_ARG]; /* the answer being typed */
+  int len;
+  char *prompt;              /* instead of "arg N: " (gather_menu), NULL = none */
+  gather_fn_t done;
+  void *data;
+  struct gather *prev;       /* the clients answering, oldest first */
+  struct gather *next;
+} gather_t;
+
+/** gather_init
+    start the prompt deadlines (GATHER_SECS), needs the event
+    loop. Without them a client is only closed to make room */
+int gather_init () ;
+
+/** gather_start
+    prompt the client for up to num_args args from the event
+    loop, calling done once they are in (or the client sent an
+    empty line). A client that goes away, or doesn't answer in
+    GATHER_SECS, is closed and done is never called. With
+    MAX_GATHERING clients answering the oldest is closed to make
+    room. Returns -1 if the client can't be taken on */
+int gather_start (int clientfd, int num_args, gather_fn_t done, void *data) ;
+/** gather_menu
+    send the client menu and read one answer the same way,
+    done gets it as the only arg (no args for an empty line) */
+int gather_menu (int clientfd, char *menu, gather_fn_t done, void *data) ;
+/** gather_count
+    clients still answering */
+int gather_count () ;
+/** gather_pack
+    args as "ARG\0ARG\0..." in buf, for sending to a session.
+    Returns the length used */
+int gather_pack (char **args, int nargs, char *buf, int size) ;
+/** gather_unpack
+    the reverse of gather_pack, args (room for max+1) point
+    into buf. Returns the number of args */
+int gather_unpack (char *buf, int len, char **args, int max) ;
+
+#endif /* GATHER_H */
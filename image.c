@@ -0,0 +1,408 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the program's image. Every session used to
+ * exec the program by path: the path walked again, java (and an
+ * "#!/usr/bin/env python3" line) looked up on PATH again, and a TA
+ * copying a new version in mid-lab raced every session starting
+ * while the copy was half written.
+ *
+ * Now the program is checked once, at start up. An ELF program
+ * (C) is copied into a sealed memfd and sessions exec that fd
+ * (execveat): nothing can change it under them. A script's #!
+ * interpreter (or the -m one), and java, are looked up on PATH
+ * once and exec'd by fd, with the argv the kernel would have
+ * built for a #! line. The script
+ * itself is still read by its interpreter from its path (its
+ * imports are beside it).
+ *
+ * The program's directory is watched (inotify, from the event
+ * loop). When the program is replaced (written and closed, or
+ * moved in), it is checked again: an ELF program gets a new
+ * memfd, which new sessions exec from then on, while running
+ * ones keep the image they started with. A new version that
+ * isn't runnable (half an ELF file, a script without its #!) is
+ * logged and, for ELF, the old image is kept.
+ *
+ * Each program served (-C) has its own image, java is found once
+ * for all of them. Forked sessions inherit the fds. A pool worker (-P) closes
+ * everything it doesn't need, so it (and anything else that
+ * lost an fd) execs by path, the fds are checked before use.
+ *
+ */
+
+#define _GNU_SOURCE  /* execveat, memfd_create */
+#include "image.h"
+#include "evloop.h"
+#include "logger.h"
+
+static image_t g_images[MAX_PROGS];
+static int g_nimages = 0;
+static image_fd_t g_image_java = { -1 }; /* java, found on PATH once */
+static char g_image_java_path[PATH_MAX];
+static int g_image_watch = -1;           /* inotify fd */
+
+/** _image_hold
+    remember what fd is, for _image_ok */
+void _image_hold (image_fd_t *h, int fd) {
+  struct stat st;
+  h->fd = -1;
+  if (0 <= fd && 0 == fstat(fd, &st)) {
+    h->fd = fd;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+  } else if (0 <= fd) {
+    close(fd);
+  }
+}
+
+/** _image_ok
+    h still has the file it was opened on */
+int _image_ok (image_fd_t *h) {
+  struct stat st;
+  return 0 <= h->fd && 0 == fstat(h->fd, &st) &&
+    st.st_dev == h->dev && st.st_ino == h->ino;
+}
+
+/** _image_which
+    the executable name, looked up on PATH like execvp does, in out */
+int _image_which (char *name, char *out, int size) {
+  char *path = getenv("PATH"), *dir, *end;
+  struct stat st;
+  int len;
+  if (NULL != strchr(name, '/')) {
+    return (NULL == realpath(name, out)) ? -1 : 0;
+  }
+  for (dir = (NULL != path) ? path : "/bin:/usr/bin"; NULL != dir; dir = end) {
+    end = strchr(dir, ':');
+    len = (NULL != end) ? (int)(end - dir) : (int)strlen(dir);
+    if (NULL != end) {
+      end++;
+    }
+    if (size > snprintf(out, size, "%.*s/%s", len, (0 < len) ? dir : ".", name) &&
+	0 == stat(out, &st) && S_ISREG(st.st_mode) && 0 == access(out, X_OK)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** _image_tool
+    look name up on PATH into path, and hold it */
+int _image_tool (char *name, char *path, int size, image_fd_t *h) {
+  if (-1 == _image_which(name, path, size)) {
+    return -1;
+  }
+  _image_hold(h, open(path, O_PATH | O_CLOEXEC));
+  return (0 <= h->fd) ? 0 : -1;
+}
+
+/** _image_find
+    the image of the program at path, NULL if there isn't one */
+image_t *_image_find (char *path) {
+  int i;
+  for (i = 0; i < g_nimages; i++) {
+    if (0 == strcmp(path, g_images[i].path)) {
+      return &(g_images[i]);
+    }
+  }
+  return NULL;
+}
+
+/** _image_elf
+    copy the ELF program (open on fd, size bytes) into a sealed
+    memfd. Returns it, or -1 */
+int _image_elf (image_t *im, int fd, off_t size) {
+  char buf[IMAGE_COPY];
+  int mfd, n;
+  off_t done = 0;
+#ifdef MFD_EXEC
+  mfd = memfd_create(im->name, MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_EXEC);
+  if (-1 == mfd && EINVAL == errno) /* an older kernel */
+#endif
+    mfd = memfd_create(im->name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (-1 == mfd) {
+    return -1;
+  }
+  while (done < size && 0 < (n = pread(fd, buf, sizeof(buf), done))) {
+    if (n != write(mfd, buf, n)) {
+      break;
+    }
+    done += n;
+  }
+  if (done != size ||
+      -1 == fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+    close(mfd);
+    return -1;
+  }
+  return mfd;
+}
+
+/** _image_interp
+    find the interpreter named in im->interp_buf (a #! line, or
+    the -m interpreter) and hold it. "/usr/bin/env NAME" is
+    looked up here instead */
+int _image_interp (image_t *im) {
+  char *interp, *arg;
+  interp = strtok(im->interp_buf, " \t\r");
+  arg = strtok(NULL, "\r"); /* the rest, one argument like the kernel does */
+  while (NULL != arg && (' ' == *arg || '\t' == *arg)) {
+    arg++;
+  }
+  if (NULL == interp) {
+    return -1;
+  }
+  if (0 == strcmp(interp, "/usr/bin/env") && NULL != arg && '-' != *arg &&
+      NULL == strpbrk(arg, " \t")) {
+    interp = arg; /* env would search PATH for it at every exec */
+    arg = NULL;
+  }
+  im->interp_arg = (NULL != arg && '\0' != *arg) ? arg : NULL;
+  return _image_tool(interp, im->interp_path, sizeof(im->interp_path), &(im->interp));
+}
+
+/** _image_shebang
+    the interpreter on the #! line in buf (len bytes) */
+int _image_shebang (image_t *im, char *buf, int len) {
+  char *nl;
+  if (NULL == (nl = memchr(buf, '\n', len))) { /* a longer line isn't runnable */
+    return -1;
+  }
+  memcpy(im->interp_buf, buf + 2, nl - buf - 2);
+  im->interp_buf[nl - buf - 2] = '\0';
+  return _image_interp(im);
+}
+
+/** _image_load
+    check the program, and take its new image if it is ELF.
+    Returns -1 (keeping any old image) if it isn't runnable */
+int _image_load (image_t *im) {
+  char buf[IMAGE_SHEBANG];
+  struct stat st;
+  int fd, len, mfd;
+
+  if (-1 == (fd = open(im->path, O_RDONLY | O_CLOEXEC)) ||
+      -1 == fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    if (-1 != fd) {
+      close(fd);
+    }
+    return -1;
+  }
+  len = pread(fd, buf, sizeof(buf), 0);
+  if (4 <= len && 0 == memcmp(buf, "\177ELF", 4)) {
+    if (0 == access(im->path, X_OK) && -1 != (mfd = _image_elf(im, fd, st.st_size))) {
+      if (-1 != im->elf.fd) {
+	close(im->elf.fd); /* sessions running it have their own */
+      }
+      _image_hold(&(im->elf), mfd);
+      snprintf(im->proc, sizeof(im->proc), "/proc/self/fd/%d", mfd);
+      if (0 != access(im->proc, X_OK)) {
+	im->proc[0] = '\0';
+      }
+      close(fd);
+      im->loads++;
+      return 0;
+    }
+  } else if (2 <= len && 0 == memcmp(buf, "#!", 2)) {
+    close(fd);
+    if (-1 != im->interp.fd) {
+      close(im->interp.fd); /* the new version's #! may differ */
+      im->interp.fd = -1;
+    }
+    if (0 == access(im->path, X_OK) && 0 == _image_shebang(im, buf, len)) {
+      im->loads++;
+      return 0;
+    }
+    return -1;
+  }
+  close(fd);
+  return -1;
+}
+
+/** _image_argv
+    what the kernel makes of #!: interpreter [arg] script args,
+    malloc'd. NULL if it can't be */
+char **_image_argv (image_t *im, char **argv) {
+  char **iargv;
+  int skip = (NULL != im->mode) ? 2 : 1; /* -m: argv is "-m" name args */
+  int n = 0, i = 0;
+  while (NULL != argv[n]) {
+    n++;
+  }
+  if (NULL == (iargv = (char **)malloc((n + 3) * sizeof(char *)))) {
+    return NULL;
+  }
+  iargv[i++] = im->interp_path;
+  if (NULL != im->interp_arg) {
+    iargv[i++] = im->interp_arg;
+  }
+  iargv[i++] = im->path;
+  memcpy(iargv + i, argv + skip, (n - skip + 1) * sizeof(char *)); /* and the NULL */
+  return iargv;
+}
+
+int image_open (char *path, int java, char *mode) {
+  char *slash;
+  image_t *im;
+  if (MAX_PROGS == g_nimages) {
+    return -1;
+  }
+  im = &(g_images[g_nimages]);
+  bzero(im, sizeof(image_t));
+  im->path = path;
+  im->java = java;
+  im->wd = -1;
+  im->elf.fd = im->interp.fd = -1;
+  if (java) {
+    /* the classes are the JVM's to load (and cds.c's to watch),
+       java itself is found now, once for every program */
+    if (NULL == (im->name = (char *)malloc(PATH_MAX))) {
+      return -1;
+    }
+    slash = strrchr(path, '/');
+    snprintf(im->name, PATH_MAX, "%s.class", (NULL != slash) ? slash + 1 : path);
+    g_nimages++;
+    if (-1 == g_image_java.fd &&
+	-1 == _image_tool("java", g_image_java_path, sizeof(g_image_java_path), &g_image_java)) {
+      dprintf(STDERR_FILENO, "java isn't on PATH\n");
+      return -1;
+    }
+    return 0;
+  }
+  slash = strrchr(path, '/');
+  im->name = (NULL != slash) ? slash + 1 : path;
+  g_nimages++;
+  if (NULL != mode) {
+    /* the script is the interpreter's to read, it is found now */
+    im->mode = mode;
+    snprintf(im->interp_buf, sizeof(im->interp_buf), "%s", mode);
+    if (-1 == _image_interp(im)) {
+      dprintf(STDERR_FILENO, "%s isn't on PATH\n", mode);
+      return -1;
+    }
+    return 0;
+  }
+  if (-1 == _image_load(im)) {
+    dprintf(STDERR_FILENO, "%s isn't an executable program (ELF, or a script with #!)\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/** _image_changed
+    event loop handler for the inotify fd */
+void _image_changed (int fd, int events, void *data) {
+  char buf[IMAGE_EVENTS] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  int changed[MAX_PROGS];
+  image_t *im;
+  int n, off, i;
+  bzero(changed, sizeof(changed));
+  while (0 < (n = read(fd, buf, sizeof(buf)))) {
+    for (off = 0; off < n; off += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)(buf + off);
+      for (i = 0; 0 < ev->len && i < g_nimages; i++) {
+	if (ev->wd == g_images[i].wd && 0 == strcmp(ev->name, g_images[i].name)) {
+	  changed[i] = 1;
+	}
+      }
+    }
+  }
+  for (i = 0; i < g_nimages; i++) {
+    im = &(g_images[i]);
+    if (!changed[i]) {
+      continue;
+    }
+    if (im->java) {
+      log_msg("%s changed, new sessions get the new classes", im->name);
+    } else if (NULL != im->mode) {
+      log_msg("%s changed, new sessions get the new version", im->name);
+    } else if (0 == _image_load(im)) {
+      log_msg("%s changed, new sessions get the new version", im->name);
+    } else if (-1 != im->elf.fd) {
+      log_msg("%s changed but isn't runnable, new sessions still get the old version", im->name);
+    } else {
+      log_msg("%s changed but isn't runnable", im->name);
+    }
+  }
+}
+
+int image_watch () {
+  char dir[PATH_MAX];
+  char *slash;
+  int i;
+  if (0 == g_nimages) {
+    return -1;
+  }
+  g_image_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (-1 == g_image_watch || -1 == ev_add(g_image_watch, EV_READ, _image_changed, NULL)) {
+    log_msg("Unable to watch the programs for a new version");
+    if (-1 != g_image_watch) {
+      close(g_image_watch);
+      g_image_watch = -1;
+    }
+    return -1;
+  }
+  for (i = 0; i < g_nimages; i++) {
+    snprintf(dir, sizeof(dir), "%s", g_images[i].path);
+    if (NULL != (slash = strrchr(dir, '/'))) {
+      *slash = '\0';
+    }
+    /* programs in the same directory get the same wd */
+    g_images[i].wd = inotify_add_watch(g_image_watch, ('\0' != dir[0]) ? dir : "/",
+				       IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (-1 == g_images[i].wd) {
+      log_msg("Unable to watch %s for a new version", g_images[i].path);
+    }
+  }
+  return 0;
+}
+
+void image_exec (char *file, char **argv) {
+  extern char **environ;
+  image_t *im;
+  char **iargv;
+
+  if (0 == strcmp(file, "java")) {
+    if (_image_ok(&g_image_java)) {
+      execveat(g_image_java.fd, "", argv, environ, AT_EMPTY_PATH);
+    }
+    return;
+  }
+  if (NULL == (im = _image_find(file))) {
+    return;
+  }
+  if (_image_ok(&(im->elf))) {
+    execveat(im->elf.fd, "", argv, environ, AT_EMPTY_PATH);
+    return;
+  }
+  if ((_image_ok(&(im->interp)) || NULL != im->mode) &&
+      NULL != (iargv = _image_argv(im, argv))) {
+    if (_image_ok(&(im->interp))) {
+      execveat(im->interp.fd, "", iargv, environ, AT_EMPTY_PATH);
+    }
+    /* an interpreter that is itself a script can't be run from
+       an fd closed on exec, and the fd may be gone: by its path */
+    execv(im->interp_path, iargv);
+    free(iargv);
+  }
+}
+
+char *image_file (char *file, char ***argv) {
+  image_t *im;
+  char **iargv;
+  if (0 == strcmp(file, "java")) {
+    return _image_ok(&g_image_java) ? g_image_java_path : file;
+  }
+  if (NULL == (im = _image_find(file))) {
+    return file;
+  }
+  if (_image_ok(&(im->elf))) {
+    return ('\0' != im->proc[0]) ? im->proc : file;
+  }
+  if (!(_image_ok(&(im->interp)) || NULL != im->mode) ||
+      NULL == (iargv = _image_argv(im, *argv))) {
+    return file;
+  }
+  *argv = iargv;
+  return im->interp_path;
+}
@@ -0,0 +1,67 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* an fd held to exec, and what it was opened on (a forked
+   session may have closed it and reused the number) */
+typedef struct image_fd {
+  int fd;                    /* -1 = none */
+  dev_t dev;
+  ino_t ino;
+} image_fd_t;
+
+/* a program, and what runs it */
+typedef struct image {
+  char *path;                /* abs_path */
+  char *name;                /* the file that is watched (.class for java) */
+  int java;                  /* run by java (the tool below) */
+  int wd;                    /* inotify watch of its directory */
+  image_fd_t elf;            /* sealed copy of an ELF program */
+  char proc[32];             /* /proc/self/fd/N of it, "" = no /proc */
+  char *mode;                /* the -m interpreter, NULL = the #! line */
+  image_fd_t interp;         /* a script's interpreter, found on PATH once */
+  char interp_path[PATH_MAX];
+  char *interp_arg;          /* its argument, NULL = none */
+  char interp_buf[IMAGE_SHEBANG];
+  int loads;
+} image_t;
+
+/** image_open
+    check the program at path (java: path.class) once, before
+    any session: an ELF program is copied into a sealed memfd
+    that sessions exec (it can't change under them), a script's
+    #! interpreter (mode, the -m one, if not NULL) and java are
+    looked up on PATH now instead of at every exec. Each
+    program served (-C) is opened.
+    Returns -1 if the program isn't there or isn't runnable
+    (sessions exec it by path, as before) */
+int image_open (char *path, int java, char *mode) ;
+/** image_watch
+    from the event loop (each acceptor its own), reload a
+    program when it is replaced, so new sessions get the new
+    version and running ones keep theirs */
+int image_watch () ;
+/** image_exec
+    in a session's child: exec file (a program, or "java")
+    from what image_open holds. Returns only if it can't, the
+    caller execs by path */
+void image_exec (char *file, char **argv) ;
+/** image_file
+    the file for the spawn backends to exec in place of file,
+    *argv may be replaced (malloc'd) as exec_file does */
+char *image_file (char *file, char ***argv) ;
+
+#endif /* IMAGE_H */
@@ -0,0 +1,165 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the server side of the resident JVM (-J).
+ * SessionHost.java runs every session of the .java program in one
+ * JVM, a thread and a class loader per client. The server connects
+ * to it over a unix socket once per client and relays the bytes.
+ *
+ */
+
+#define _GNU_SOURCE  /* pipe2 */
+#include "jvmhost.h"
+#include "gather.h"
+#include "logger.h"
+
+/** _jvm_source
+    SessionHost.java lives next to the server executable */
+int _jvm_source (char *buf, int len) {
+  char exe[PATH_MAX];
+  bzero(exe, sizeof(exe));
+  if (0 >= readlink("/proc/self/exe", exe, sizeof(exe)-1)) {
+    return -1;
+  }
+  char *slash = strrchr(exe, '/');
+  if (NULL == slash) {
+    return -1;
+  }
+  *slash = '\0';
+  snprintf(buf, len, "%s/SessionHost.java", exe);
+  return access(buf, R_OK);
+}
+
+/** _jvm_ready
+    wait for the host's "ready" line on rfd, it closes the pipe
+    without one if it can't start */
+int _jvm_ready (int rfd) {
+  struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+  char c;
+  int n;
+
+  do {
+    n = poll(&pfd, 1, JVM_START_SECS * 1000);
+  } while (-1 == n && EINTR == errno);
+  if (1 != n || 1 != read(rfd, &c, 1)) {
+    return -1;
+  }
+  return 0;
+}
+
+jvm_t *jvm_create (char *abs_path) {
+  char src[PATH_MAX];
+  char dir[PATH_MAX];
+  char *cls;
+  int pfd[2];
+  int rfd[2];
+  int status;
+
+  if (-1 == _jvm_source(src, sizeof(src))) {
+    log_msg("SessionHost.java not found next to the server");
+    return NULL;
+  }
+  bzero(dir, sizeof(dir));
+  strncpy(dir, abs_path, sizeof(dir)-1);
+  cls = strrchr(dir, '/');
+  if (NULL == cls) {
+    return NULL;
+  }
+  *cls = '\0';
+  cls++;
+
+  jvm_t *j = (jvm_t *)calloc(1, sizeof(jvm_t));
+  if (NULL == j) {
+    return NULL;
+  }
+  /* only our uid may connect, a session there bypasses -c, -w and -L */
+  strcpy(j->dir, "/tmp/ta_server_jvm_XXXXXX");
+  if (NULL == mkdtemp(j->dir)) {
+    free(j);
+    return NULL;
+  }
+  snprintf(j->sock, sizeof(j->sock), "%s/sock", j->dir);
+  if (-1 == pipe2(pfd, O_CLOEXEC)) {
+    rmdir(j->dir);
+    free(j);
+    return NULL;
+  }
+  if (-1 == pipe2(rfd, O_CLOEXEC)) {
+    close(pfd[0]);
+    close(pfd[1]);
+    rmdir(j->dir);
+    free(j);
+    return NULL;
+  }
+
+  char *argv[] = { "java", "-Djava.security.manager=allow",
+		   src, j->sock, dir, cls, NULL };
+  pid_t chid = fork ();
+  if (0 > chid) {
+    close(pfd[0]);
+    close(pfd[1]);
+    close(rfd[0]);
+    close(rfd[1]);
+    rmdir(j->dir);
+    free(j);
+    return NULL;
+  }
+  if (0 == chid) {
+    close(pfd[1]);
+    close(rfd[0]);
+    if (0 != fork ()) {
+      _exit(0);
+    }
+    dup2(pfd[0], STDIN_FILENO);
+    dup2(rfd[1], STDOUT_FILENO); /* "ready", then the host closes it */
+    execvp(argv[0], argv);
+    dprintf(STDERR_FILENO, "Unable to start the JVM session host\n");
+    _exit(12);
+  }
+  close(pfd[0]);
+  close(rfd[1]);
+  waitpid(chid, &status, 0);
+  j->ctl = pfd[1];
+  if (-1 == _jvm_ready(rfd[0])) {
+    close(rfd[0]);
+    jvm_destroy(j); /* closing ctl stops it, if it is still starting */
+    return NULL;
+  }
+  close(rfd[0]);
+  return j;
+}
+
+relay_t *jvm_handoff (jvm_t *j, int clientfd, char **args, int nargs,
+		      void (*on_close)(relay_t *r, void *data), void *data) {
+  struct sockaddr_un addr;
+  char hdr[1+MAX_PACKED_ARGS];
+  relay_t *r = NULL;
+  int len;
+
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, j->sock, sizeof(addr.sun_path)-1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (-1 == fd) {
+    return NULL;
+  }
+  if (-1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd); /* gone */
+    return NULL;
+  }
+  /* "ARG\0...\0", the args the server gathered */
+  len = gather_pack(args, nargs, hdr, MAX_PACKED_ARGS);
+  hdr[len++] = '\0';
+  if (len != write(fd, hdr, len) ||
+      NULL == (r = relay_start(clientfd, fd, fd, on_close, data))) {
+    close(fd);
+    return NULL;
+  }
+  return r;
+}
+
+void jvm_destroy (jvm_t *j) {
+  close(j->ctl);
+  unlink(j->sock);
+  rmdir(j->dir);
+  free(j);
+}
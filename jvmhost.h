@@ -0,0 +1,46 @@
+#ifndef JVMHOST_H
+#define JVMHOST_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "relay.h"
+
+/* one resident JVM (SessionHost.java) running every session */
+typedef struct jvm {
+  char dir[32];        /* private, 0700 */
+  char sock[sizeof(((struct sockaddr_un *)0)->sun_path)]; /* where it listens, in dir */
+  int ctl;             /* its stdin, the JVM exits when this closes */
+} jvm_t;
+
+/** jvm_create
+    start "java SessionHost.java SOCKET DIR CLASS" for the
+    program at abs_path (DIR/CLASS), listening on a socket in a
+    private /tmp/ta_server_jvm_XXXXXX directory. Waits up to
+    JVM_START_SECS for the host to listen, and returns NULL if it
+    doesn't (or can't trap System.exit, java 24 and newer). Like the
+    zygote it is double forked, so call it before SIGCHLD is handled */
+jvm_t *jvm_create (char *abs_path) ;
+/** jvm_handoff
+    connect a session to the JVM, pass it the gathered args and
+    relay clientfd to it. Returns the relay, or NULL if the JVM isn't
+    accepting (gone), the caller should fall back to exec */
+relay_t *jvm_handoff (jvm_t *j, int clientfd, char **args, int nargs,
+		      void (*on_close)(relay_t *r, void *data), void *data) ;
+/** jvm_destroy
+    stop the JVM and remove its socket and directory */
+void jvm_destroy (jvm_t *j) ;
+
+#endif /* JVMHOST_H */
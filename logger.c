@@ -0,0 +1,328 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the log. log_put_msg used to call time,
+ * localtime and strftime and then dprintf straight to the log
+ * file for every line, a timezone lookup and a write on the
+ * accept path. Now the server thread only formats the line into
+ * a ring buffer (single producer, single consumer, no locks) and
+ * a log thread writes whole batches with writev. The date is
+ * cached and only rebuilt when the (coarse) clock's second changes.
+ * An idle log thread sleeps in poll, a line queued while it does
+ * wakes it through an eventfd (only then, busy it isn't signalled).
+ *
+ * With -bg and -l the log file is rotated by size: it becomes
+ * ta_server_log_PID.1 and a new one is started.
+ *
+ * The log thread also writes the session transcripts (-v). A
+ * relay tees each chunk into a pipe, the thread splices it into
+ * the transcript, so the server thread never waits on the disk.
+ *
+ */
+
+#define _GNU_SOURCE  /* splice, pipe2 */
+#include "logger.h"
+
+static log_slot_t g_log_ring[LOG_SLOTS];
+static unsigned int g_log_head = 0;     /* next slot the server fills */
+static unsigned int g_log_tail = 0;     /* next slot the log thread writes */
+static unsigned long g_log_dropped = 0; /* lines lost to a full ring */
+static volatile int g_log_stop = 0;
+static int g_log_running = 0;
+static int g_log_idle = 0;              /* the log thread is about to sleep */
+static int g_log_wake = -1;             /* eventfd, wakes it */
+static pthread_t g_log_thread;
+static char *g_log_path = NULL;         /* file to rotate, NULL = don't */
+static long g_log_rotate = 0;
+
+/* transcripts, shared with the log thread */
+static pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_script_t *g_log_scripts = NULL;
+static int g_log_nscripts = 0;
+static int g_log_maxscripts = 0;
+
+/* only the server thread touches these */
+static time_t g_log_sec = -1;           /* second g_log_date is for */
+static char g_log_date[64];
+
+/** _log_wake
+    wake the log thread */
+void _log_wake () {
+  uint64_t one = 1;
+  write(g_log_wake, &one, sizeof(one));
+}
+
+/** _log_write
+    write the whole batch, finishing a short writev by hand */
+void _log_write (struct iovec *iov, int n) {
+  ssize_t bytes = writev(STDOUT_FILENO, iov, n);
+  int i;
+  if (0 > bytes) {
+    return; /* nowhere to log, the lines are lost */
+  }
+  for (i = 0; i < n; i++) {
+    if (bytes >= (ssize_t)iov[i].iov_len) {
+      bytes -= iov[i].iov_len;
+      continue;
+    }
+    write(STDOUT_FILENO, (char *)iov[i].iov_base + bytes, iov[i].iov_len - bytes);
+    bytes = 0;
+  }
+}
+
+/** _log_rotate
+    move a full log file to PATH.1 and start a new one.
+    Another acceptor may have done it already, then
+    only the new file is opened */
+void _log_rotate () {
+  struct stat cur, named;
+  char old[PATH_MAX];
+  int fd;
+  if (NULL == g_log_path || 0 >= g_log_rotate || -1 == fstat(STDOUT_FILENO, &cur)) {
+    return;
+  }
+  if (0 == stat(g_log_path, &named) && named.st_ino == cur.st_ino) {
+    if (cur.st_size < g_log_rotate) {
+      return;
+    }
+    snprintf(old, sizeof(old), "%s.1", g_log_path);
+    rename(g_log_path, old);
+  }
+  fd = open(g_log_path, O_CLOEXEC | O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (-1 == fd) {
+    return;
+  }
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  close(fd);
+}
+
+/** _log_flush
+    write everything in the ring. Returns the lines written */
+int _log_flush () {
+  struct iovec iov[LOG_BATCH];
+  unsigned int tail = g_log_tail;
+  unsigned int head = __atomic_load_n(&g_log_head, __ATOMIC_SEQ_CST); /* after g_log_idle */
+  unsigned long dropped;
+  char msg[64];
+  int n = 0, total = 0;
+
+  while (tail != head) {
+    for (n = 0; n < LOG_BATCH && tail + n != head; n++) {
+      iov[n].iov_base = g_log_ring[(tail + n) % LOG_SLOTS].buf;
+      iov[n].iov_len = g_log_ring[(tail + n) % LOG_SLOTS].len;
+    }
+    _log_write(iov, n);
+    tail += n;
+    total += n;
+    __atomic_store_n(&g_log_tail, tail, __ATOMIC_RELEASE);
+  }
+  if (0 != (dropped = __atomic_exchange_n(&g_log_dropped, 0, __ATOMIC_RELAXED))) {
+    n = snprintf(msg, sizeof(msg), "(%lu log lines dropped)\n", dropped);
+    write(STDOUT_FILENO, msg, n);
+  }
+  if (0 < total) {
+    _log_rotate();
+  }
+  return total;
+}
+
+void log_msg (const char *fmt, ...) {
+  struct timespec now;
+  struct tm tm;
+  log_slot_t *slot;
+  va_list ap;
+  int len;
+  unsigned int head = __atomic_load_n(&g_log_head, __ATOMIC_RELAXED);
+
+  if (LOG_SLOTS == head - __atomic_load_n(&g_log_tail, __ATOMIC_ACQUIRE)) {
+    __atomic_add_fetch(&g_log_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  if (now.tv_sec != g_log_sec) {
+    g_log_sec = now.tv_sec;
+    localtime_r(&(now.tv_sec), &tm);
+    strftime(g_log_date, sizeof(g_log_date), "%a %d %b %Y %H:%M:%S", &tm);
+  }
+  slot = &(g_log_ring[head % LOG_SLOTS]);
+  len = snprintf(slot->buf, LOG_LINE, "%s - ", g_log_date);
+  va_start(ap, fmt);
+  len += vsnprintf(slot->buf + len, LOG_LINE - len, fmt, ap);
+  va_end(ap);
+  if (LOG_LINE-1 <= len) {
+    len = LOG_LINE-2; /* cut long lines */
+  }
+  slot->buf[len++] = '\n';
+  slot->len = len;
+  __atomic_store_n(&g_log_head, head+1, __ATOMIC_SEQ_CST);
+  if (!g_log_running) {
+    _log_flush(); /* no log thread (yet) */
+  } else if (__atomic_exchange_n(&g_log_idle, 0, __ATOMIC_SEQ_CST)) {
+    _log_wake();
+  }
+}
+
+/** _log_script
+    move what is waiting in the transcript's pipe to the file. Returns 1 if the transcript is finished (the relay
+    closed its end, or the file can't be written) */
+int _log_script (log_script_t *t) {
+  ssize_t n;
+  for (;;) {
+    n = splice(t->pipe, NULL, t->fd, NULL, LOG_SCRIPT_CHUNK,
+	       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (0 < n) {
+      continue;
+    }
+    if (0 > n && EINTR == errno) {
+      continue;
+    }
+    return !(0 > n && EAGAIN == errno);
+  }
+}
+
+/** _log_scripts
+    write what the transcripts have. With wait, sleep until
+    there is some, a line is queued or a transcript is added.
+    Finished transcripts are closed, the relay then gets
+    EPIPE and stops recording if it hadn't already */
+void _log_scripts (int wait) {
+  struct pollfd *pfd;
+  uint64_t n64;
+  int i, n;
+  pthread_mutex_lock(&g_log_lock);
+  n = g_log_nscripts;
+  pfd = (struct pollfd *)malloc((n+1) * sizeof(*pfd));
+  for (i = 0; NULL != pfd && i < n; i++) {
+    pfd[i].fd = g_log_scripts[i].pipe;
+    pfd[i].events = POLLIN;
+  }
+  pthread_mutex_unlock(&g_log_lock);
+  if (NULL == pfd) {
+    return; /* try again */
+  }
+  pfd[n].fd = g_log_wake;
+  pfd[n].events = POLLIN;
+  if (0 < poll(pfd, n+1, wait ? -1 : 0)) {
+    if (0 != pfd[n].revents) {
+      read(g_log_wake, &n64, sizeof(n64));
+    }
+    /* only the log thread removes transcripts, the first n are still pfd's */
+    pthread_mutex_lock(&g_log_lock);
+    for (i = n-1; 0 <= i; i--) {
+      if (0 != pfd[i].revents && _log_script(&(g_log_scripts[i]))) {
+	close(g_log_scripts[i].pipe);
+	close(g_log_scripts[i].fd);
+	g_log_scripts[i] = g_log_scripts[--g_log_nscripts];
+      }
+    }
+    pthread_mutex_unlock(&g_log_lock);
+  }
+  free(pfd);
+}
+
+/** _log_main
+    the log thread */
+void *_log_main (void *arg) {
+  int i;
+  while (!g_log_stop) {
+    __atomic_store_n(&g_log_idle, 1, __ATOMIC_SEQ_CST);
+    if (0 < _log_flush()) {
+      __atomic_store_n(&g_log_idle, 0, __ATOMIC_SEQ_CST);
+      _log_scripts(0);
+    } else {
+      _log_scripts(1); /* log_msg sees g_log_idle and wakes it */
+    }
+  }
+  _log_flush();
+  pthread_mutex_lock(&g_log_lock);
+  for (i = 0; i < g_log_nscripts; i++) {
+    _log_script(&(g_log_scripts[i]));
+  }
+  pthread_mutex_unlock(&g_log_lock);
+  return NULL;
+}
+
+/** _log_thread
+    start the thread with every signal blocked,
+    they are for the server thread */
+int _log_thread () {
+  sigset_t all, old;
+  int err = -1;
+  if (-1 != g_log_wake) {
+    close(g_log_wake); /* after fork, the parent's */
+  }
+  g_log_idle = 0;
+  g_log_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (-1 != g_log_wake) {
+    err = pthread_create(&g_log_thread, NULL, _log_main, NULL);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (0 != err) {
+    dprintf(STDERR_FILENO, "Unable to start the log thread, logging directly\n");
+    return -1;
+  }
+  g_log_running = 1;
+  return 0;
+}
+
+int log_start (char *path, long rotate) {
+  g_log_path = path;
+  g_log_rotate = rotate;
+  g_log_stop = 0;
+  return _log_thread();
+}
+
+int log_after_fork () {
+  int i;
+  pthread_mutex_init(&g_log_lock, NULL);
+  for (i = 0; i < g_log_nscripts; i++) {
+    close(g_log_scripts[i].pipe); /* the parent's sessions */
+    close(g_log_scripts[i].fd);
+  }
+  g_log_nscripts = 0;
+  g_log_tail = g_log_head;
+  g_log_stop = 0;
+  return _log_thread();
+}
+
+void log_stop () {
+  if (!g_log_running) {
+    _log_flush();
+    return;
+  }
+  g_log_stop = 1;
+  _log_wake();
+  pthread_join(g_log_thread, NULL);
+  g_log_running = 0;
+}
+
+int log_transcript (int fd) {
+  int p[2];
+  log_script_t *more;
+  if (!g_log_running || -1 == pipe2(p, O_CLOEXEC | O_NONBLOCK)) {
+    close(fd);
+    return -1;
+  }
+  pthread_mutex_lock(&g_log_lock);
+  if (g_log_nscripts == g_log_maxscripts) {
+    more = (log_script_t *)realloc(g_log_scripts,
+				   (g_log_maxscripts + 64) * sizeof(log_script_t));
+    if (NULL == more) {
+      pthread_mutex_unlock(&g_log_lock);
+      close(p[0]);
+      close(p[1]);
+      close(fd);
+      return -1;
+    }
+    g_log_scripts = more;
+    g_log_maxscripts += 64;
+  }
+  g_log_scripts[g_log_nscripts].pipe = p[0];
+  g_log_scripts[g_log_nscripts].fd = fd;
+  g_log_nscripts++;
+  pthread_mutex_unlock(&g_log_lock);
+  _log_wake(); /* to poll it too */
+  return p[1];
+}
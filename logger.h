@@ -0,0 +1,62 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* one line waiting to be written */
+typedef struct log_slot {
+  int len;
+  char buf[LOG_LINE];
+} log_slot_t;
+
+/* a session transcript (-v) the log thread writes */
+typedef struct log_script {
+  int pipe;         /* what the relay tees, the read end */
+  int fd;           /* the transcript file */
+} log_script_t;
+
+/** log_msg
+    "DATE - MESSAGE\n" to the log (stdout, the log file with -bg).
+    Never blocks: the line is formatted into a ring buffer and
+    written later by the log thread. If the ring is full the
+    line is dropped (and the drop is counted) */
+void log_msg (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+/** log_start
+    start the log thread. With path (the -bg log file) and
+    rotate > 0, the file is moved to PATH.1 once it reaches
+    rotate bytes and a new one is started */
+int log_start (char *path, long rotate) ;
+/** log_after_fork
+    in a forked child that keeps running the server (an -n
+    acceptor): threads don't survive fork, start a new one.
+    Lines the parent hadn't written yet are the parent's */
+int log_after_fork () ;
+/** log_transcript
+    the log thread takes fd (a session transcript) and writes
+    whatever is put in the returned pipe (non-blocking) to it.
+    Closing the pipe finishes the transcript. -1 (fd is closed)
+    if there is no log thread or no pipe. If the file can't be
+    written the thread closes its end, writes then get EPIPE */
+int log_transcript (int fd) ;
+/** log_stop
+    write everything left and stop the log thread */
+void log_stop () ;
+
+#endif /* LOGGER_H */
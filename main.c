@@ -15,7 +15,8 @@
  *
  * For java:
  *   The necessary .class and .java files should be in the
- *   directory.
+ *   directory. The server builds an AppCDS archive for the
+ *   program in .ta_cds/ and uses it once it is ready.
  *    $ ./main -r program.java
  *    $ ./main -r program.java
  *
@@ -44,14 +45,109 @@
  *    [-a NUM_ARGS] (int)instructs the server to request up to NUM_ARGS from client, and passing them
  *                        in the call to exec. The arg gathering ends when NUM_ARGS have been collected,
  *                        or if the client enters an empty string for an arg.
+ *                        (the server asks from its event loop, a client that hasn't
+ *                         answered yet doesn't hold a process or a connection slot.
+ *                         It has 2 minutes to answer, and with 256 clients at the
+ *                         prompts the oldest is closed to make room)
  *    [-m MODE]  (str)  intstructs the server to use MODE as the interpreter
  *                        (this flag is useful for specifying python vs python3, for example)
- *    !![-v]            instructs the server to record its session
- *                        (if the server is run with -bg, this is recoreded
- *                         in file 'ta_server_log_PID')
+ *    [-v]              instructs the server to record its sessions, each one
+ *                        in file 'ta_server_log_PID_N' (the server's own log,
+ *                        with -bg, is 'ta_server_log_PID'). Both directions are
+ *                        timestamped and marked "in" (client) or "out" (program)
+ *    [-l MB]    (int)  with -bg, move the log file to 'ta_server_log_PID.1' once it
+ *                        reaches MB megabytes, and start a new one (0 = never, the default)
  *    [-bg]             put the server in the background
+ *    [-e BACKEND] (str) event loop to use, epoll (default), select or uring
+ *                        (io_uring: one syscall per round of the loop, the listener
+ *                         hands over clients with multishot accept; falls back to
+ *                         epoll if the kernel doesn't have it)
+ *    [-P NUM]   (int)  keep NUM workers forked and parked, waiting for clients
+ *                        (0 by default, fork when the client connects). A .py
+ *                        program's workers park in its interpreter (zygote.py), with
+ *                        its imports done, so they save the interpreter's startup.
+ *                        Other workers stop just short of exec and only save the
+ *                        fork (a .java program's JVM startup: -J)
+ *    [-z]              python only: start one interpreter (zygote.py) that preloads
+ *                        the program's imports and forks a session per client
+ *    [-J]              java only: run every session in one resident JVM (SessionHost.java),
+ *                        a thread and class loader per client (needs java 16+)
+ *    [-s SPAWN] (str)  how sessions are started: fork (default), spawn (posix_spawn)
+ *                        or vfork (clone with CLONE_VM|CLONE_VFORK). spawn and vfork
+ *                        don't copy the server's page tables
+ *    [-n NUM]   (int)  run NUM acceptor processes, each with its own SO_REUSEPORT
+ *                        listener on the port (the kernel spreads the clients),
+ *                        sharing one connection limit. Each has its own pool (-P)
+ *                        and zygote (-z), the JVM (-J) is shared (1 by default)
+ *    [-c CONNS] (int)  run at most CONNS sessions at once (35 by default)
+ *    [-w WAITING] (int) once CONNS are running, up to WAITING more clients wait in line
+ *                        (told their place and an estimated wait) instead of
+ *                        getting "Server Busy" (64 by default, 0 = no waiting)
+ *    [-T]              run the program on a pseudo-terminal, relayed to the client,
+ *                        so its output isn't block buffered (not with -J)
+ *    [-M WHERE] (str)  serve metrics (Prometheus text over HTTP) on port WHERE,
+ *                        or on the Unix socket WHERE if it isn't a number:
+ *                        sessions, rejects, waiting room, accept queue, spawn and
+ *                        first output latency, session length, exit codes
+ *                        ( -M 9100  OR  -M /tmp/ta.sock ; curl localhost:9100 )
+ *    [-i IDLE]  (int)  end a session once the client hasn't typed anything for IDLE
+ *    [-I LIFE]  (int)  end a session once it has run for LIFE
+ *                        (minutes, or s, m, h, d like -t; 0 = no limit, the default.
+ *                         The client is warned a minute before, input in that
+ *                         time clears an idle warning)
+ *                        ( -i 20 -I 2h : 20 minutes idle, 2 hours in all )
+ *    [-g LIMITS] (str) each session's program gets its own cgroup v2 with these limits:
+ *                        cpu=PCT of one CPU, mem=MB, pids=N (comma separated).
+ *                        What each session used is logged. Without cgroups memory
+ *                        is an rlimit and cpu a lower priority (not with -J)
+ *                        ( -g cpu=50,mem=256,pids=64 )
+ *    [-L RATE]  (int)  let one address connect at most RATE times a minute (in bursts
+ *                        of up to RATE), clients over it are reset right away.
+ *                        The acceptors (-n) count together (0 = no limit, the default)
+ *    [-o KBPS[,MB][,drop]] relay each program's output, at most KBPS KB a second
+ *                        (0 = any) and MB in all. Over the rate the program is made
+ *                        to wait, or with drop its output is skipped. Past MB the
+ *                        client is told and the session ends
+ *                        ( -o 64  OR  -o 64,10  OR  -o 0,10  OR  -o 64,10,drop )
+ *    [-B MANIFEST] (str) don't serve: run the program over every case in MANIFEST and
+ *                        print each result as it finishes, then the throughput and
+ *                        wall and CPU time. A line is NAME STDIN EXPECTED [ARG ...],
+ *                        files (- for none), a case passes if its stdout matches
+ *                        and it exits 0. Each case may run for -I (10s by default).
+ *                        Exits with 0 if every case passed
+ *    [-j JOBS]  (int)  -B: run JOBS cases at once (one per CPU by default),
+ *                        idle workers steal cases queued for busy ones
+ *                        ( ./main -r prog1.py -B tests.txt -j 8 )
+ *    [-K CACHE] (str)  -B: keep each case's output and exit status in the file CACHE
+ *                        (made if it isn't there, 64MB), keyed by a hash of the program
+ *                        file, its args and stdin. A case found there isn't run again,
+ *                        across runs and servers. Only for deterministic programs
+ *    [-x PORT]  (int)  also serve the framed protocol on PORT: one connection runs
+ *                        many sessions, each a stream with its own stdin, stdout,
+ *                        stderr and exit status, flow controlled (see mux.c and
+ *                        muxclient.py). Its sessions count against -c but don't
+ *                        wait (-w), and are always forked (not -z, -J, -T, -v, -o).
+ *                        -i and -I apply, measured on the connection: a stream past
+ *                        them is killed without a warning.
+ *                        With -C it serves the first program
+ *    [-C FILE]  (str)  serve every program in FILE (up to 32), one a line, in the same
+ *                        flags as here: -r PROG and any of -m -p -a -P -z -J -s -T -v
+ *                        -w -i -I, # starts a comment. A line starts from the command
+ *                        line's options. Clients of the server's port choose a program
+ *                        from a menu, a line's -p is a port of its own for it. The
+ *                        programs share the connections (-c), each has its own pool,
+ *                        waiting room, zygote or JVM, limits and metrics. -r on the
+ *                        command line is served too, first (and is the one -B runs)
+ *                        ( ./main -C lab3.txt -p 43122 -a 1 -i 10m )
+ *                        ( lab3.txt:  -r prog1.py -z
+ *                                     -r prog3.c -p 43123 -P 4 -I 30m )
  *
- * There is no special protocol used by this server.
+ * The program is checked once at start up (see image.c): a C program is
+ * copied and exec'd from the copy, python's and java's interpreters are
+ * found on PATH once. Copying a new version over the program while the
+ * server runs is noticed, new sessions get it and running ones don't.
+ *
+ * There is no special protocol used by this server (but see -x).
  * Thus, have the students run netcat to utilize the
  * server. For example, once the server has  started,
  * a student can issue this command:
@@ -72,6 +168,7 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
@@ -82,21 +179,132 @@
 
 #include <ifaddrs.h>
 
+#include "batch.h"
+#include "cds.h"
+#include "cgroup.h"
 #include "defs.h"
+#include "evloop.h"
+#include "expire.h"
+#include "gather.h"
+#include "image.h"
+#include "jvmhost.h"
+#include "logger.h"
+#include "metrics.h"
+#include "mux.h"
 #include "netwrk.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "record.h"
+#include "ptyrelay.h"
+#include "session.h"
 #include "set_up.h"
+#include "spawn.h"
+#include "waitroom.h"
+#include "zygote.h"
 
 volatile sig_atomic_t g_time_is_up = 0;    /* Flag that ends server loop */
-volatile sig_atomic_t g_connections = 0;   /* always <= MAX_CONNECTIONS */
+prog_t *g_progs = NULL;                    /* the programs served (-r, -C) */
+int g_nprogs = 0;
+char g_menu[MENU_MAX];                     /* offered on the server's port, if there are several */
+
+/** give_slot
+    a session ended, its slot goes to whoever is waiting.
+    With several programs their waiting rooms take turns */
+void give_slot () {
+  static int next = 0;
+  int i;
+  session_slot_give();
+  for (i = 0; i < g_nprogs; i++) {
+    next = (next + 1) % g_nprogs;
+    if (NULL != g_progs[next].waitroom && 0 < g_progs[next].waitroom->len) {
+      waitroom_admit(g_progs[next].waitroom);
+      return;
+    }
+  }
+}
+
+/** session_ended
+    a session the server started has been reaped (see session.c),
+    give its slot back and record how it went */
+void session_ended (pid_t pid, int status, double secs, struct rusage *ru, void *data) {
+  prog_t *prog = (prog_t *)data;
+  char who[NAME_MAX+32];
+  if (1 < g_nprogs) {
+    snprintf(who, sizeof(who), "%d (%s)", (int)pid, prog->title);
+  } else {
+    snprintf(who, sizeof(who), "%d", (int)pid);
+  }
+  if (WIFSIGNALED(status)) {
+    log_msg("session %s killed by signal %d after %.1fs",
+	    who, WTERMSIG(status), secs);
+  } else {
+    log_msg("session %s exited with %d after %.1fs",
+	    who, WEXITSTATUS(status), secs);
+  }
+  metrics_program(prog->id);
+  metrics_ended(status, secs);
+  cgroup_release(pid, ru);
+  expire_end_pid(pid);
+  mux_ended(pid, status);
+  give_slot();
+}
+
+/** track_session
+    pid is running a client's session of prog, the slot it
+    was given (and its deadlines, x) are held until session_ended.
+    Its cgroup leaf (-g, it joined it before exec) goes with it,
+    and its relay (r, or NULL) kills it if it ends the session */
+void track_session (pid_t pid, expiry_t *x, prog_t *prog, cgleaf_t *leaf, relay_t *r) {
+  cgroup_attach(leaf, pid);
+  if (NULL != r) {
+    relay_pid(r, pid);
+  }
+  if (-1 == session_add(pid, (void *)prog)) {
+    session_slot_give(); /* can't be tracked, don't leak the slot */
+    expire_end(x);
+    return;
+  }
+  expire_pid(x, pid);
+}
 
-/** handle_sigchld
-    avoids zombies by calling wait once the SIGCHLD
-    signal is sent. The parent process should register
-    this handler for every successful fork */
-void handle_sigchld (int signo) {
-  g_connections--;
-  int status = 0;
-  wait (&status);
+/* a session handed to the python zygote, until its pid is known */
+typedef struct zstart {
+  expiry_t *x;         /* its deadlines, or NULL */
+  relay_t *r;          /* its relay, or NULL (none, or it has closed) */
+} zstart_t;
+
+/** zygote_relay_closed
+    the relay of a zygote session ended before the pid came */
+void zygote_relay_closed (relay_t *r, void *data) {
+  ((zstart_t *)data)->r = NULL;
+}
+
+/** zygote_session_started
+    the python zygote forked the session handed to it */
+void zygote_session_started (pid_t pid, cgleaf_t *leaf, void *data) {
+  zstart_t *zs = (zstart_t *)data;
+  cgroup_attach(leaf, pid);
+  if (NULL != zs->r) {
+    zs->r->on_close = NULL;
+    relay_pid(zs->r, pid);
+  }
+  expire_pid(zs->x, pid);
+  free(zs);
+}
+
+/** zygote_session_done
+    a session forked by the python zygote ended */
+void zygote_session_done (pid_t pid, int status) {
+  cgroup_release(pid, NULL);
+  expire_end_pid(pid);
+  give_slot();
+}
+
+/** jvm_session_done
+    the relay to the resident JVM ended */
+void jvm_session_done (relay_t *r, void *data) {
+  expire_end((expiry_t *)data);
+  give_slot();
 }
 
 /** handle_sigalrm
@@ -113,130 +321,335 @@ void handle_sigpipe (int signo) {
   _exit(2);
 }
 
-/** get_args_for_exec
-    build argv that will be passed to the exec function */
-char **get_args_for_exec (char *name, int num_args, int interpreter) {
-  /* make room for prog name, null pointer, (and maybe "-m") */
-  num_args+= interpreter ? 3 : 2;
-  char **argv = (char**)malloc(num_args*sizeof(char*));
-  int i = 0;
-  int user_arg = 1;
-  if (interpreter) {
-    argv[i] = "-m";
-    i++;
-  }
-  argv[i] = name;
-  i++;
-  int bytes;
-  char buf_to[MAX_STRLEN_ARG];
-  char buf_from[MAX_STRLEN_ARG];
-  for ( ; i < num_args-1; i++, user_arg++) {
-    /* malloc pointer, get str */
-    snprintf(buf_to, MAX_STRLEN_ARG, "arg %d: ", user_arg);
-    write_cli(STDOUT_FILENO, buf_to, 1+strlen(buf_to));
-    if (1 == (bytes = read_cli(STDIN_FILENO, buf_from))) {
-      break; /* no more args */
-    }
-    argv[i] = (char *)malloc(1+strlen(buf_from));
-    strncpy(argv[i], buf_from, 1+strlen(buf_from));
-  }
-  argv[i] = NULL;
-  return argv;
-}
-
 /** prep_for_exec
     redirect stdin/out/err to client (fd)
-    gather command line args
     exec program */
-void prep_for_exec (int fd, char *abs_path, char *name, int num_args,
-		    int interpreter, void(*exec_fn)(void *, void *, void *)) {
+void prep_for_exec (int fd, char *abs_path, char *name, char **argv,
+		    void(*exec_fn)(void *, void *, void *)) {
+  pty_take_ctty(fd);
   dup2(fd, STDIN_FILENO);
   dup2(fd, STDOUT_FILENO);
   dup2(fd, STDERR_FILENO);
   close(fd);
-  char **argv = get_args_for_exec(name, num_args, interpreter);
-  exec_fn(abs_path, name, argv);
+  if (NULL != argv) {
+    exec_fn(abs_path, name, argv);
+  }
   _exit (12);
 }
 
 /** term_client
     need to ensure non-blocking, notify client, terminate connection */
 void term_client (int fd) {
+  metrics_rejected();
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
   write(fd, "Server Busy\n", 12);
   shutdown(fd, SHUT_RDWR);
   close(fd);
 }
 
-/** new_connection
-    The parent forks and registers the SIGCHLD handler,
+/** drop_client
+    a client that's connecting too often: reset it,
+    it's not worth a write or a TIME_WAIT */
+void drop_client (int fd) {
+  struct linger lg = { 1, 0 };
+  metrics_rate_limited();
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  close(fd);
+}
+
+/** close_listeners
+    in a forked session: the server's listening sockets */
+void close_listeners (prog_t *prog) {
+  int i;
+  close(prog->entryfd);
+  for (i = 0; i < g_nprogs; i++) {
+    if (0 < g_progs[i].port && &(g_progs[i]) != prog) {
+      close(g_progs[i].entryfd);
+    }
+  }
+}
+
+/** launch_session
+    runs in the child (forked, or a parked pool worker)
+    once it has a client and its args. Does not return */
+void launch_session (int clientfd, char **args, int nargs, void *data) {
+  prog_t *prog = (prog_t *)data;
+  signal(SIGPIPE, handle_sigpipe);
+  prep_for_exec(clientfd, prog->abs_path, prog->name,
+		get_args_for_exec(prog->name, prog->interpreter, args, nargs),
+		prog->exec_fn);
+}
+
+/** run_session
+    the client's args are in (if -a asked for any), and it
+    has a connection slot.
+    Its deadlines (-i, -I) start now.
+    Hands the client to the resident JVM (-J), the python
+    zygote (-z) or to a parked pool worker if there is one,
+    otherwise spawns (-s spawn/vfork) or the parent forks.
+    The parent adds the child to the session table,
     then goes back to the server loop
     The child cleans its resources,
     redirects stdin, stdout, stderr, and exec's the program */
-void new_connection (int entryfd, int timeout, char *abs_path, char *name,
-		     int num_args, int interpreter, void(*exec_fn)(void *, void *, void *)) {
-  struct sockaddr addr;
-  socklen_t addrlen = sizeof (addr);
-  
-  int clientfd = accept (entryfd, &addr, &addrlen);
-  if (((EWOULDBLOCK | EAGAIN) & errno) || clientfd < 0) {
-    /* no client, or problem accepting */
-    errno = 0; /* reset errno, important so the main server loop doesn't get stuck */
+void run_session (int clientfd, char **args, int nargs, void *data) {
+  prog_t *prog = (prog_t *)data;
+  relay_t *r = NULL;
+  zstart_t *zs;
+  cgleaf_t *leaf = NULL;
+  pid_t pid = -1;
+  expiry_t *x = expire_start(clientfd, prog->idle, prog->life); /* NULL if there are no limits */
+
+  metrics_program(prog->id);
+  metrics_session();
+  if (NULL != prog->jvm &&
+      NULL != (r = jvm_handoff(prog->jvm, clientfd, args, nargs, jvm_session_done, (void *)x))) {
+    /* the relay owns clientfd now */
+    if (prog->record) {
+      record_start(r);
+    }
     return;
   }
 
-  if (MAX_CONNECTIONS <= g_connections) {
-    /* ensure non-blocking, notify client, kill connection */
-    term_client(clientfd);
+  if (prog->pty || prog->record || prog->capped) {
+    /* -T/-v/-o: the relay owns the socket, the program gets the pty
+       (or a socketpair), clientfd is the program's end from here on */
+    int fd = prog->pty ? pty_session(clientfd, &r) : record_session(clientfd, &r);
+    if (-1 != fd) {
+      if (prog->record) {
+	record_start(r);
+      }
+      clientfd = fd;
+    }
+  }
+
+  /* -g: made now, the process joins it before it execs */
+  leaf = cgroup_leaf();
+  if (NULL != prog->zygote && NULL != (zs = (zstart_t *)calloc(1, sizeof(zstart_t)))) {
+    zs->x = x;
+    zs->r = r;
+    if (0 == zygote_handoff(prog->zygote, clientfd, leaf, args, nargs, (void *)zs)) {
+      /* the zygote forks it, and tells us when it ends */
+      if (NULL != r) {
+	r->on_close = zygote_relay_closed;
+	r->data = (void *)zs;
+      }
+      close (clientfd);
+      return;
+    }
+    free(zs);
+  }
+
+  if (NULL != prog->cds) {
+    cds_refresh(prog->cds); /* rebuild the archive if the classes changed */
+  }
+
+  if (NULL != prog->pool &&
+      0 < (pid = pool_handoff(prog->pool, clientfd, (NULL == leaf) ? NULL : leaf->path, args, nargs))) {
+    /* a worker has it, same bookkeeping as a fork */
+    track_session(pid, x, prog, leaf, r);
+    close (clientfd);
     return;
   }
 
-  pid_t chid = fork ();
-  if (0 > chid) {
-    dprintf(STDERR_FILENO, "Unable to fork\n");
+  if (SPAWN_FORK != prog->spawn) {
+    char **argv = get_args_for_exec(prog->name, prog->interpreter, args, nargs);
+    char **exec_argv = argv;
+    if (NULL != argv) {
+      char *file = exec_file(prog->exec_fn, prog->abs_path, &exec_argv);
+      metrics_spawn_begin();
+      pid = spawn_session(prog->spawn, clientfd, file, exec_argv,
+			  (NULL == leaf) ? NULL : leaf->path);
+      if (0 < pid) {
+	metrics_spawn_end(); /* returns once the child has exec'd */
+      }
+      if (exec_argv != argv) {
+	free(exec_argv);
+      }
+      free(argv);
+    }
+    if (0 < pid) {
+      track_session(pid, x, prog, leaf, r);
+      close (clientfd);
+      return;
+    }
+  }
+
+  metrics_spawn_begin();
+  pid = fork ();
+  if (0 > pid) {
+    log_msg("Unable to fork");
+    cgroup_attach(leaf, -1);
+    session_slot_give();
+    expire_end(x);
     term_client(clientfd);
     return;
   }
-  if (chid) {
+  if (pid) {
     /* parent */
-    g_connections++;
-    signal(SIGCHLD, handle_sigchld);
+    track_session(pid, x, prog, leaf, r);
     close (clientfd);
   } else {
-    close(entryfd);
-    signal(SIGPIPE, handle_sigpipe);
-    prep_for_exec(clientfd, abs_path, name, num_args, interpreter, exec_fn);
+    cgroup_enter((NULL == leaf) ? NULL : leaf->path);
+    close_listeners(prog);
+    ev_child_reset();
+    metrics_spawn_end();
+    launch_session(clientfd, args, nargs, (void *)prog);
   }
 }
 
-/* void _srvr_loop_poll (int timeout, char *run) { */
-/* } */
+/** mux_session
+    start a session for a stream on a -x connection (see mux.c),
+    on the pipes in fds. It needs a slot like any other but
+    doesn't wait for one, and its args came with it (as many as
+    -a allows). Its deadlines (-i, -I) are measured on the
+    connection, conn. Always forked, the program's stdin, stdout
+    and stderr are the stream's */
+pid_t mux_session (int conn, int *fds, char **args, int nargs, void *data) {
+  prog_t *prog = (prog_t *)data;
+  expiry_t *x;
+  cgleaf_t *leaf;
+  pid_t pid;
+  int i;
+  metrics_program(prog->id);
+  if (-1 == session_slot_take()) {
+    metrics_rejected();
+    return -1;
+  }
+  metrics_session();
+  if (nargs > prog->num_args) {
+    nargs = prog->num_args;
+  }
+  leaf = cgroup_leaf();
+  metrics_spawn_begin();
+  pid = fork();
+  if (0 > pid) {
+    log_msg("Unable to fork");
+    cgroup_attach(leaf, -1);
+    session_slot_give();
+    return -1;
+  }
+  if (pid) {
+    x = expire_stream(conn, prog->idle, prog->life); /* NULL if there are no limits */
+    track_session(pid, x, prog, leaf, NULL);
+    return pid;
+  }
+  cgroup_enter((NULL == leaf) ? NULL : leaf->path);
+  close_listeners(prog);
+  ev_child_reset();
+  metrics_spawn_end();
+  for (i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+  }
+  args = get_args_for_exec(prog->name, prog->interpreter, args, nargs);
+  if (NULL != args) {
+    prog->exec_fn(prog->abs_path, prog->name, args);
+  }
+  _exit (12);
+}
 
-/** _srvr_lop_select
-    The main server loop, implemented with syscall select.
-    This is a simple loop that calls new_connection() when
-    a client connects. */
-void _srvr_loop_select (int entryfd, int timeout, char *abs_path, char *name,
-			int num_args, int interpreter, void(*exec_fn)(void *, void *, void *)) {
-  fd_set r, w, e;
-  struct timeval *to = NULL;
-  
-  FD_ZERO (&r);
-  FD_ZERO (&w);
-  FD_ZERO (&e);
-  FD_SET (entryfd, &r);
-  FD_SET (entryfd, &e);
-
-  while (select (entryfd+1, &r, &w, &e, to)) {
-    if (g_time_is_up || (EINTR != errno && FD_ISSET(entryfd, &e))) {
-      break;
+/** start_session
+    take a slot and run the session. If they are all in use
+    the client waits its turn in the program's waiting room (or,
+    if there is none or it is full, gets "Server Busy") */
+void start_session (int clientfd, char **args, int nargs, void *data) {
+  prog_t *prog = (prog_t *)data;
+  metrics_program(prog->id);
+  if ((NULL != prog->waitroom && 0 < waitroom_waiting()) || -1 == session_slot_take()) {
+    /* full, or others are already waiting (a slot another acceptor
+       gave back is theirs) */
+    if (NULL == prog->waitroom || -1 == waitroom_add(prog->waitroom, clientfd, args, nargs)) {
+      term_client(clientfd);
+    }
+    return;
+  }
+  run_session(clientfd, args, nargs, data);
+}
+
+/** new_connection
+    With -a the client is asked for its args from the event
+    loop first (gather.c), so a client sitting at a prompt
+    costs a gather_t, not a process or a connection slot.
+    Otherwise the session starts (or waits) right away */
+void new_connection (int clientfd, prog_t *prog) {
+  metrics_program(prog->id);
+  if (NULL == prog->waitroom && 0 == session_slots_free()) {
+    /* ensure non-blocking, notify client, kill connection */
+    term_client(clientfd);
+    return;
+  }
+  if (0 < prog->num_args) {
+    if (-1 == gather_start(clientfd, prog->num_args, start_session, (void *)prog)) {
+      term_client(clientfd);
     }
-    if (FD_ISSET(entryfd, &r)) {
-      new_connection(entryfd, timeout, abs_path, name, num_args, interpreter, exec_fn);
+    return;
+  }
+  start_session(clientfd, NULL, 0, (void *)prog);
+}
+
+/** find_program
+    the program answer names on the menu: its number,
+    or its name (with or without the extension) */
+prog_t *find_program (char *answer) {
+  char *end;
+  long k;
+  int i;
+  if (NULL == answer) {
+    return NULL;
+  }
+  k = strtol(answer, &end, 10);
+  if (end != answer && '\0' == *end) {
+    return (1 <= k && k <= g_nprogs) ? &(g_progs[k-1]) : NULL;
+  }
+  for (i = 0; i < g_nprogs; i++) {
+    if (0 == strcmp(answer, g_progs[i].title) || 0 == strcmp(answer, g_progs[i].name)) {
+      return &(g_progs[i]);
+    }
+  }
+  return NULL;
+}
+
+/** choose_program
+    the client answered the menu (gather_menu), it goes on
+    to the program it chose like a client of its port would */
+void choose_program (int clientfd, char **args, int nargs, void *data) {
+  prog_t *prog = find_program((0 < nargs) ? args[0] : NULL);
+  if (NULL == prog) {
+    send(clientfd, "No such program\n", 16, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(clientfd);
+    return;
+  }
+  new_connection(clientfd, prog);
+}
+
+/** accept_connection
+    event loop handler for the listening sockets (see ev_accept),
+    called for each client accepted. The client fd is left
+    blocking, the exec'd program expects that.
+    A client over the -L rate is dropped before anything else.
+    On a program's own port (-C) data is the program, on the
+    server's it is NULL when the client has to choose from the menu */
+void accept_connection (int entryfd, int clientfd, void *data) {
+  if (EV_ACCEPT_DONE == clientfd) {
+    metrics_backlog(entryfd); /* once a batch, not per client */
+    return;
+  }
+  if (0 > clientfd) {
+    g_time_is_up = 1; /* listening socket is broken, end the server */
+    return;
+  }
+  if (!rate_allow(clientfd)) {
+    drop_client(clientfd);
+    return;
+  }
+  metrics_program((NULL != data) ? ((prog_t *)data)->id : -1);
+  metrics_accepted(clientfd);
+  if (NULL == data) {
+    if (-1 == gather_menu(clientfd, g_menu, choose_program, NULL)) {
+      term_client(clientfd);
     }
-    FD_SET(entryfd, &r);
-    FD_SET(entryfd, &e);
+    return;
   }
+  new_connection(clientfd, (prog_t *)data);
 }
 
 /** doesnt work yet !! */
@@ -252,25 +665,142 @@ void _srvr_loop_select (int entryfd, int timeout, char *abs_path, char *name,
 /*   //  dprintf (STDOUT_FILENO, "", addr. */
 /* } */
 
-/** srvr_loop
-    Planning on implementing a poll and select version */
-void srvr_loop (int entryfd, int timeout, char * abs_path, char *name,
-		int num_args, int interpreter,  void(*exec_fn)(void *, void *, void *)) {
-  _srvr_loop_select (entryfd, timeout, abs_path, name, num_args, interpreter, exec_fn);
-  /* _srvr_loop_poll (entryfd, timeout, run); */
+/** build_menu
+    what a client of the server's port is asked when there
+    are several programs, answered with a number or a name */
+void build_menu () {
+  int i, len;
+  len = snprintf(g_menu, sizeof(g_menu), "Programs:\n");
+  for (i = 0; i < g_nprogs && len < sizeof(g_menu); i++) {
+    len += snprintf(g_menu + len, sizeof(g_menu) - len, "  %d) %s\n", i+1, g_progs[i].title);
+  }
+  if (len < sizeof(g_menu)) {
+    snprintf(g_menu + len, sizeof(g_menu) - len, "Choose one (number or name): ");
+  }
 }
 
-/** log_put_msg
-    write something to the log file */
-void log_put_msg (char *s) {
-  struct tm *tm;
-  time_t t;
-  char date[100];
+/** open_listeners
+    a program with a port of its own (-C) gets a listener on it,
+    each acceptor its own like the server's (reuseport). If it
+    can't, the program is only on the menu. The others are
+    served on entryfd */
+void open_listeners (int entryfd, int queue, int reuseport) {
+  prog_t *prog;
+  int i, fd;
+  for (i = 0; i < g_nprogs; i++) {
+    prog = &(g_progs[i]);
+    if (0 < prog->port && 0 <= prog->entryfd) {
+      close(prog->entryfd); /* an acceptor's copy of the first server's */
+    }
+    prog->entryfd = entryfd;
+    if (0 < prog->port) {
+      if (-1 == (fd = socket_tcp(prog->port, queue, reuseport))) {
+	log_msg("Unable to listen on %d, %s is only on the menu",
+		prog->port, prog->title);
+	prog->port = 0;
+	continue;
+      }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      prog->entryfd = fd;
+    }
+  }
+}
+
+/** srvr_loop
+    The main server loop. The listening sockets are registered with
+    the event loop (epoll by default, select or io_uring with -e)
+    and accept_connection() runs for each client. The session
+    timers (-i, -I) tick in the same loop, and the framed
+    protocol (-x) is served from it.
+    Each program has its own waiting room and pool (-P, filled
+    before the first client). -L, -M and -x are the server's,
+    every program has the same, the first's are used */
+void srvr_loop (int entryfd, int backend) {
+  prog_t *prog;
+  int i, limits = 0;
+  ev_init(backend);
+  if (-1 == session_watch(session_ended)) {
+    return;
+  }
+  if (-1 == gather_init()) {
+    log_msg("Clients at a prompt will have no time limit");
+  }
+  for (i = 0; i < g_nprogs; i++) {
+    limits |= (0 < g_progs[i].idle || 0 < g_progs[i].life);
+  }
+  if (limits && -1 == expire_init()) {
+    log_msg("Sessions will have no idle or time limit");
+  }
+  for (i = 0; i < g_nprogs; i++) {
+    prog = &(g_progs[i]);
+    if (NULL != prog->zygote) {
+      zygote_watch(prog->zygote, zygote_session_started, zygote_session_done);
+    }
+    prog->waitroom = waitroom_create(prog->wait_size, run_session, (void *)prog);
+    if (0 < prog->pool_size) {
+      prog->pool = pool_create(prog->pool_size, prog->entryfd, launch_session, (void *)prog,
+			       prog->park);
+    }
+    if (entryfd != prog->entryfd &&
+	-1 == ev_accept(prog->entryfd, accept_connection, (void *)prog)) {
+      log_msg("Unable to watch port %d, %s is only on the menu",
+	      prog->port, prog->title);
+    }
+  }
+  if (NULL != g_progs[0].metrics) {
+    metrics_listen(g_progs[0].metrics, DEFAULT_Q);
+  }
+  if (0 <= g_progs[0].mux) {
+    mux_listen(g_progs[0].mux, DEFAULT_Q, mux_session, (void *)&(g_progs[0]));
+  }
+  image_watch();
+  build_menu();
+  if (-1 == ev_accept(entryfd, accept_connection,
+		      (1 < g_nprogs) ? NULL : (void *)&(g_progs[0]))) {
+    log_msg("Unable to watch the server socket");
+    return;
+  }
+  ev_run(&g_time_is_up);
+  metrics_close();
+  ev_del(entryfd);
+}
 
-  t = time(NULL);
-  tm = localtime(&t);
-  strftime(date, sizeof(date), "%a %d %b %Y %H:%M:%S", tm);
-  dprintf(STDOUT_FILENO, "%s - %s\n", date, s);
+/** start_acceptors
+    -n: fork n-1 more acceptors. Each opens its own SO_REUSEPORT
+    listener on the server's port (*entryfd is replaced), and the
+    connection slots are shared first so there is still one limit.
+    alarm() isn't inherited, so each sets its own, and they get
+    SIGALRM (a clean shutdown) if the first server goes away.
+    Returns this process's acceptor number, 0 is the first server */
+int start_acceptors (int n, int *entryfd, int queue, int timeout) {
+  int i, fd, port;
+  if (1 >= n) {
+    return 0;
+  }
+  if (-1 == session_share_slots()) {
+    log_msg("Unable to share the connection count, using one acceptor");
+    return 0;
+  }
+  port = get_actual_port(*entryfd);
+  for (i = 1; i < n; i++) {
+    pid_t chid = fork ();
+    if (0 > chid) {
+      log_msg("Unable to fork acceptor %d", i);
+      break;
+    }
+    if (0 == chid) {
+      log_after_fork();
+      prctl(PR_SET_PDEATHSIG, SIGALRM);
+      alarm(timeout);
+      if (-1 == (fd = socket_tcp(port, queue, 1))) {
+	_exit(1);
+      }
+      close(*entryfd);
+      *entryfd = fd;
+      return i;
+    }
+  }
+  return 0;
 }
 
 /** background_process
@@ -297,20 +827,26 @@ void background_process (int bg, int *pstop) {
 
 /** background_process_logfile
     if this is a background process,
-    reroute stdout/stderr to file */
-void background_process_logfile (int bg, char *name) {
+    reroute stdout/stderr to file.
+    Returns the file's name (NULL if not bg) */
+char *background_process_logfile (int bg, char *name) {
   int fd;
-  char fname[128];
+  static char fname[128];
   if (bg) {
     bzero(fname, sizeof(fname));
-    sprintf(fname, "ta_server_log_%d", (int)getpid());
-    fd = open((NULL==name) ? fname : name,
-	      O_CLOEXEC | O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+    if (NULL == name) {
+      sprintf(fname, "ta_server_log_%d", (int)getpid());
+    } else {
+      strncpy(fname, name, sizeof(fname)-1);
+    }
+    fd = open(fname, O_CLOEXEC | O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
     dup2(fd, STDOUT_FILENO);
     dup2(fd, STDERR_FILENO);
     close(fd);
-    log_put_msg("server initialized");
+    log_msg("server initialized");
+    return fname;
   }
+  return NULL;
 }
 
 /** close_stdin
@@ -338,7 +874,72 @@ void synch_parent (int bg, int *pstop) {
 /** end_log
     this is registered to occur at exit time */
 void end_log () {
-  log_put_msg("server terminated");
+  log_msg("server terminated");
+  log_stop();
+}
+
+/* associate a command line parameter to a program variable */
+typedef struct assoc {
+  char *descr;                                     /* command line flag */
+  void *var;                                       /* program variable */
+  void (*fn)(char **argv, int *i, void *var);      /* handler function */
+  int prog;                                        /* 1 = may differ by program (-C) */
+} assoc_t;
+
+/** parse_args
+    set the variables of the flags in argv (argc of them).
+    A line of the -C file (conf) may only have a program's */
+void parse_args (assoc_t *args, int nassoc, int argc, char **argv, int conf) {
+  int i, j;
+  for (i = 1; i < argc; i++) {
+    /* for each command arg */
+    for (j = 0; j < nassoc; j++) {
+      /* check the args[] for match */
+      if (strncmp (argv[i], args[j].descr, strlen(args[j].descr)) == 0) {
+	if (conf && !args[j].prog) {
+	  dprintf(STDERR_FILENO, "%s: %s is for the command line, ignoring it\n",
+		  argv[0], args[j].descr);
+	  continue;
+	}
+	/* perform the setter function */
+	args[j].fn (argv, &i, args[j].var);
+      }
+    }
+  }
+}
+
+/** make_prog
+    prog, from its options o. The program is in cwd.
+    Returns -1 if there is no exec function for it */
+int make_prog (prog_t *prog, opts_t *o, char *cwd) {
+  bzero(prog, sizeof(prog_t));
+  prog->title = strdup(o->name); /* before the extension is cut off */
+  /* set exec function */
+  if (NULL == prog->title ||
+      NULL == (prog->exec_fn = set_exec_fn (o->name, o->mode, &(prog->interpreter)))) {
+    return -1;
+  }
+  /* create full path to executable */
+  if (NULL == (prog->abs_path = (char *)malloc(PATH_MAX))) {
+    return -1;
+  }
+  snprintf(prog->abs_path, PATH_MAX, "%s/%s", cwd, o->name);
+  if (-1 == image_open(prog->abs_path, execvp_java == prog->exec_fn,
+			(execvp_python_i == prog->exec_fn) ? o->mode : NULL)) {
+    dprintf(STDERR_FILENO, "Sessions will exec %s by path\n", prog->abs_path);
+  }
+  prog->name = o->name;
+  prog->port = o->port;
+  prog->num_args = o->num_args;
+  prog->spawn = o->spawn;
+  prog->pty = o->pty;
+  prog->record = o->record;
+  prog->idle = o->idle;
+  prog->life = o->life;
+  prog->pool_size = o->pool;
+  prog->wait_size = o->waiting;
+  prog->entryfd = -1;
+  return 0;
 }
 
 /** main
@@ -347,79 +948,174 @@ void end_log () {
  *    Build associator array that groups together:
  *      a setter function, a command arg, and a program variable
  *    Check command args, setting variables appropriately
- *    Create server entry point
+ *    Read the programs from the -C file, the same way
+ *    Create server entry point(s)
  *    Display server information
  *    Decide if background/foreground process
  *    Set alarm, start server
  */
 int main (int argc, char **argv) {
-  char abs_path[PATH_MAX];
-  bzero (abs_path, sizeof (abs_path));
-  getcwd (abs_path, sizeof (abs_path));
+  char cwd[PATH_MAX];
+  bzero (cwd, sizeof (cwd));
+  getcwd (cwd, sizeof (cwd));
   
   /* default values for program variables */
-  int p = DEFAULT_P;        /* port (optional) */
+  opts_t po;                /* the program's, or every program's unless its line says (-C) */
+  po.name = NULL;           /* program to run (REQUIRED, unless -C) */
+  po.mode = NULL;           /* mode (optional) */
+  po.port = DEFAULT_P;      /* port (optional) */
+  po.num_args = DEFAULT_A;  /* number of command args to gather for exec */
+  po.pool = DEFAULT_POOL;   /* number of parked workers (optional) */
+  po.zygote = 0;            /* python zygote? (optional) */
+  po.jvm = 0;               /* resident JVM? (optional) */
+  po.spawn = DEFAULT_S;     /* how sessions are spawned (optional) */
+  po.pty = 0;               /* run sessions on a pty? (optional) */
+  po.record = 0;            /* record sessions? (optional) */
+  po.waiting = DEFAULT_W;   /* waiting room size (optional) */
+  po.idle = DEFAULT_IDLE;   /* session idle limit, seconds (optional) */
+  po.life = DEFAULT_LIFE;   /* session time limit, seconds (optional) */
   int q = DEFAULT_Q;        /* listen queue (optional) */
   int t = DEFAULT_T;        /* client timeout (optional) */
   int bg = DEFAULT_BG;      /* make a background process? (optional) */
-  int a = DEFAULT_A;        /* number of command args to gather for exec */
-  char *name = NULL;        /* program to run (REQUIRED) */
-  char *mode = NULL;        /* mode (REQUIRED) */
+  int e = DEFAULT_E;        /* event loop backend (optional) */
+  int n = DEFAULT_N;        /* number of acceptor processes (optional) */
+  int c = MAX_CONNECTIONS;  /* connection limit (optional) */
+  int l = DEFAULT_L;        /* rotate the log file at this many MB (optional) */
+  char *M = NULL;           /* where to serve metrics (optional) */
+  limits_t g;               /* session resource limits (optional) */
+  int L = DEFAULT_RATE;     /* connections a minute from one address (optional) */
+  outcap_t o;               /* output caps (optional) */
+  int x = DEFAULT_X;        /* framed protocol port, -1 = none (optional) */
+  char *B = NULL;           /* batch manifest, instead of serving (optional) */
+  int jobs = DEFAULT_J;     /* batch workers, 0 = one per CPU (optional) */
+  char *K = NULL;           /* batch result cache file (optional) */
+  char *C = NULL;           /* file of programs to serve (optional) */
   
-  void (*exec_fn)(void *, void *, void *) = NULL; /* how to exec the program */
-
-  int m = 0; /* mode flag: 1 = include -m flag */
-  
-  /* associate a command line parameter to a program variable */
-  typedef struct assoc {
-    char *descr;                                     /* command line flag */
-    void *var;                                       /* program variable */
-    void (*fn)(char **argv, int *i, void *var);      /* handler function */
-  } assoc_t;
+  bzero(&g, sizeof(g));
+  bzero(&o, sizeof(o));
 
   assoc_t args[] = {
-    {"-p", (void *)&p, set_port},
-    {"-q", (void *)&q, set_queue},
-    {"-t", (void *)&t, set_timeout},
-    {"-r", (void *)&name, set_run},
-    {"-m", (void *)&mode, set_mode},
-    {"-bg", (void *)&bg, set_bg},
-    {"-a", (void *)&a, set_exec_args}
+    {"-p", (void *)&po.port, set_port, 1},
+    {"-q", (void *)&q, set_queue, 0},
+    {"-t", (void *)&t, set_timeout, 0},
+    {"-r", (void *)&po.name, set_run, 1},
+    {"-m", (void *)&po.mode, set_mode, 1},
+    {"-bg", (void *)&bg, set_bg, 0},
+    {"-a", (void *)&po.num_args, set_exec_args, 1},
+    {"-e", (void *)&e, set_event_backend, 0},
+    {"-P", (void *)&po.pool, set_pool, 1},
+    {"-z", (void *)&po.zygote, set_zygote, 1},
+    {"-J", (void *)&po.jvm, set_jvm, 1},
+    {"-s", (void *)&po.spawn, set_spawn, 1},
+    {"-n", (void *)&n, set_acceptors, 0},
+    {"-c", (void *)&c, set_connections, 0},
+    {"-w", (void *)&po.waiting, set_waitroom, 1},
+    {"-T", (void *)&po.pty, set_pty, 1},
+    {"-v", (void *)&po.record, set_record, 1},
+    {"-l", (void *)&l, set_log_rotate, 0},
+    {"-M", (void *)&M, set_metrics, 0},
+    {"-i", (void *)&po.idle, set_idle, 1},
+    {"-I", (void *)&po.life, set_lifetime, 1},
+    {"-g", (void *)&g, set_limits, 0},
+    {"-L", (void *)&L, set_rate, 0},
+    {"-o", (void *)&o, set_outcap, 0},
+    {"-x", (void *)&x, set_mux, 0},
+    {"-B", (void *)&B, set_batch, 0},
+    {"-j", (void *)&jobs, set_jobs, 0},
+    {"-K", (void *)&K, set_cache, 0},
+    {"-C", (void *)&C, set_config, 0}
   };
+  int nassoc = sizeof(args) / sizeof(assoc_t);
 
   /* set any variables defined in command line */
-  int i, j;
-  for (i = 1; i < argc; i++) {
-    /* for each command arg */
-    for (j = 0; j < sizeof(args) / sizeof(assoc_t); j++) {
-      /* check the args[] for match */
-      if (strncmp (argv[i], args[j].descr, strlen(args[j].descr)) == 0) {
-	/* perform the setter function */
-  	args[j].fn (argv, &i, args[j].var);
-      }
-    }
-  }
+  parse_args(args, nassoc, argc, argv, 0);
 
   /* chech for required params */
-  if (NULL == name) {
-    dprintf(STDERR_FILENO,"Usage: ./main -r PROG [-m MODE] [-p PORT] [-t TIMEOUT] [-a NUMARGS] [-q QUEUE]\n");
+  if (NULL == po.name && NULL == C) {
+    dprintf(STDERR_FILENO,"Usage: ./main -r PROG [-m MODE] [-p PORT] [-t TIMEOUT] [-a NUMARGS] [-q QUEUE] [-e BACKEND] [-P POOL] [-z] [-J] [-s SPAWN] [-n ACCEPTORS] [-c CONNS] [-w WAITING] [-T] [-v] [-l MB] [-M WHERE] [-i IDLE] [-I LIFE] [-g LIMITS] [-L RATE] [-o KBPS[,MB][,drop]] [-x PORT] [-B MANIFEST [-j JOBS] [-K CACHE]] [-C PROGRAMS]\n");
     dprintf(STDERR_FILENO,"$ ./main -r prog1.py               # execs prog1.py (as interpreter file)\n");
     dprintf(STDERR_FILENO,"$ ./main -r prog2.py -m python2    # execs python2 prog2.py\n");
     dprintf(STDERR_FILENO,"$ ./main -r prog3.c                # execs ./prog3\n");
     dprintf(STDERR_FILENO,"$ ./main -r prog4.java             # execs java prog4\n");
     dprintf(STDERR_FILENO,"$ ./main -r prog4.java -bg         # srvr runs in background, creates file ta_server_log_PID\n");
     dprintf(STDERR_FILENO,"$ ./main -r prog5.c -a 5 -t15m     # gathers up to 5 args, passing them to exec ./prog5 and terminates the server after 15mins\n");
+    dprintf(STDERR_FILENO,"$ ./main -r prog1.py -B tests.txt  # runs prog1.py over each case in tests.txt, on every CPU\n");
+    dprintf(STDERR_FILENO,"$ ./main -C lab3.txt -p 43122      # serves every program in lab3.txt, clients choose from a menu\n");
     return 0;
   }
 
-  /* set exec function */
-  if (NULL == (exec_fn = set_exec_fn (name, mode, &m))) {
-    dprintf(STDERR_FILENO, "terminating because no exec function\n");
-    return 21;
+  /* the programs: -r's, then one per line of the -C file, each
+     line starting from the command line's options */
+  opts_t popts[MAX_PROGS];
+  int nprogs = 0, i, j;
+  if (NULL != po.name) {
+    popts[nprogs] = po;
+    popts[nprogs++].port = 0; /* it is on the server's port */
+  }
+  if (NULL != C) {
+    opts_t cmdline = po;
+    char ***lines;
+    int nlines, len;
+    if (NULL == (lines = config_read(C, &nlines))) {
+      dprintf(STDERR_FILENO, "Unable to read the programs in %s\n", C);
+      return 23;
+    }
+    for (i = 0; i < nlines && nprogs < MAX_PROGS; i++) {
+      po = cmdline;
+      po.name = po.mode = NULL;
+      po.port = 0;
+      for (len = 0; NULL != lines[i][len]; len++)
+	;
+      parse_args(args, nassoc, len, lines[i], 1);
+      if (NULL == po.name) {
+	dprintf(STDERR_FILENO, "%s: line %d has no -r PROG\n", C, i+1);
+	return 23;
+      }
+      popts[nprogs++] = po;
+    }
+    po = cmdline;
+  }
+  if (0 == nprogs) {
+    dprintf(STDERR_FILENO, "No programs in %s\n", C);
+    return 23;
+  }
+  for (i = 0; i < nprogs; i++) {
+    /* a port is one program's, the server's is the menu's */
+    for (j = 0; 0 < popts[i].port && j < i; j++) {
+      if (popts[i].port == popts[j].port) {
+	break;
+      }
+    }
+    if (0 < popts[i].port && (j < i || popts[i].port == po.port)) {
+      dprintf(STDERR_FILENO, "Port %d is taken, %s is only on the menu\n",
+	      popts[i].port, popts[i].name);
+      popts[i].port = 0;
+    }
   }
 
-  /* create full path to executable */
-  sprintf (&(abs_path[strlen(abs_path)]), "/%s", name);
+  prog_t progs[MAX_PROGS];
+  for (i = 0; i < nprogs; i++) {
+    if (-1 == make_prog(&(progs[i]), &(popts[i]), cwd)) {
+      dprintf(STDERR_FILENO, "terminating because no exec function\n");
+      return 21;
+    }
+    progs[i].id = i;
+  }
+  g_progs = progs;
+  g_nprogs = nprogs;
+
+  if (NULL != B) {
+    /* -B: grade instead of serving (the first program) */
+    switch (batch_run(&(progs[0]), B, jobs, progs[0].life, K)) {
+    case 0: return 0;
+    case 1: return 1;
+    default: return 22;
+    }
+  }
+
+  if (NULL != K) {
+    dprintf(STDERR_FILENO, "-K is only for -B, ignoring it\n");
+  }
 
   /* sync parent if bg process */
   int pstop[2];
@@ -427,7 +1123,8 @@ int main (int argc, char **argv) {
   background_process (bg, pstop);
   
   /* create server entry point */
-  int entryfd = socket_tcp (p, q);
+  int entryfd = socket_tcp (po.port, q, 1 < n);
+  open_listeners(entryfd, q, 1 < n);
   dprintf(STDOUT_FILENO," Server (PID: %d)\n", (int)getpid());
  
   /* print out network addresses, look for eth01, or en0 or something like that */
@@ -447,9 +1144,17 @@ int main (int argc, char **argv) {
   freeifaddrs(addrs);
 
   dprintf(STDOUT_FILENO, "%d # connect to server with netcat\n", get_actual_port(entryfd));
+  for (i = 0; 1 < nprogs && i < nprogs; i++) {
+    if (0 < progs[i].port) {
+      dprintf(STDOUT_FILENO, " %d) %s, also on port %d\n", i+1, progs[i].title, progs[i].port);
+    } else {
+      dprintf(STDOUT_FILENO, " %d) %s\n", i+1, progs[i].title);
+    }
+  }
   //print_addr (entryfd);
   synch_parent(bg, pstop); /* if running in background, this lets the info print to terminal before parent terminates */
-  background_process_logfile(bg, NULL);
+  /* log lines are written by the log thread from here on */
+  log_start(background_process_logfile(bg, NULL), l * 1024L * 1024L);
   close_stdin();
   atexit(end_log);
   
@@ -458,11 +1163,77 @@ int main (int argc, char **argv) {
   alarm(t);
 
   /* be a server */
-  srvr_loop (entryfd, t, abs_path, name, a, m, exec_fn);
+  relay_limit(&o);
+  if (0 < g.cpu || 0 < g.mem || 0 < g.pids) {
+    /* first, the server may move to a cgroup of its own */
+    cgroup_init(&g);
+    atexit(cgroup_close);
+  }
+  for (i = 0; i < nprogs; i++) {
+    progs[i].capped = (0 < o.rate || 0 < o.max);
+    progs[i].mux = x;
+    if (0 < progs[i].pool_size &&
+	(execvp_python == progs[i].exec_fn || execvp_python_i == progs[i].exec_fn)) {
+      /* -P: the workers park in the interpreter */
+      progs[i].park = zygote_park_argv(progs[i].abs_path, popts[i].mode, POOL_PARK_FD);
+    }
+    if (execvp_java == progs[i].exec_fn) {
+      /* build an AppCDS archive in the background */
+      progs[i].cds = cds_create(progs[i].abs_path);
+    }
+    if (popts[i].jvm) {
+      /* before SIGCHLD is handled, like the zygote */
+      if (execvp_java != progs[i].exec_fn) {
+	log_msg("-J is only for .java programs, ignoring it for %s",
+		progs[i].title);
+      } else if (NULL == (progs[i].jvm = jvm_create(progs[i].abs_path))) {
+	log_msg("Unable to start the JVM session host for %s, exec'ing per client",
+		progs[i].title);
+      }
+    }
+  }
+
+  /* -n: the other acceptors share the JVM (and the -c limit), each starts its own zygote */
+  session_slot_limit(c);
+  if (NULL != M) {
+    /* before the acceptors, they share the counters */
+    static char *names[MAX_PROGS];
+    for (i = 0; i < nprogs; i++) {
+      names[i] = progs[i].title;
+    }
+    metrics_create(n);
+    metrics_programs(names, nprogs);
+  }
+  rate_init(L); /* before the acceptors too, one bucket per address for all of them */
+  int acceptor = start_acceptors(n, &entryfd, q, t);
+  metrics_acceptor(acceptor);
+  if (0 == acceptor) {
+    progs[0].metrics = M;
+  } else {
+    open_listeners(entryfd, q, 1);
+  }
+  for (i = 0; i < nprogs; i++) {
+    if (!popts[i].zygote) {
+      continue;
+    }
+    /* start before SIGCHLD is handled, see zygote_create */
+    if (execvp_python != progs[i].exec_fn && execvp_python_i != progs[i].exec_fn) {
+      log_msg("-z is only for .py programs, ignoring it for %s", progs[i].title);
+    } else if (NULL == (progs[i].zygote = zygote_create(progs[i].abs_path, popts[i].mode))) {
+      log_msg("Unable to start the zygote for %s, exec'ing per client",
+	      progs[i].title);
+    }
+  }
+  srvr_loop (entryfd, e);
 
   /* clean up */
+  for (i = 0; i < nprogs && 0 == acceptor; i++) {
+    if (NULL != progs[i].jvm) {
+      jvm_destroy(progs[i].jvm);
+    }
+  }
   shutdown(entryfd, SHUT_RDWR);
   close(entryfd);
   /* pthread_mutex_destroy(&g_child_wait); */
   return 0;
-}  
+}
@@ -0,0 +1,520 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the metrics (-M). The only state anyone
+ * could see was the connection count. Now the first server
+ * answers HTTP on a separate port (or Unix socket) with the
+ * counters in Prometheus' text format: sessions, rejects, the
+ * waiting room and accept queue, and histograms of spawn time,
+ * time to the program's first output and session length, with
+ * the exit codes and (-g) what the sessions used.
+ *
+ * Each acceptor (-n) has its own slot of counters in shared
+ * memory, so nothing is locked and no cache line is fought over
+ * by acceptors. The forked sessions (fork to exec) add to their
+ * acceptor's slot with atomic adds. The scrape sums the slots.
+ *
+ * With several programs (-C) the sessions, rejects and failures
+ * are also counted per program, labeled with its name.
+ *
+ */
+
+#define _GNU_SOURCE  /* accept4 */
+#include "metrics.h"
+#include "evloop.h"
+#include "logger.h"
+#include "netwrk.h"
+#include "session.h"
+
+/* bucket bounds, in seconds */
+static const double g_met_lat[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+				    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+static const double g_met_len[] = { 1, 5, 15, 30, 60, 120, 300, 600, 1200,
+				    1800, 3600, 7200, 14400 };
+
+static met_slot_t *g_met_slots = NULL;  /* one per acceptor, NULL = no metrics */
+static int g_met_n = 0;
+static met_slot_t *g_met = NULL;        /* this acceptor's */
+static int g_met_fd = -1;               /* the listener, only the first server has one */
+static char *g_met_path = NULL;         /* its Unix socket */
+static struct timespec *g_met_at = NULL;/* when each client fd was accepted */
+static int g_met_at_len = 0;
+static int g_met_batch = 0;             /* clients accepted since the backlog was checked */
+static char **g_met_names = NULL;       /* of the programs, -C */
+static int g_met_nprogs = 0;
+static int g_met_prog = -1;             /* what the counts are for now */
+static struct timespec g_met_spawn;     /* metrics_spawn_begin, a forked child inherits it */
+
+/** _met_add
+    counters are only ever added to */
+#define _met_add(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+#define _met_get(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/** _met_since
+    seconds since start */
+double _met_since (struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** _met_observe
+    count secs into h, bounds are its buckets' */
+void _met_observe (met_hist_t *h, const double *bounds, double secs) {
+  int i;
+  for (i = 0; i < MET_BUCKETS && secs > bounds[i]; i++)
+    ;
+  if (i < MET_BUCKETS) {
+    _met_add(h->b[i], 1);
+  }
+  _met_add(h->sum_us, (uint64_t)(secs * 1e6));
+  _met_add(h->count, 1);
+}
+
+int metrics_create (int n) {
+  size_t size = n * sizeof(met_slot_t);
+  g_met_slots = (met_slot_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == g_met_slots) {
+    log_msg("Unable to create the metrics");
+    g_met_slots = NULL;
+    return -1;
+  }
+  g_met_n = n;
+  g_met = g_met_slots;
+  return 0;
+}
+
+void metrics_acceptor (int i) {
+  if (NULL != g_met_slots && i < g_met_n) {
+    g_met = &(g_met_slots[i]);
+  }
+}
+
+void metrics_programs (char **names, int n) {
+  g_met_names = names;
+  g_met_nprogs = (MAX_PROGS < n) ? MAX_PROGS : n;
+}
+
+void metrics_program (int k) {
+  g_met_prog = (0 <= k && k < g_met_nprogs) ? k : -1;
+}
+
+void metrics_accepted (int clientfd) {
+  if (NULL == g_met) {
+    return;
+  }
+  _met_add(g_met->accepted, 1);
+  g_met_batch++;
+  if (clientfd >= g_met_at_len) {
+    int len = g_met_at_len ? g_met_at_len : 64;
+    struct timespec *at;
+    while (len <= clientfd) {
+      len *= 2;
+    }
+    if (NULL == (at = (struct timespec *)realloc(g_met_at, len*sizeof(struct timespec)))) {
+      return;
+    }
+    g_met_at = at;
+    g_met_at_len = len;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &(g_met_at[clientfd]));
+}
+
+void metrics_backlog (int entryfd) {
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+  int accepted = g_met_batch;
+  g_met_batch = 0;
+  if (NULL == g_met || -1 == getsockopt(entryfd, IPPROTO_TCP, TCP_INFO, &ti, &len)) {
+    return;
+  }
+  /* on a listener: clients waiting to be accepted, and the limit */
+  __atomic_store_n(&(g_met->backlog), ti.tcpi_unacked, __ATOMIC_RELAXED);
+  __atomic_store_n(&(g_met->backlog_limit), ti.tcpi_sacked, __ATOMIC_RELAXED);
+  if (accepted + ti.tcpi_unacked > g_met->backlog_peak) {
+    __atomic_store_n(&(g_met->backlog_peak), accepted + ti.tcpi_unacked, __ATOMIC_RELAXED);
+  }
+}
+
+void metrics_rejected () {
+  if (NULL != g_met) {
+    _met_add(g_met->rejected, 1);
+    if (0 <= g_met_prog) {
+      _met_add(g_met->prog_rejected[g_met_prog], 1);
+    }
+  }
+}
+
+void metrics_rate_limited () {
+  if (NULL != g_met) {
+    _met_add(g_met->rate_limited, 1);
+  }
+}
+
+void metrics_output_capped () {
+  if (NULL != g_met) {
+    _met_add(g_met->out_capped, 1);
+  }
+}
+
+void metrics_output_dropped (int bytes) {
+  if (NULL != g_met) {
+    _met_add(g_met->out_dropped, bytes);
+  }
+}
+
+void metrics_waiting (int n) {
+  if (NULL != g_met) {
+    __atomic_store_n(&(g_met->waiting), n, __ATOMIC_RELAXED);
+  }
+}
+
+void metrics_session () {
+  if (NULL != g_met) {
+    _met_add(g_met->sessions, 1);
+    if (0 <= g_met_prog) {
+      _met_add(g_met->prog_sessions[g_met_prog], 1);
+    }
+  }
+}
+
+void metrics_spawn_begin () {
+  if (NULL != g_met) {
+    clock_gettime(CLOCK_MONOTONIC, &g_met_spawn);
+  }
+}
+
+void metrics_spawn_end () {
+  if (NULL != g_met) {
+    _met_observe(&(g_met->spawn), g_met_lat, _met_since(&g_met_spawn));
+  }
+}
+
+void metrics_first_byte (int clientfd) {
+  if (NULL != g_met && 0 <= clientfd && clientfd < g_met_at_len) {
+    _met_observe(&(g_met->first_byte), g_met_lat, _met_since(&(g_met_at[clientfd])));
+  }
+}
+
+void metrics_ended (int status, double secs) {
+  if (NULL == g_met) {
+    return;
+  }
+  _met_observe(&(g_met->duration), g_met_len, secs);
+  if (0 <= g_met_prog && (WIFSIGNALED(status) || 0 != WEXITSTATUS(status))) {
+    _met_add(g_met->prog_failed[g_met_prog], 1);
+  }
+  if (WIFSIGNALED(status)) {
+    if (WTERMSIG(status) < MET_SIGNALS) {
+      _met_add(g_met->signals[WTERMSIG(status)], 1);
+    }
+  } else {
+    _met_add(g_met->exits[WEXITSTATUS(status)], 1);
+  }
+}
+
+void metrics_usage (uint64_t cpu_us, uint64_t throttled_us, uint64_t mem_peak, uint64_t ooms) {
+  if (NULL == g_met) {
+    return;
+  }
+  _met_add(g_met->cpu_us, cpu_us);
+  _met_add(g_met->throttled_us, throttled_us);
+  _met_add(g_met->oom_kills, ooms);
+  if (mem_peak > _met_get(g_met->mem_peak)) {
+    __atomic_store_n(&(g_met->mem_peak), mem_peak, __ATOMIC_RELAXED);
+  }
+}
+
+/** _met_sum
+    a value summed over the acceptors */
+#define _met_sum(total, field) do {			\
+    int _i;						\
+    (total) = 0;					\
+    for (_i = 0; _i < g_met_n; _i++) {			\
+      (total) += _met_get(g_met_slots[_i].field);	\
+    }							\
+  } while (0)
+
+/** _met_print
+    one metric with its HELP and TYPE lines */
+void _met_print (FILE *f, char *name, char *type, char *help, uint64_t val) {
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+	  name, help, name, type, name, (unsigned long long)val);
+}
+
+/** _met_print_progs
+    a counter by program, the off'th array in the slot */
+void _met_print_progs (FILE *f, char *name, char *help, size_t off) {
+  uint64_t val;
+  int i, k;
+  if (1 >= g_met_nprogs) {
+    return;
+  }
+  fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (k = 0; k < g_met_nprogs; k++) {
+    for (val = 0, i = 0; i < g_met_n; i++) {
+      val += _met_get(((uint64_t *)((char *)&(g_met_slots[i]) + off))[k]);
+    }
+    fprintf(f, "%s{program=\"%s\"} %llu\n", name, g_met_names[k], (unsigned long long)val);
+  }
+}
+
+/** _met_print_hist
+    a histogram summed over the acceptors, the off'th
+    met_hist_t in the slot */
+void _met_print_hist (FILE *f, char *name, char *help, size_t off, const double *bounds) {
+  uint64_t count = 0, sum = 0, b[MET_BUCKETS];
+  uint64_t cum = 0;
+  met_hist_t *h;
+  int i, j;
+  bzero(b, sizeof(b));
+  for (i = 0; i < g_met_n; i++) {
+    h = (met_hist_t *)((char *)&(g_met_slots[i]) + off);
+    count += _met_get(h->count);
+    sum += _met_get(h->sum_us);
+    for (j = 0; j < MET_BUCKETS; j++) {
+      b[j] += _met_get(h->b[j]);
+    }
+  }
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (j = 0; j < MET_BUCKETS; j++) {
+    cum += b[j];
+    fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[j], (unsigned long long)cum);
+  }
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n",
+	  name, (unsigned long long)count, name, sum / 1e6, name, (unsigned long long)count);
+}
+
+/** _met_report
+    the whole scrape, malloc'd. Returns its length */
+size_t _met_report (char **out) {
+  FILE *f;
+  size_t len = 0;
+  uint64_t val, total;
+  int i, code;
+
+  if (NULL == (f = open_memstream(out, &len))) {
+    return 0;
+  }
+  _met_print(f, "ta_sessions_active", "gauge", "Sessions running (connection slots in use)",
+	     session_slots());
+  _met_print(f, "ta_sessions_limit", "gauge", "Sessions allowed at once (-c)",
+	     session_slots() + session_slots_free());
+  _met_sum(val, sessions);
+  _met_print(f, "ta_sessions_total", "counter", "Sessions started", val);
+  _met_sum(val, rejected);
+  _met_print(f, "ta_rejects_total", "counter", "Clients turned away with Server Busy", val);
+  _met_sum(val, rate_limited);
+  _met_print(f, "ta_rate_limited_total", "counter",
+	     "Clients refused for connecting too often (-L)", val);
+  _met_sum(val, out_capped);
+  _met_print(f, "ta_output_capped_total", "counter",
+	     "Sessions ended for sending more than the -o total", val);
+  _met_sum(val, out_dropped);
+  _met_print(f, "ta_output_dropped_bytes_total", "counter",
+	     "Program output discarded over the -o rate", val);
+  _met_sum(val, waiting);
+  _met_print(f, "ta_waiting", "gauge", "Clients in the waiting room (-w)", val);
+  _met_sum(val, backlog);
+  _met_print(f, "ta_accept_queue", "gauge",
+	     "Connections left waiting to be accepted after each acceptor's last accept", val);
+  for (val = 0, i = 0; i < g_met_n; i++) {
+    if (_met_get(g_met_slots[i].backlog_peak) > val) {
+      val = _met_get(g_met_slots[i].backlog_peak);
+    }
+  }
+  _met_print(f, "ta_accept_queue_peak", "gauge",
+	     "Most connections waiting at one acceptor at once", val);
+  _met_sum(val, backlog_limit);
+  _met_print(f, "ta_accept_queue_limit", "gauge", "Listen backlog, all acceptors", val);
+
+  fprintf(f, "# HELP ta_accepted_total Connections accepted\n# TYPE ta_accepted_total counter\n");
+  for (i = 0; i < g_met_n; i++) {
+    fprintf(f, "ta_accepted_total{acceptor=\"%d\"} %llu\n",
+	    i, (unsigned long long)_met_get(g_met_slots[i].accepted));
+  }
+
+  _met_print_hist(f, "ta_spawn_seconds", "Fork (or spawn) to exec of a session",
+		  offsetof(met_slot_t, spawn), g_met_lat);
+  _met_print_hist(f, "ta_first_byte_seconds",
+		  "Accept to the program's first output (relayed sessions, -T -v -J)",
+		  offsetof(met_slot_t, first_byte), g_met_lat);
+  _met_print_hist(f, "ta_session_seconds", "Session length",
+		  offsetof(met_slot_t, duration), g_met_len);
+
+  _met_sum(val, cpu_us);
+  fprintf(f, "# HELP ta_session_cpu_seconds_total CPU used by ended sessions (-g)\n"
+	  "# TYPE ta_session_cpu_seconds_total counter\nta_session_cpu_seconds_total %.6f\n",
+	  val / 1e6);
+  _met_sum(val, throttled_us);
+  fprintf(f, "# HELP ta_session_cpu_throttled_seconds_total Time sessions were held to cpu.max\n"
+	  "# TYPE ta_session_cpu_throttled_seconds_total counter\n"
+	  "ta_session_cpu_throttled_seconds_total %.6f\n", val / 1e6);
+  for (val = 0, i = 0; i < g_met_n; i++) {
+    if (_met_get(g_met_slots[i].mem_peak) > val) {
+      val = _met_get(g_met_slots[i].mem_peak);
+    }
+  }
+  _met_print(f, "ta_session_memory_peak_bytes", "gauge", "Most memory one session used", val);
+  _met_sum(val, oom_kills);
+  _met_print(f, "ta_session_oom_kills_total", "counter", "Session processes killed at memory.max",
+	     val);
+
+  fprintf(f, "# HELP ta_session_exits_total Sessions ended, by exit code or signal\n"
+	  "# TYPE ta_session_exits_total counter\n");
+  for (code = 0; code < 256; code++) {
+    _met_sum(total, exits[code]);
+    if (0 < total) {
+      fprintf(f, "ta_session_exits_total{code=\"%d\"} %llu\n", code, (unsigned long long)total);
+    }
+  }
+  for (code = 1; code < MET_SIGNALS; code++) {
+    _met_sum(total, signals[code]);
+    if (0 < total) {
+      fprintf(f, "ta_session_exits_total{signal=\"%d\"} %llu\n", code, (unsigned long long)total);
+    }
+  }
+  _met_print_progs(f, "ta_program_sessions_total", "Sessions started, by program (-C)",
+		   offsetof(met_slot_t, prog_sessions));
+  _met_print_progs(f, "ta_program_rejects_total", "Clients turned away, by program (-C)",
+		   offsetof(met_slot_t, prog_rejected));
+  _met_print_progs(f, "ta_program_failures_total",
+		   "Sessions that exited with other than 0 or were killed, by program (-C)",
+		   offsetof(met_slot_t, prog_failed));
+  fclose(f);
+  return len;
+}
+
+/* a scrape's answer, sent as the scraper takes it */
+typedef struct met_scrape {
+  char *buf;           /* header and report */
+  size_t len;
+  size_t off;          /* sent so far */
+} met_scrape_t;
+
+/** _met_done
+    the scrape is answered, or gone */
+void _met_done (int fd, met_scrape_t *sc) {
+  ev_del(fd);
+  if (NULL != sc) {
+    if (sc->off == sc->len) {
+      shutdown(fd, SHUT_WR);
+    }
+    free(sc->buf);
+    free(sc);
+  }
+  close(fd);
+}
+
+/** _met_write
+    event loop handler, send the rest of a scrape's answer. The
+    fd stays nonblocking, a scraper that stops reading only holds
+    its own connection, never the loop */
+void _met_write (int fd, int events, void *data) {
+  met_scrape_t *sc = (met_scrape_t *)data;
+  ssize_t bytes;
+  while (sc->off < sc->len) {
+    bytes = send(fd, sc->buf + sc->off, sc->len - sc->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (0 > bytes) {
+      if (EAGAIN == errno || EINTR == errno) {
+	return; /* EV_WRITE again */
+      }
+      break;
+    }
+    sc->off += bytes;
+  }
+  _met_done(fd, sc);
+}
+
+/** _met_request
+    event loop handler for a scrape. Whatever was asked for
+    (it's one small GET), the answer is the report */
+void _met_request (int fd, int events, void *data) {
+  char req[1024], hdr[128];
+  char *body = NULL;
+  met_scrape_t *sc;
+  size_t len;
+  int bytes = recv(fd, req, sizeof(req), 0);
+
+  if (0 > bytes && (EAGAIN == errno || EINTR == errno)) {
+    return;
+  }
+  if (0 >= bytes || NULL == (sc = (met_scrape_t *)calloc(1, sizeof(met_scrape_t)))) {
+    _met_done(fd, NULL);
+    return;
+  }
+  len = _met_report(&body);
+  bytes = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		   "Content-Type: text/plain; version=0.0.4\r\n"
+		   "Content-Length: %zu\r\n\r\n", len);
+  if (NULL == (sc->buf = (char *)malloc(bytes + len))) {
+    free(body);
+    free(sc);
+    _met_done(fd, NULL);
+    return;
+  }
+  memcpy(sc->buf, hdr, bytes);
+  if (NULL != body) {
+    memcpy(sc->buf + bytes, body, len);
+  }
+  sc->len = bytes + len;
+  free(body);
+  ev_del(fd);
+  if (-1 == ev_add(fd, EV_WRITE, _met_write, (void *)sc)) {
+    free(sc->buf);
+    free(sc);
+    _met_done(fd, NULL);
+    return;
+  }
+  _met_write(fd, EV_WRITE, (void *)sc);
+}
+
+/** _met_accept
+    event loop handler for the metrics listener */
+void _met_accept (int fd, int events, void *data) {
+  int cfd;
+  while (0 <= (cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+    if (-1 == ev_add(cfd, EV_READ, _met_request, NULL)) {
+      close(cfd);
+    }
+  }
+}
+
+int metrics_listen (char *where, int queue) {
+  char *end;
+  long port;
+  if (NULL == g_met_slots || NULL == where) {
+    return -1;
+  }
+  port = strtol(where, &end, 10);
+  if ('\0' == *end && 0 <= port && MAX_P >= port) {
+    g_met_fd = socket_tcp((int)port, queue, 0);
+  } else {
+    g_met_fd = socket_unix(where, queue);
+    g_met_path = where;
+  }
+  if (-1 == g_met_fd || -1 == ev_add(g_met_fd, EV_READ, _met_accept, NULL)) {
+    log_msg("Unable to serve the metrics on %s", where);
+    if (-1 != g_met_fd) {
+      close(g_met_fd);
+      g_met_fd = -1;
+    }
+    return -1;
+  }
+  if (NULL == g_met_path) {
+    log_msg("metrics on port %d", get_actual_port(g_met_fd));
+  }
+  return 0;
+}
+
+void metrics_close () {
+  if (-1 == g_met_fd) {
+    return;
+  }
+  ev_del(g_met_fd);
+  close(g_met_fd);
+  g_met_fd = -1;
+  if (NULL != g_met_path) {
+    unlink(g_met_path);
+  }
+}
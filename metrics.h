@@ -0,0 +1,128 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* latencies (or session lengths), counted into buckets */
+typedef struct met_hist {
+  uint64_t count;
+  uint64_t sum_us;              /* microseconds */
+  uint64_t b[MET_BUCKETS];      /* not cumulative, the scrape adds them up */
+} met_hist_t;
+
+/* one acceptor's counters, only that acceptor (and the sessions
+   it forks) write them. Shared memory, one cache line per slot start */
+typedef struct met_slot {
+  uint64_t accepted;
+  uint64_t sessions;            /* started */
+  uint64_t rejected;            /* "Server Busy" */
+  uint64_t rate_limited;        /* refused, connecting too often (-L) */
+  uint64_t out_capped;          /* sessions ended at the -o total */
+  uint64_t out_dropped;         /* output bytes discarded over the -o rate */
+  uint64_t waiting;             /* clients in the waiting room now */
+  uint64_t backlog;             /* accept queue left after the last accept */
+  uint64_t backlog_peak;        /* most found waiting at once */
+  uint64_t backlog_limit;       /* listen's queue */
+  met_hist_t spawn;             /* fork (or spawn) to exec */
+  met_hist_t first_byte;        /* accept to the program's first output */
+  met_hist_t duration;          /* session length */
+  uint64_t cpu_us;              /* CPU the sessions used (-g) */
+  uint64_t throttled_us;        /* time they were held back by cpu.max */
+  uint64_t mem_peak;            /* the most one session used, bytes */
+  uint64_t oom_kills;           /* killed at memory.max */
+  uint64_t exits[256];          /* exit codes */
+  uint64_t signals[MET_SIGNALS];
+  uint64_t prog_sessions[MAX_PROGS]; /* by program (-C) */
+  uint64_t prog_rejected[MAX_PROGS];
+  uint64_t prog_failed[MAX_PROGS];   /* exited with other than 0, or killed */
+} __attribute__ ((aligned (64))) met_slot_t;
+
+/** metrics_create
+    counters for n acceptors, in shared memory (the -n acceptors and
+    forked sessions update them, the first server reports them).
+    Until this is called every metrics_ call does nothing */
+int metrics_create (int n) ;
+/** metrics_acceptor
+    this process is acceptor i (see start_acceptors) */
+void metrics_acceptor (int i) ;
+/** metrics_programs
+    the names of the n programs served (-C), for labels.
+    Before the acceptors are started */
+void metrics_programs (char **names, int n) ;
+/** metrics_program
+    the calls that follow are for program k (-1 = none yet,
+    a client still choosing from the menu) */
+void metrics_program (int k) ;
+/** metrics_listen
+    serve the counters (Prometheus text, over HTTP) from the event
+    loop. where is a port, or the path of a Unix socket */
+int metrics_listen (char *where, int queue) ;
+/** metrics_close
+    stop serving them (the Unix socket is removed) */
+void metrics_close () ;
+
+/** metrics_accepted
+    a client connected on clientfd */
+void metrics_accepted (int clientfd) ;
+/** metrics_backlog
+    check the listener's accept queue after a batch of
+    clients was accepted (they were in it too) */
+void metrics_backlog (int entryfd) ;
+/** metrics_rejected
+    a client got "Server Busy" */
+void metrics_rejected () ;
+/** metrics_rate_limited
+    a client was refused for connecting too often */
+void metrics_rate_limited () ;
+/** metrics_output_capped
+    a session sent all the output -o allows, it was ended */
+void metrics_output_capped () ;
+/** metrics_output_dropped
+    bytes of a program's output were discarded (-o ...,drop) */
+void metrics_output_dropped (int bytes) ;
+/** metrics_waiting
+    n clients are in this acceptor's waiting rooms */
+void metrics_waiting (int n) ;
+/** metrics_session
+    a session is starting */
+void metrics_session () ;
+/** metrics_spawn_begin
+    about to fork (or spawn) a session's process */
+void metrics_spawn_begin () ;
+/** metrics_spawn_end
+    the process is exec'ing: in the forked child just before
+    exec, or in the server once spawn_session returns (posix_spawn
+    and vfork return once the child has exec'd) */
+void metrics_spawn_end () ;
+/** metrics_first_byte
+    the program's first output is going to clientfd
+    (seen by the relay, -T -v -J) */
+void metrics_first_byte (int clientfd) ;
+/** metrics_ended
+    a session was reaped (status from waitpid) */
+void metrics_ended (int status, double secs) ;
+
+/** metrics_usage
+    what a session used (cgroup.c) */
+void metrics_usage (uint64_t cpu_us, uint64_t throttled_us, uint64_t mem_peak, uint64_t ooms) ;
+
+#endif /* METRICS_H */
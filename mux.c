@@ -0,0 +1,593 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the framed protocol (-x), so a client (an
+ * autograder, an IDE) can run many sessions over one connection
+ * instead of one connection per run. It is served on a port of
+ * its own, the plain port is still netcat's.
+ *
+ * Everything on the connection is a frame: an 8 byte header,
+ * the stream it is for (4 bytes), its type, a zero byte and
+ * the payload length (2 bytes), all big-endian, then at most
+ * MUX_PAYLOAD bytes of payload. The client picks the stream ids,
+ * opens a stream with MUX_OPEN (its args, packed as gather_pack
+ * does), sends MUX_STDIN and MUX_EOF, and gets MUX_STDOUT,
+ * MUX_STDERR and, once the output is all sent, MUX_EXIT. A stream
+ * that can't start gets MUX_ERROR instead ("Server Busy").
+ *
+ * Flow control is by credit, MUX_CREDIT bytes each way to begin
+ * with. A stream's pipes aren't read once the client's credit is
+ * used up, so a program whose output isn't being read blocks in
+ * write like it would on a socket, and a MUX_WINDOW frame from
+ * the client lets it go on. The server hands out stdin credit as
+ * the program takes it; more stdin than that closes the
+ * connection. Whatever the credits, nothing more is read from the
+ * pipes or the client while the connection has MUX_OBUF unsent.
+ *
+ * Each session is a forked process of its own like any other,
+ * counted against -c, its pipes are watched from the event loop.
+ * A session ends for the client once its output is all sent and
+ * it has been reaped (mux_ended). A connection that goes away
+ * (or only shuts down its side: it can't send credit any more)
+ * takes its sessions with it.
+ *
+ */
+
+#define _GNU_SOURCE  /* pipe2 */
+#include "mux.h"
+#include "evloop.h"
+#include "logger.h"
+#include "ratelimit.h"
+
+static int g_mux_fd = -1;                  /* listener */
+static mux_start_fn_t g_mux_start = NULL;  /* runs a session */
+static void *g_mux_data = NULL;
+static mux_stream_t *g_mux_streams = NULL; /* every stream, for mux_ended */
+
+void _mux_conn_event (int fd, int events, void *data) ;
+void _mux_pipe_event (int fd, int events, void *data) ;
+
+/** _mux_put16, _mux_put32, _mux_get16, _mux_get32
+    big-endian */
+void _mux_put16 (char *p, uint16_t v) {
+  p[0] = (char)(v >> 8);
+  p[1] = (char)v;
+}
+void _mux_put32 (char *p, uint32_t v) {
+  _mux_put16(p, (uint16_t)(v >> 16));
+  _mux_put16(p + 2, (uint16_t)v);
+}
+uint16_t _mux_get16 (char *p) {
+  return (uint16_t)(((uint8_t)p[0] << 8) | (uint8_t)p[1]);
+}
+uint32_t _mux_get32 (char *p) {
+  return ((uint32_t)_mux_get16(p) << 16) | _mux_get16(p + 2);
+}
+
+/** _mux_room
+    make room for n more bytes in c's obuf. Returns -1 if it can't */
+int _mux_room (mux_conn_t *c, int n) {
+  char *buf;
+  int cap;
+  if (0 < c->ooff && c->ooff == c->olen) {
+    c->ooff = c->olen = 0;
+  }
+  if (c->olen + n <= c->ocap) {
+    return 0;
+  }
+  if (0 < c->ooff) {
+    memmove(c->obuf, c->obuf + c->ooff, c->olen - c->ooff);
+    c->olen -= c->ooff;
+    c->ooff = 0;
+    if (c->olen + n <= c->ocap) {
+      return 0;
+    }
+  }
+  cap = c->ocap ? c->ocap : MUX_HDR + MUX_PAYLOAD;
+  while (cap < c->olen + n) {
+    cap *= 2;
+  }
+  if (NULL == (buf = (char *)realloc(c->obuf, cap))) {
+    return -1;
+  }
+  c->obuf = buf;
+  c->ocap = cap;
+  return 0;
+}
+
+/** _mux_header
+    the header of a frame at p */
+void _mux_header (char *p, uint32_t id, int type, int len) {
+  _mux_put32(p, id);
+  p[4] = (char)type;
+  p[5] = 0;
+  _mux_put16(p + 6, (uint16_t)len);
+}
+
+/** _mux_frame
+    queue a frame for the client. Returns -1 if it can't */
+int _mux_frame (mux_conn_t *c, uint32_t id, int type, char *payload, int len) {
+  if (-1 == _mux_room(c, MUX_HDR + len)) {
+    return -1;
+  }
+  _mux_header(c->obuf + c->olen, id, type, len);
+  memcpy(c->obuf + c->olen + MUX_HDR, payload, len);
+  c->olen += MUX_HDR + len;
+  return 0;
+}
+
+/** _mux_frame32
+    queue a frame whose payload is one uint32 */
+int _mux_frame32 (mux_conn_t *c, uint32_t id, int type, uint32_t v) {
+  char p[4];
+  _mux_put32(p, v);
+  return _mux_frame(c, id, type, p, 4);
+}
+
+/** _mux_pipe_interest
+    the events s's pipe fd (i: 0 stdin, 1 stdout, 2 stderr) is watched for */
+int _mux_pipe_interest (mux_stream_t *s, int i) {
+  if (0 == i) {
+    return (0 < s->ilen) ? EV_WRITE : 0;
+  }
+  return (0 < s->window && !s->conn->backed) ? EV_READ : 0;
+}
+
+/** _mux_watch
+    watch s's pipe i for what it is waiting on now. A pipe with
+    nothing to wait on is taken out of the event loop, a hung up
+    one would be reported over and over until it is read */
+void _mux_watch (mux_stream_t *s, int i) {
+  int events;
+  if (-1 == s->fd[i]) {
+    return;
+  }
+  events = _mux_pipe_interest(s, i);
+  if (0 == events) {
+    if ((1 << i) & s->watched) {
+      ev_del(s->fd[i]);
+      s->watched &= ~(1 << i);
+    }
+  } else if ((1 << i) & s->watched) {
+    ev_mod(s->fd[i], events);
+  } else if (0 == ev_add(s->fd[i], events, _mux_pipe_event, (void *)s)) {
+    s->watched |= (1 << i);
+  }
+}
+
+/** _mux_rearm
+    watch all of s's pipes for what they are waiting on now */
+void _mux_rearm (mux_stream_t *s) {
+  int i;
+  for (i = 0; i < 3; i++) {
+    _mux_watch(s, i);
+  }
+}
+
+/** _mux_close_pipe
+    s's pipe i is done */
+void _mux_close_pipe (mux_stream_t *s, int i) {
+  if (-1 == s->fd[i]) {
+    return;
+  }
+  if ((1 << i) & s->watched) {
+    ev_del(s->fd[i]);
+    s->watched &= ~(1 << i);
+  }
+  close(s->fd[i]);
+  s->fd[i] = -1;
+  if (0 == i) {
+    s->ilen = 0;
+  }
+}
+
+/** _mux_stream_free
+    take s off its connection and out of the table, and free it.
+    Its process, if it is still running, is killed */
+void _mux_stream_free (mux_stream_t *s) {
+  mux_stream_t **p;
+  int i;
+  if (!s->exited && 0 < s->pid) {
+    kill(s->pid, SIGKILL); /* reaped by session.c like any other */
+  }
+  for (i = 0; i < 3; i++) {
+    _mux_close_pipe(s, i);
+  }
+  for (p = &(s->conn->streams); NULL != *p; p = &((*p)->next)) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  for (p = &g_mux_streams; NULL != *p; p = &((*p)->gnext)) {
+    if (*p == s) {
+      *p = s->gnext;
+      break;
+    }
+  }
+  s->conn->nstreams--;
+  free(s->ibuf);
+  free(s);
+}
+
+/** _mux_conn_interest
+    the events c's socket is watched for */
+int _mux_conn_interest (mux_conn_t *c) {
+  int events = 0;
+  if (!c->backed) {
+    events |= EV_READ;
+  }
+  if (c->ooff < c->olen) {
+    events |= EV_WRITE;
+  }
+  return events;
+}
+
+/** _mux_conn_close
+    the connection is done (or broken), so are its streams */
+void _mux_conn_close (mux_conn_t *c) {
+  while (NULL != c->streams) {
+    _mux_stream_free(c->streams);
+  }
+  ev_del(c->fd);
+  close(c->fd);
+  free(c->obuf);
+  free(c);
+}
+
+/** _mux_flush
+    write what c has queued, as much as the socket takes, and
+    start or stop reading the pipes as it drains or backs up.
+    Returns -1 if the connection is gone (and c with it) */
+int _mux_flush (mux_conn_t *c) {
+  mux_stream_t *s;
+  int n, backed;
+  while (c->ooff < c->olen) {
+    n = write(c->fd, c->obuf + c->ooff, c->olen - c->ooff);
+    if (0 > n) {
+      if (EAGAIN == errno || EWOULDBLOCK == errno) {
+	break;
+      }
+      if (EINTR == errno) {
+	continue;
+      }
+      _mux_conn_close(c);
+      return -1;
+    }
+    c->ooff += n;
+  }
+  backed = (MUX_OBUF < c->olen - c->ooff);
+  if (backed != c->backed) {
+    c->backed = backed;
+    for (s = c->streams; NULL != s; s = s->next) {
+      _mux_rearm(s);
+    }
+  }
+  ev_mod(c->fd, _mux_conn_interest(c));
+  return 0;
+}
+
+/** _mux_exit_code
+    what MUX_EXIT says for a wait status */
+uint32_t _mux_exit_code (int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+/** _mux_stream_check
+    once s's output is all read and it has been reaped, the
+    client gets MUX_EXIT and the stream is gone */
+void _mux_stream_check (mux_stream_t *s) {
+  if (!s->exited || -1 != s->fd[1] || -1 != s->fd[2]) {
+    return;
+  }
+  _mux_frame32(s->conn, s->id, MUX_EXIT, _mux_exit_code(s->status));
+  _mux_stream_free(s);
+}
+
+/** _mux_stream_find
+    the stream id on c, NULL if there is none */
+mux_stream_t *_mux_stream_find (mux_conn_t *c, uint32_t id) {
+  mux_stream_t *s;
+  for (s = c->streams; NULL != s && s->id != id; s = s->next)
+    ;
+  return s;
+}
+
+/** _mux_error
+    stream id on c didn't start */
+void _mux_error (mux_conn_t *c, uint32_t id, char *why) {
+  _mux_frame(c, id, MUX_ERROR, why, strlen(why));
+}
+
+/** _mux_open
+    MUX_OPEN: start a session for stream id, with the args packed in buf */
+void _mux_open (mux_conn_t *c, uint32_t id, char *buf, int len) {
+  char packed[MAX_PACKED_ARGS + 1];
+  char *args[MAX_A + 1];
+  int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+  int fds[3], nargs, i;
+  mux_stream_t *s;
+
+  if (NULL != _mux_stream_find(c, id)) {
+    _mux_error(c, id, "Stream In Use");
+    return;
+  }
+  if (MUX_STREAMS <= c->nstreams) {
+    _mux_error(c, id, "Too Many Streams");
+    return;
+  }
+  if (MAX_PACKED_ARGS < len) {
+    _mux_error(c, id, "Args Too Long");
+    return;
+  }
+  memcpy(packed, buf, len);
+  packed[len] = '\0'; /* the last arg may not be terminated */
+  nargs = gather_unpack(packed, len, args, MAX_A);
+
+  s = (mux_stream_t *)calloc(1, sizeof(mux_stream_t));
+  if (NULL == s || NULL == (s->ibuf = (char *)malloc(MUX_CREDIT)) ||
+      -1 == pipe2(in, O_CLOEXEC) || -1 == pipe2(out, O_CLOEXEC) ||
+      -1 == pipe2(err, O_CLOEXEC)) {
+    log_msg("Unable to set up a mux stream");
+    goto fail;
+  }
+  fds[0] = in[0];
+  fds[1] = out[1];
+  fds[2] = err[1];
+  if (0 > (s->pid = g_mux_start(c->fd, fds, args, nargs, g_mux_data))) {
+    _mux_error(c, id, "Server Busy");
+    goto fail;
+  }
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  s->id = id;
+  s->conn = c;
+  s->fd[0] = in[1];
+  s->fd[1] = out[0];
+  s->fd[2] = err[0];
+  s->window = MUX_CREDIT;
+  s->next = c->streams;
+  c->streams = s;
+  c->nstreams++;
+  s->gnext = g_mux_streams;
+  g_mux_streams = s;
+  for (i = 0; i < 3; i++) {
+    fcntl(s->fd[i], F_SETFL, fcntl(s->fd[i], F_GETFL, 0) | O_NONBLOCK);
+  }
+  _mux_rearm(s);
+  return;
+
+ fail:
+  for (i = 0; i < 2; i++) {
+    if (-1 != in[i]) close(in[i]);
+    if (-1 != out[i]) close(out[i]);
+    if (-1 != err[i]) close(err[i]);
+  }
+  if (NULL != s) {
+    free(s->ibuf);
+    free(s);
+  }
+}
+
+/** _mux_stdin
+    MUX_STDIN: queue len bytes for s's program.
+    Returns -1 if the client sent more than its credit */
+int _mux_stdin (mux_stream_t *s, char *buf, int len) {
+  if (MUX_CREDIT < s->ilen + len) {
+    return -1;
+  }
+  if (-1 == s->fd[0] || s->in_eof) {
+    /* nobody is reading, hand the credit straight back */
+    _mux_frame32(s->conn, s->id, MUX_WINDOW, len);
+    return 0;
+  }
+  memcpy(s->ibuf + s->ilen, buf, len);
+  s->ilen += len;
+  _mux_watch(s, 0);
+  return 0;
+}
+
+/** _mux_dispatch
+    one whole frame came in on c.
+    Returns -1 if it breaks the protocol */
+int _mux_dispatch (mux_conn_t *c, uint32_t id, int type, char *buf, int len) {
+  mux_stream_t *s;
+  if (MUX_OPEN == type) {
+    _mux_open(c, id, buf, len);
+    return 0;
+  }
+  if (MUX_STDIN != type && MUX_EOF != type && MUX_WINDOW != type && MUX_KILL != type) {
+    return -1;
+  }
+  if (NULL == (s = _mux_stream_find(c, id))) {
+    return 0; /* it has already ended, the client hadn't heard yet */
+  }
+  switch (type) {
+  case MUX_STDIN:
+    return _mux_stdin(s, buf, len);
+  case MUX_EOF:
+    s->in_eof = 1;
+    if (0 == s->ilen) {
+      _mux_close_pipe(s, 0);
+    }
+    return 0;
+  case MUX_WINDOW:
+    if (4 != len || INT_MAX < s->window + (int64_t)_mux_get32(buf)) {
+      return -1;
+    }
+    s->window += _mux_get32(buf);
+    _mux_rearm(s);
+    return 0;
+  default: /* MUX_KILL */
+    if (!s->exited && 0 < s->pid) {
+      kill(s->pid, SIGKILL); /* once reaped the pid may be someone else's */
+    }
+    return 0;
+  }
+}
+
+/** _mux_read
+    read what the client sent and act on each whole frame.
+    Returns -1 if the connection is gone (and c with it) */
+int _mux_read (mux_conn_t *c) {
+  int n, off = 0, len;
+  n = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+  if (0 > n && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+    return 0;
+  }
+  if (0 >= n) {
+    /* gone, or done: either way it can't send credit, its
+       sessions would block for good */
+    _mux_conn_close(c);
+    return -1;
+  }
+  c->rlen += n;
+  while (MUX_HDR <= c->rlen - off) {
+    len = _mux_get16(c->rbuf + off + 6);
+    if (MUX_PAYLOAD < len) {
+      log_msg("mux client sent a %d byte frame, closing it", len);
+      _mux_conn_close(c);
+      return -1;
+    }
+    if (MUX_HDR + len > c->rlen - off) {
+      break;
+    }
+    if (-1 == _mux_dispatch(c, _mux_get32(c->rbuf + off), (uint8_t)c->rbuf[off + 4],
+			    c->rbuf + off + MUX_HDR, len)) {
+      log_msg("mux client broke the protocol (frame type %d), closing it",
+	      (uint8_t)c->rbuf[off + 4]);
+      _mux_conn_close(c);
+      return -1;
+    }
+    off += MUX_HDR + len;
+  }
+  memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+  c->rlen -= off;
+  return 0;
+}
+
+/** _mux_conn_event
+    event loop handler for a client connection */
+void _mux_conn_event (int fd, int events, void *data) {
+  mux_conn_t *c = (mux_conn_t *)data;
+  if (EV_ERR & events) {
+    _mux_conn_close(c);
+    return;
+  }
+  if ((EV_READ & events) && -1 == _mux_read(c)) {
+    return;
+  }
+  _mux_flush(c);
+}
+
+/** _mux_pipe_event
+    event loop handler for a stream's pipes */
+void _mux_pipe_event (int fd, int events, void *data) {
+  mux_stream_t *s = (mux_stream_t *)data;
+  mux_conn_t *c = s->conn;
+  int n, want, i;
+
+  if (fd == s->fd[0]) {
+    n = write(fd, s->ibuf, s->ilen);
+    if (0 > n && (EAGAIN == errno || EINTR == errno)) {
+      return;
+    }
+    if (0 > n) {
+      /* the program closed its stdin, what's left can't be taken */
+      n = s->ilen;
+      _mux_close_pipe(s, 0);
+    } else {
+      memmove(s->ibuf, s->ibuf + n, s->ilen - n);
+      s->ilen -= n;
+      if (0 == s->ilen && s->in_eof) {
+	_mux_close_pipe(s, 0);
+      } else {
+	_mux_watch(s, 0);
+      }
+    }
+    _mux_frame32(c, s->id, MUX_WINDOW, n);
+    _mux_flush(c);
+    return;
+  }
+
+  /* stdout or stderr, read straight into a frame */
+  i = (fd == s->fd[1]) ? 1 : 2;
+  want = (MUX_PAYLOAD < s->window) ? MUX_PAYLOAD : s->window;
+  if (0 == want || c->backed || -1 == _mux_room(c, MUX_HDR + want)) {
+    _mux_watch(s, i);
+    return;
+  }
+  n = read(fd, c->obuf + c->olen + MUX_HDR, want);
+  if (0 > n && (EAGAIN == errno || EINTR == errno)) {
+    return;
+  }
+  if (0 >= n) {
+    _mux_close_pipe(s, i);
+    _mux_stream_check(s);
+  } else {
+    _mux_header(c->obuf + c->olen, s->id, (1 == i) ? MUX_STDOUT : MUX_STDERR, n);
+    c->olen += MUX_HDR + n;
+    s->window -= n;
+    if (0 == s->window) {
+      _mux_watch(s, i);
+    }
+  }
+  _mux_flush(c);
+}
+
+/** _mux_accept
+    a client connected to the -x port */
+void _mux_accept (int fd, int clientfd, void *data) {
+  mux_conn_t *c;
+  if (0 > clientfd) {
+    return;
+  }
+  if (!rate_allow(clientfd)) {
+    close(clientfd);
+    return;
+  }
+  fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) | O_NONBLOCK);
+  if (NULL == (c = (mux_conn_t *)calloc(1, sizeof(mux_conn_t)))) {
+    close(clientfd);
+    return;
+  }
+  c->fd = clientfd;
+  if (-1 == ev_add(clientfd, EV_READ, _mux_conn_event, (void *)c)) {
+    close(clientfd);
+    free(c);
+  }
+}
+
+int mux_listen (int port, int queue, mux_start_fn_t start, void *data) {
+  g_mux_start = start;
+  g_mux_data = data;
+  g_mux_fd = socket_tcp(port, queue, 1);
+  if (-1 == g_mux_fd || -1 == ev_accept(g_mux_fd, _mux_accept, NULL)) {
+    log_msg("Unable to serve the mux protocol on port %d", port);
+    if (-1 != g_mux_fd) {
+      close(g_mux_fd);
+      g_mux_fd = -1;
+    }
+    return -1;
+  }
+  log_msg("mux protocol on port %d", get_actual_port(g_mux_fd));
+  return 0;
+}
+
+void mux_ended (pid_t pid, int status) {
+  mux_stream_t *s;
+  mux_conn_t *c;
+  for (s = g_mux_streams; NULL != s && s->pid != pid; s = s->gnext)
+    ;
+  if (NULL == s) {
+    return;
+  }
+  c = s->conn;
+  s->exited = 1;
+  s->status = status;
+  _mux_stream_check(s);
+  _mux_flush(c);
+}
@@ -0,0 +1,84 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "gather.h"
+#include "netwrk.h"
+
+/* frame types, client -> server */
+#define MUX_OPEN      1   /* start a session, payload "ARG\0ARG\0..." */
+#define MUX_STDIN     2   /* bytes for its stdin */
+#define MUX_EOF       3   /* close its stdin */
+#define MUX_WINDOW    4   /* payload uint32: more bytes the other side may send
+			     (both ways: stdout+stderr credit, stdin credit) */
+#define MUX_KILL      5   /* kill it */
+/* server -> client */
+#define MUX_STDOUT   16
+#define MUX_STDERR   17
+#define MUX_EXIT     18   /* payload uint32: exit code, or 128+signal. Last frame */
+#define MUX_ERROR    19   /* payload text, the session didn't start. Last frame */
+
+/* starts a session's program on fds (stdin, stdout, stderr) for a
+   stream on the connection conn, returns its pid, or -1 if it can't
+   (no slot, fork failed) */
+typedef pid_t (*mux_start_fn_t)(int conn, int *fds, char **args, int nargs, void *data);
+
+struct mux_conn;
+
+/* one logical session on a connection */
+typedef struct mux_stream {
+  uint32_t id;
+  pid_t pid;
+  struct mux_conn *conn;
+  int fd[3];                 /* stdin, stdout, stderr pipes, -1 once closed */
+  int watched;               /* bit i: fd[i] is in the event loop */
+  char *ibuf;                /* stdin not yet written, MUX_CREDIT */
+  int ilen;
+  int in_eof;                /* MUX_EOF came, close stdin once ibuf is written */
+  int window;                /* stdout+stderr bytes the client will take */
+  int status;                /* wait status */
+  int exited;
+  struct mux_stream *next;   /* the connection's */
+  struct mux_stream *gnext;  /* all of them, by pid for mux_ended */
+} mux_stream_t;
+
+/* one client connection */
+typedef struct mux_conn {
+  int fd;
+  char rbuf[MUX_HDR + MUX_PAYLOAD]; /* the frame coming in */
+  int rlen;
+  char *obuf;                /* frames going out */
+  int olen;
+  int ooff;
+  int ocap;
+  int backed;                /* obuf over MUX_OBUF, pipes aren't read */
+  int nstreams;
+  mux_stream_t *streams;
+} mux_conn_t;
+
+/** mux_listen
+    accept the framed protocol on port (every acceptor, the
+    port is shared with SO_REUSEPORT). start runs each session.
+    Returns -1 if the port can't be had */
+int mux_listen (int port, int queue, mux_start_fn_t start, void *data) ;
+/** mux_ended
+    a session was reaped, if it is a stream its client is
+    told once its output is all sent */
+void mux_ended (pid_t pid, int status) ;
+
+#endif /* MUX_H */
@@ -0,0 +1,121 @@
+# -*- Mode: Python -*-
+#
+# Client for the framed protocol, ./main -x PORT (see mux.c)
+#
+#   $ python3 muxclient.py HOST PORT RUNS [ARG ...] < input
+#
+# Runs the program RUNS times at once over one connection, each
+# run given all of input and the ARGs, then prints what each one
+# wrote and how it exited. An autograder would use MuxClient the
+# same way, one stream per test.
+#
+# frame:  stream (4) type (1) 0 (1) length (2), big-endian, payload
+# client -> server:  OPEN "ARG\0ARG\0..."  STDIN  EOF
+#                    WINDOW uint32 (more output credit)  KILL
+# server -> client:  STDOUT  STDERR  EXIT uint32  ERROR "why"
+#                    WINDOW uint32 (more stdin credit)
+#
+
+import select
+import socket
+import struct
+import sys
+
+OPEN, STDIN, EOF, WINDOW, KILL = 1, 2, 3, 4, 5
+STDOUT, STDERR, EXIT, ERROR = 16, 17, 18, 19
+HDR = struct.Struct('>IBxH')
+PAYLOAD = 16384
+INITIAL_WINDOW = 65536
+
+
+class Stream:
+    def __init__(self, sid, data):
+        self.sid = sid
+        self.pending = data     # stdin not sent yet
+        self.credit = INITIAL_WINDOW
+        self.eof_sent = False
+        self.out = bytearray()
+        self.err = bytearray()
+        self.status = None      # exit code, or the ERROR text
+
+
+class MuxClient:
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.streams = {}
+        self.rbuf = bytearray()
+        self.wbuf = bytearray()
+
+    def frame(self, sid, kind, payload=b''):
+        self.wbuf += HDR.pack(sid, kind, len(payload)) + payload
+
+    def open(self, sid, args=(), data=b''):
+        """start a run on stream sid, data is all of its stdin"""
+        self.streams[sid] = Stream(sid, data)
+        self.frame(sid, OPEN, b''.join(a.encode() + b'\0' for a in args))
+
+    def _feed(self):
+        """send the stdin each stream has credit for"""
+        for s in self.streams.values():
+            while s.pending and s.credit:
+                n = min(len(s.pending), s.credit, PAYLOAD)
+                self.frame(s.sid, STDIN, s.pending[:n])
+                s.pending = s.pending[n:]
+                s.credit -= n
+            if not s.pending and not s.eof_sent:
+                self.frame(s.sid, EOF)
+                s.eof_sent = True
+
+    def _handle(self, sid, kind, payload):
+        s = self.streams.get(sid)
+        if s is None:
+            return
+        if kind in (STDOUT, STDERR):
+            (s.out if STDOUT == kind else s.err).extend(payload)
+            self.frame(sid, WINDOW, struct.pack('>I', len(payload)))
+        elif WINDOW == kind:
+            s.credit += struct.unpack('>I', payload)[0]
+        elif EXIT == kind:
+            s.status = struct.unpack('>I', payload)[0]
+        elif ERROR == kind:
+            s.status = payload.decode(errors='replace')
+
+    def run(self):
+        """until every stream has ended"""
+        while any(s.status is None for s in self.streams.values()):
+            self._feed()
+            w = [self.sock] if self.wbuf else []
+            r, w, _ = select.select([self.sock], w, [])
+            if w:
+                self.wbuf = self.wbuf[self.sock.send(self.wbuf):]
+            if r:
+                data = self.sock.recv(1 << 16)
+                if not data:
+                    raise ConnectionError('server closed the connection')
+                self.rbuf += data
+                while len(self.rbuf) >= HDR.size:
+                    sid, kind, n = HDR.unpack_from(self.rbuf)
+                    if len(self.rbuf) < HDR.size + n:
+                        break
+                    self._handle(sid, kind, bytes(self.rbuf[HDR.size:HDR.size + n]))
+                    del self.rbuf[:HDR.size + n]
+        return self.streams
+
+
+def main():
+    if len(sys.argv) < 4:
+        print('usage: python3 muxclient.py HOST PORT RUNS [ARG ...] < input')
+        return 2
+    data = sys.stdin.buffer.read()
+    client = MuxClient(sys.argv[1], int(sys.argv[2]))
+    for sid in range(1, int(sys.argv[3]) + 1):
+        client.open(sid, sys.argv[4:], data)
+    for sid, s in sorted(client.run().items()):
+        print('--- run %d: %s' % (sid, s.status))
+        sys.stdout.write(s.out.decode(errors='replace'))
+        sys.stderr.write(s.err.decode(errors='replace'))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -13,7 +13,7 @@
 
 /** make_socket ("Doing stuff while waiting for alarm....")
     create a socket and bind to address */
-int make_socket (int type, int port) {
+int make_socket (int type, int port, int reuseport) {
   struct sockaddr_in addr;
   socklen_t addrlen = sizeof (addr);
   bzero (&addr, addrlen);
@@ -27,8 +27,17 @@ int make_socket (int type, int port) {
     return -1;
   }
 
-  /* socket should be non-blocking */
+  /* socket should be non-blocking, and not leak into exec'd programs */
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  /* every acceptor binds the port, the kernel spreads the clients */
+  if (reuseport &&
+      -1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport))) {
+    dprintf(STDERR_FILENO, "SO_REUSEPORT failed\n");
+    close(fd);
+    return -1;
+  }
   
   if (-1 == bind (fd, (struct sockaddr *)&addr, addrlen)) {
     dprintf(STDERR_FILENO, "bind failed\n");
@@ -39,8 +48,8 @@ int make_socket (int type, int port) {
 
 /** socket_tcp
     create a passive (listening) TCP socket */
-int socket_tcp (int port, int queue) {
-  int fd = make_socket (SOCK_STREAM, port);
+int socket_tcp (int port, int queue, int reuseport) {
+  int fd = make_socket (SOCK_STREAM, port, reuseport);
   if (-1 == fd) return -1;
 
   if (-1 == listen (fd, queue)) {
@@ -50,6 +59,41 @@ int socket_tcp (int port, int queue) {
   return fd;
 }
 
+/** socket_unix
+    create a passive Unix socket at path. An old socket there is
+    removed, anything else is left alone and it fails */
+int socket_unix (char *path, int queue) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+  bzero (&addr, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof (addr.sun_path)) {
+    dprintf(STDERR_FILENO, "socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  if (0 == lstat(path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      dprintf(STDERR_FILENO, "%s exists and isn't a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (-1 == fd) {
+    dprintf (STDERR_FILENO, "socket failed\n");
+    return -1;
+  }
+  if (-1 == bind (fd, (struct sockaddr *)&addr, sizeof (addr)) || -1 == listen (fd, queue)) {
+    dprintf(STDERR_FILENO, "bind failed\n");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
 /** get_actual_port
     return the port the server is using.
     useful when allowing the OS to select the port */
@@ -83,3 +127,55 @@ int read_cli (int fd, char *buf) {
   *(buf+bytes-1) = '\0';
   return bytes;
 }
+
+/** send_fd
+    send buf and fd over the unix socket chan */
+int send_fd (int chan, int fd, char *buf, int len) {
+  char ctl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { buf, len };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  bzero(&msg, sizeof(msg));
+  bzero(ctl, sizeof(ctl));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return (len == sendmsg(chan, &msg, MSG_NOSIGNAL)) ? 0 : -1;
+}
+
+/** recv_fd
+    receive a message and fd sent with send_fd */
+int recv_fd (int chan, char *buf, int *len) {
+  char ctl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { buf, *len };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int fd = -1;
+  int bytes;
+
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  while (0 > (bytes = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC))) {
+    if (EINTR != errno) {
+      *len = 0;
+      return -1;
+    }
+  }
+  *len = bytes;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level &&
+      SCM_RIGHTS == cmsg->cmsg_type) {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  return fd;
+}
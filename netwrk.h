@@ -3,22 +3,31 @@
 #define NETWRK_H
 
 #include <arpa/inet.h>
-//#include <errno.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
 //#include <netinet/in.h>
 //#include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 //#include <sys/select.h>
-//#include <sys/socket.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "defs.h"
 
 /** socket_tcp
-    create a passive (listening) TCP socket */
-int socket_tcp (int port, int queue) ;
+    create a passive (listening) TCP socket.
+    With reuseport other sockets (the -n acceptors)
+    can listen on the same port */
+int socket_tcp (int port, int queue, int reuseport) ;
+/** socket_unix
+    create a passive (listening) Unix socket at path. An old
+    socket there is removed, if it is anything else it fails */
+int socket_unix (char *path, int queue) ;
 /** get_actual_port
     return the port the server is using.
     useful when allowing the OS to select the port */
@@ -29,4 +38,14 @@ int write_cli (int fd, char *s, int len) ;
 /* read a mesg from client (could block) */
 int read_cli (int fd, char *buf) ;
 
+/** send_fd
+    send len bytes of buf over the unix socket chan,
+    along with fd (SCM_RIGHTS). Returns -1 on failure */
+int send_fd (int chan, int fd, char *buf, int len) ;
+/** recv_fd
+    receive a message sent with send_fd, blocking.
+    The message goes in buf (*len is its size, and is set to
+    the bytes received). Returns the fd, or -1 if there wasn't one */
+int recv_fd (int chan, char *buf, int *len) ;
+
 #endif /* NETWRK_H */
@@ -0,0 +1,140 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the pre-spawned session pool (-P NUM).
+ * Workers are forked ahead of time and park in recvmsg on
+ * a unix socket. When a client connects the server passes
+ * the client fd (and its -a args) over with SCM_RIGHTS, so the fork is already
+ * paid for and the worker only has to exec. The pool is
+ * refilled from the event loop after the current batch of
+ * clients has been handed off.
+ *
+ * A program can't be exec'd before it has its client, it would
+ * start running. A python program's workers exec its interpreter
+ * instead (zygote.py --park), which does the program's imports
+ * and parks, so the interpreter's startup is paid ahead too.
+ *
+ */
+
+#define _GNU_SOURCE  /* close_range */
+#include "pool.h"
+#include "cgroup.h"
+#include "evloop.h"
+#include "gather.h"
+#include "logger.h"
+#include "netwrk.h"
+
+/** _pool_spawn
+    fork one worker and park it.
+    The worker closes everything that belongs to the server
+    (the other workers' sockets, so they notice when the server
+    goes away, and the clients of relayed sessions, which would
+    otherwise stay open after the server closes them) */
+int _pool_spawn (pool_t *pool) {
+  int sv[2];
+  int clientfd, nargs, at;
+  char buf[2+PATH_MAX+MAX_PACKED_ARGS];
+  char *args[MAX_A+1];
+  int len = sizeof(buf)-1;
+  if (-1 == socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+    return -1;
+  }
+  pid_t chid = fork ();
+  if (0 > chid) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (0 == chid) {
+    /* worker */
+    close_range(STDERR_FILENO+1, sv[1]-1, 0);
+    close_range(sv[1]+1, ~0U, 0);
+    ev_child_reset();
+    if (NULL != pool->park) {
+      if (POOL_PARK_FD == sv[1]) {
+	fcntl(sv[1], F_SETFD, 0);
+      } else {
+	dup2(sv[1], POOL_PARK_FD);
+      }
+      execvp(pool->park[0], pool->park);
+      /* no interpreter, park here */
+    }
+    clientfd = recv_fd(sv[1], buf, &len);
+    close(sv[1]);
+    if (0 > clientfd) {
+      _exit(0); /* server is gone */
+    }
+    /* "c", the session's cgroup leaf (-g), then the args */
+    buf[len] = '\0';
+    at = 1 + strlen(buf+1) + 1;
+    cgroup_enter(buf+1);
+    nargs = (at < len) ? gather_unpack(buf+at, len-at, args, MAX_A) : 0;
+    pool->launch(clientfd, args, nargs, pool->prog);
+    _exit(12);
+  }
+  /* server */
+  close(sv[1]);
+  pool->chans[pool->idle] = sv[0];
+  pool->pids[pool->idle] = chid;
+  pool->idle++;
+  return 0;
+}
+
+/** _pool_refill
+    event loop handler for the pool's eventfd */
+void _pool_refill (int fd, int events, void *data) {
+  pool_t *pool = (pool_t *)data;
+  eventfd_t n;
+  eventfd_read(fd, &n);
+  while (pool->idle < pool->size) {
+    if (-1 == _pool_spawn(pool)) {
+      log_msg("Unable to refill session pool");
+      break;
+    }
+  }
+}
+
+pool_t *pool_create (int size, int entryfd, launch_fn_t launch, void *prog, char **park) {
+  pool_t *pool = (pool_t *)calloc(1, sizeof(pool_t));
+  if (NULL == pool) {
+    return NULL;
+  }
+  pool->size = size;
+  pool->entryfd = entryfd;
+  pool->launch = launch;
+  pool->prog = prog;
+  pool->park = park;
+  pool->chans = (int *)calloc(size, sizeof(int));
+  pool->pids = (pid_t *)calloc(size, sizeof(pid_t));
+  pool->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (NULL == pool->chans || NULL == pool->pids || 0 > pool->wakefd ||
+      -1 == ev_add(pool->wakefd, EV_READ, _pool_refill, (void *)pool)) {
+    log_msg("Unable to create session pool");
+    free(pool->chans);
+    free(pool->pids);
+    free(pool);
+    return NULL;
+  }
+  /* fill it right away, before any clients show up */
+  _pool_refill(pool->wakefd, EV_READ, (void *)pool);
+  return pool;
+}
+
+pid_t pool_handoff (pool_t *pool, int clientfd, char *cgroup, char **args, int nargs) {
+  char buf[2+PATH_MAX+MAX_PACKED_ARGS];
+  pid_t pid = -1;
+  int len;
+  buf[0] = 'c';
+  snprintf(buf+1, PATH_MAX, "%s", (NULL == cgroup) ? "" : cgroup);
+  len = 1 + strlen(buf+1) + 1;
+  len += gather_pack(args, nargs, buf+len, MAX_PACKED_ARGS);
+  while (0 < pool->idle && -1 == pid) {
+    pool->idle--;
+    if (0 == send_fd(pool->chans[pool->idle], clientfd, buf, len)) {
+      pid = pool->pids[pool->idle];
+    }
+    /* either handed off, or the worker died, it's not parked anymore */
+    close(pool->chans[pool->idle]);
+  }
+  eventfd_write(pool->wakefd, 1);
+  return pid;
+}
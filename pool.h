@@ -0,0 +1,49 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* runs in a worker once it has a client (and its args),
+   should not return */
+typedef void (*launch_fn_t)(int clientfd, char **args, int nargs, void *prog);
+
+/* processes started ahead of time, each parked on a unix
+   socket waiting for a client fd (SCM_RIGHTS) */
+typedef struct pool {
+  int size;            /* how many workers to keep parked */
+  int idle;            /* how many are parked right now */
+  int *chans;          /* server end of each parked worker's socket */
+  pid_t *pids;         /* pid of each parked worker */
+  int entryfd;         /* listening socket, closed in the workers */
+  int wakefd;          /* eventfd, tells the loop to refill */
+  launch_fn_t launch;
+  void *prog;
+  char **park;         /* the workers exec this and park in it, NULL = they don't */
+} pool_t;
+
+/** pool_create
+    fork size workers and register the refill handler with the
+    event loop. With park the workers exec it, their socket on
+    POOL_PARK_FD, and it takes the client (see zygote_park_argv),
+    otherwise they stop short of exec and call launch.
+    Returns NULL if the pool can't be set up */
+pool_t *pool_create (int size, int entryfd, launch_fn_t launch, void *prog, char **park) ;
+/** pool_handoff
+    pass clientfd and its args to a parked worker, which joins
+    the cgroup leaf (NULL for none) first. Returns the
+    worker's pid (which is now the client's session), or -1 if
+    none are parked */
+pid_t pool_handoff (pool_t *pool, int clientfd, char *cgroup, char **args, int nargs) ;
+
+#endif /* POOL_H */
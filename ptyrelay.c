@@ -0,0 +1,59 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the pty sessions (-T). With the socket on
+ * stdin/stdout the program's stdio sees a non-tty and buffers
+ * its output in blocks, so a prompt like "Enter your name: " can
+ * show up after the student has already typed. With -T the
+ * program runs on a pseudo-terminal instead (stdio line buffers,
+ * python and java flush as they would in a terminal), and the
+ * server relays between the pty master and the client socket.
+ *
+ * The pty doesn't echo and doesn't turn "\n" into "\r\n", so the
+ * client sees the same bytes it would without -T, only sooner.
+ *
+ */
+
+#define _GNU_SOURCE  /* posix_openpt, ptsname */
+#include "ptyrelay.h"
+
+int pty_session (int clientfd, relay_t **r) {
+  struct termios tio;
+  struct winsize ws;
+  int master, slave;
+  char *name;
+
+  if (-1 == (master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC))) {
+    return -1;
+  }
+  if (-1 == grantpt(master) || -1 == unlockpt(master) ||
+      NULL == (name = ptsname(master)) ||
+      -1 == (slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC))) {
+    close(master);
+    return -1;
+  }
+  if (0 == tcgetattr(slave, &tio)) {
+    tio.c_lflag &= ~(ECHO | ECHONL); /* nc already shows what was typed */
+    tio.c_oflag &= ~OPOST;
+    tcsetattr(slave, TCSANOW, &tio);
+  }
+  bzero(&ws, sizeof(ws));
+  ws.ws_row = PTY_ROWS;
+  ws.ws_col = PTY_COLS;
+  ioctl(slave, TIOCSWINSZ, &ws);
+
+  /* the session is over when the program's side closes (EIO),
+     its slot is given back when it is reaped */
+  if (NULL == (*r = relay_start(clientfd, master, master, NULL, NULL))) {
+    close(slave);
+    close(master);
+    return -1;
+  }
+  return slave;
+}
+
+void pty_take_ctty (int fd) {
+  if (isatty(fd)) {
+    setsid();
+    ioctl(fd, TIOCSCTTY, 0);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef PTYRELAY_H
+#define PTYRELAY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "relay.h"
+
+/** pty_session
+    -T: put a pseudo-terminal between the client and the
+    program. The relay (*r) pumps clientfd <-> the master from
+    the event loop (and owns clientfd from now on). Returns the
+    slave, which the program gets instead of the socket, or
+    -1 (nothing changed, use clientfd as before) */
+int pty_session (int clientfd, relay_t **r) ;
+/** pty_take_ctty
+    in the session's process before exec: if fd is a pty
+    slave, make it the controlling terminal (new session),
+    so the program gets SIGHUP when the client goes away */
+void pty_take_ctty (int fd) ;
+
+#endif /* PTYRELAY_H */
@@ -0,0 +1,259 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the per-address connection limit (-L).
+ * A script reconnecting in a loop used to fill the listen queue
+ * and cost a fork per connection. Now every client address has
+ * a token bucket, checked as soon as the client is accepted:
+ * one token per connection, refilled at the -L rate, and a
+ * client without one is reset and closed before anything else
+ * is done for it.
+ *
+ * The buckets are in one fixed table (RATE_SLOTS, open addressing
+ * with linear probing, no tombstones: a delete shifts the probe
+ * chain back). It never holds more than RATE_MAX addresses, the
+ * least recently seen one makes room for a new one, so the memory
+ * is bounded however many addresses connect. An address that was
+ * evicted had a full bucket or soon would, it loses nothing.
+ *
+ * The table is in shared memory, made before the acceptors (-n)
+ * are forked, so an address has one bucket however its
+ * connections are spread over them (SO_REUSEPORT hashes each
+ * connection, not each address). A process-shared mutex guards
+ * it, held for one lookup, and robust, an acceptor that dies
+ * holding it doesn't stop the others.
+ *
+ */
+
+#include "ratelimit.h"
+#include "logger.h"
+
+#define RATE_MASK (RATE_SLOTS - 1)
+#define RATE_NIL 0xffff
+
+static rate_table_t *g_rate = NULL;    /* shared, NULL = no limit */
+
+/** _rate_ms
+    CLOCK_MONOTONIC milliseconds, wrapping (only differences are used) */
+uint32_t _rate_ms () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+/** _rate_hash
+    FNV-1a of the address, seeded */
+uint16_t _rate_hash (uint8_t *addr) {
+  uint32_t h = 2166136261u ^ g_rate->seed;
+  int i;
+  for (i = 0; i < 16; i++) {
+    h = (h ^ addr[i]) * 16777619u;
+  }
+  return (uint16_t)((h ^ (h >> 16)) & RATE_MASK);
+}
+
+/** _rate_unlink
+    take slot i out of the LRU list */
+void _rate_unlink (uint16_t i) {
+  rate_entry_t *e = &(g_rate->slots[i]);
+  if (RATE_NIL != e->prev) {
+    g_rate->slots[e->prev].next = e->next;
+  } else {
+    g_rate->head = e->next;
+  }
+  if (RATE_NIL != e->next) {
+    g_rate->slots[e->next].prev = e->prev;
+  } else {
+    g_rate->tail = e->prev;
+  }
+}
+
+/** _rate_front
+    put slot i at the front of the LRU list */
+void _rate_front (uint16_t i) {
+  g_rate->slots[i].prev = RATE_NIL;
+  g_rate->slots[i].next = g_rate->head;
+  if (RATE_NIL != g_rate->head) {
+    g_rate->slots[g_rate->head].prev = i;
+  } else {
+    g_rate->tail = i;
+  }
+  g_rate->head = i;
+}
+
+/** _rate_move
+    the entry in slot from moves to the empty slot to */
+void _rate_move (uint16_t from, uint16_t to) {
+  rate_entry_t *e = &(g_rate->slots[to]);
+  *e = g_rate->slots[from];
+  g_rate->slots[from].used = 0;
+  if (RATE_NIL != e->prev) {
+    g_rate->slots[e->prev].next = to;
+  } else {
+    g_rate->head = to;
+  }
+  if (RATE_NIL != e->next) {
+    g_rate->slots[e->next].prev = to;
+  } else {
+    g_rate->tail = to;
+  }
+}
+
+/** _rate_delete
+    empty slot i, shifting back the entries after it
+    that would no longer be found past the hole */
+void _rate_delete (uint16_t i) {
+  uint16_t j = i, home;
+  _rate_unlink(i);
+  g_rate->slots[i].used = 0;
+  g_rate->count--;
+  for (;;) {
+    j = (j + 1) & RATE_MASK;
+    if (!g_rate->slots[j].used) {
+      return;
+    }
+    home = g_rate->slots[j].home;
+    /* stays if its home is (cyclically) after the hole, up to j */
+    if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+      continue;
+    }
+    _rate_move(j, i);
+    i = j;
+  }
+}
+
+/** _rate_find
+    the slot with addr, or the empty slot where it would go */
+uint16_t _rate_find (uint8_t *addr, uint16_t home) {
+  uint16_t i = home;
+  while (g_rate->slots[i].used && 0 != memcmp(g_rate->slots[i].addr, addr, 16)) {
+    i = (i + 1) & RATE_MASK;
+  }
+  return i;
+}
+
+/** _rate_peer
+    the peer of fd as 16 bytes. Returns -1 if it isn't IP */
+int _rate_peer (int fd, uint8_t *addr) {
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  if (-1 == getpeername(fd, (struct sockaddr *)&ss, &len)) {
+    return -1;
+  }
+  if (AF_INET == ss.ss_family) {
+    bzero(addr, 10);
+    addr[10] = addr[11] = 0xff;
+    memcpy(addr+12, &(((struct sockaddr_in *)&ss)->sin_addr), 4);
+    return 0;
+  }
+  if (AF_INET6 == ss.ss_family) {
+    memcpy(addr, &(((struct sockaddr_in6 *)&ss)->sin6_addr), 16);
+    return 0;
+  }
+  return -1;
+}
+
+int rate_init (int per_minute) {
+  pthread_mutexattr_t attr;
+  if (0 >= per_minute) {
+    return 0;
+  }
+  g_rate = (rate_table_t *)mmap(NULL, sizeof(rate_table_t), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == g_rate) {
+    g_rate = NULL;
+    log_msg("Unable to make the rate limit table, not limiting");
+    return -1;
+  }
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&(g_rate->lock), &attr);
+  pthread_mutexattr_destroy(&attr);
+  g_rate->head = g_rate->tail = RATE_NIL;
+  if (sizeof(g_rate->seed) != getrandom(&(g_rate->seed), sizeof(g_rate->seed), GRND_NONBLOCK)) {
+    g_rate->seed = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+  }
+  g_rate->burst = per_minute;
+  g_rate->per_ms = per_minute / 60000.0f;
+  return 0;
+}
+
+/** _rate_lock
+    take the table's lock. If an acceptor died holding it the
+    table may be half updated, it is emptied (every address
+    starts again with a full bucket) */
+void _rate_lock () {
+  if (EOWNERDEAD == pthread_mutex_lock(&(g_rate->lock))) {
+    bzero(g_rate->slots, sizeof(g_rate->slots));
+    g_rate->count = 0;
+    g_rate->head = g_rate->tail = RATE_NIL;
+    pthread_mutex_consistent(&(g_rate->lock));
+  }
+}
+
+/** _rate_take
+    take a token for addr. Returns 1 if it had one, 0 if it
+    didn't (-1 if it didn't and it should be logged) */
+int _rate_take (uint8_t *addr) {
+  uint16_t home, i;
+  uint32_t now;
+  rate_entry_t *e;
+
+  now = _rate_ms();
+  home = _rate_hash(addr);
+  i = _rate_find(addr, home);
+  if (!g_rate->slots[i].used) {
+    if (RATE_MAX <= g_rate->count) {
+      _rate_delete(g_rate->tail);
+      i = _rate_find(addr, home); /* the shift may have opened an earlier slot */
+    }
+    e = &(g_rate->slots[i]);
+    memcpy(e->addr, addr, 16);
+    e->home = home;
+    e->tokens = g_rate->burst;
+    e->last_ms = now;
+    e->used = 1;
+    e->warned = 0;
+    g_rate->count++;
+  } else {
+    e = &(g_rate->slots[i]);
+    e->tokens += (uint32_t)(now - e->last_ms) * g_rate->per_ms;
+    if (e->tokens > g_rate->burst) {
+      e->tokens = g_rate->burst;
+    }
+    e->last_ms = now;
+    _rate_unlink(i);
+  }
+  _rate_front(i);
+
+  if (1.0f <= e->tokens) {
+    e->tokens -= 1.0f;
+    e->warned = 0;
+    return 1;
+  }
+  if (!e->warned) {
+    /* once per run of refusals, a loop would flood the log */
+    e->warned = 1;
+    return -1;
+  }
+  return 0;
+}
+
+int rate_allow (int clientfd) {
+  uint8_t addr[16];
+  char str[INET6_ADDRSTRLEN];
+  int ok;
+
+  if (NULL == g_rate || -1 == _rate_peer(clientfd, addr)) {
+    return 1;
+  }
+  _rate_lock();
+  ok = _rate_take(addr);
+  pthread_mutex_unlock(&(g_rate->lock));
+  if (-1 == ok) {
+    inet_ntop(AF_INET6, addr, str, sizeof(str));
+    log_msg("%s is connecting too often, refusing it for now",
+	    (0 == strncmp(str, "::ffff:", 7)) ? str+7 : str);
+  }
+  return (1 == ok);
+}
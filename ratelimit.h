@@ -0,0 +1,57 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* one client address and its token bucket, 32 bytes */
+typedef struct rate_entry {
+  uint8_t addr[16];          /* IPv6, or IPv4 mapped (::ffff:a.b.c.d) */
+  float tokens;              /* connections it may still make */
+  uint32_t last_ms;          /* when tokens was last topped up */
+  uint16_t home;             /* the slot its hash picked */
+  uint16_t prev;             /* LRU list, RATE_NIL ends it */
+  uint16_t next;
+  uint8_t used;
+  uint8_t warned;            /* logged since it last had tokens */
+} rate_entry_t;
+
+/* every address's bucket, shared by the acceptors (-n) */
+typedef struct rate_table {
+  pthread_mutex_t lock;      /* process-shared, robust */
+  int count;
+  uint16_t head;             /* most recently seen, RATE_NIL = none */
+  uint16_t tail;             /* least, evicted first */
+  float burst;               /* bucket size */
+  float per_ms;              /* refill */
+  uint32_t seed;             /* so addresses can't be picked to collide */
+  rate_entry_t slots[RATE_SLOTS];
+} rate_table_t;
+
+/** rate_init
+    allow each client address per_minute connections a minute,
+    in bursts of up to per_minute. Call before the acceptors
+    are forked, they share the table. Returns -1 if the table
+    can't be made (then every client is allowed) */
+int rate_init (int per_minute) ;
+/** rate_allow
+    take a token for the peer of clientfd. Returns 0 if it has
+    none left (over the rate), 1 otherwise (and always without
+    -L, or if the peer isn't an IP address) */
+int rate_allow (int clientfd) ;
+
+#endif /* RATELIMIT_H */
@@ -0,0 +1,57 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains session recording (-v). Every session is
+ * relayed (through a pty with -T, otherwise a socketpair) and the
+ * relay tees both directions into a transcript next to the
+ * server's own log: ta_server_log_PID is the server, and
+ * ta_server_log_PID_N is its N'th session. Each chunk is marked
+ * with the seconds since the session started and "in" (from the
+ * client) or "out" (from the program).
+ *
+ */
+
+#include "record.h"
+#include "logger.h"
+
+static int g_record_n = 0; /* sessions recorded so far */
+
+int record_session (int clientfd, relay_t **r) {
+  int sv[2];
+  if (-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+    return -1;
+  }
+  /* the session is over when the program's end closes,
+     its slot is given back when it is reaped */
+  if (NULL == (*r = relay_start(clientfd, sv[0], sv[0], NULL, NULL))) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  return sv[1];
+}
+
+int record_start (relay_t *r) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  char fname[64], peer[INET_ADDRSTRLEN], date[64];
+  time_t t = time(NULL);
+  int fd;
+
+  g_record_n++;
+  snprintf(fname, sizeof(fname), "ta_server_log_%d_%d", (int)getpid(), g_record_n);
+  fd = open(fname, O_CLOEXEC | O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (-1 == fd) {
+    log_msg("Unable to create %s, not recording the session", fname);
+    return -1;
+  }
+  bzero(peer, sizeof(peer));
+  if (-1 == getpeername(r->cli, (struct sockaddr *)&addr, &addrlen) ||
+      AF_INET != addr.sin_family) {
+    strncpy(peer, "?", sizeof(peer)-1);
+  } else {
+    inet_ntop(AF_INET, &(addr.sin_addr), peer, sizeof(peer));
+  }
+  strftime(date, sizeof(date), "%a %d %b %Y %H:%M:%S", localtime(&t));
+  dprintf(fd, "session %d from %s - %s\n", g_record_n, peer, date);
+  return relay_record(r, fd);
+}
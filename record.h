@@ -0,0 +1,31 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "relay.h"
+
+/** record_session
+    -v without -T: put a socketpair between the client and the
+    program so the server can see (and record) the bytes. The
+    relay (*r) owns clientfd from now on. Returns the program's
+    end, or -1 (nothing changed, use clientfd as before) */
+int record_session (int clientfd, relay_t **r) ;
+/** record_start
+    open this session's transcript, ta_server_log_PID_N
+    (N counts the server's sessions), and record r to it */
+int record_start (relay_t *r) ;
+
+#endif /* RECORD_H */
@@ -0,0 +1,537 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the relay, for sessions where the program
+ * isn't handed the client socket directly. The server sits in
+ * the middle and pumps bytes both ways from the event loop.
+ * The session ends when the program's output ends (everything
+ * is written to the client first) or the client goes away.
+ *
+ * When a session is recorded (-v) each direction goes through a
+ * pipe: splice moves the bytes in, tee copies them to the log
+ * thread's pipe for the transcript, and splice moves them on, so
+ * nothing is copied through user space. Only bytes already tee'd
+ * are moved on, so when the log thread falls behind the relay
+ * waits for room in its pipe (the disk is never written here).
+ *
+ * With -o the program's output is metered. A token bucket (a
+ * second's worth of bytes) limits the rate: out of tokens, the
+ * relay either stops reading the program until a tick of the
+ * shared timer tops it up, so the program blocks in write
+ * (throttle), or reads and discards the output (drop). Past the
+ * total the client gets what was read, a notice, and the session
+ * ends (the program's end is closed under it).
+ *
+ */
+
+#define _GNU_SOURCE  /* splice, tee */
+#include "relay.h"
+#include "evloop.h"
+#include "logger.h"
+#include "metrics.h"
+
+static outcap_t g_relay_cap;            /* -o, zeroed = no caps */
+static relay_t *g_relay_paused = NULL;  /* throttled relays, waiting for tokens */
+static int g_relay_tick = -1;           /* timerfd, ticks while any are */
+
+/** _relay_interest
+    the events fd should be watched for */
+int _relay_interest (relay_t *r, int fd) {
+  int events = 0;
+  relay_dir_t *d[2] = { &(r->in), &(r->out) };
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (d[i]->done) {
+      continue;
+    }
+    if (d[i]->src == fd && !d[i]->eof && d[i]->off == d[i]->len &&
+	!(d[i] == &(r->out) && r->paused)) {
+      events |= EV_READ;
+    }
+    if (d[i]->dst == fd && d[i]->off < d[i]->len &&
+	(-1 == r->logp || d[i]->off < d[i]->logged)) {
+      events |= EV_WRITE;
+    }
+    if (r->logp == fd && d[i]->off < d[i]->len && d[i]->off == d[i]->logged) {
+      events |= EV_WRITE; /* waiting to tee the rest to the transcript */
+    }
+  }
+  return events;
+}
+
+/** _relay_chunk
+    the least worth reading at the -o rate, a tick's worth
+    (smaller reads would cost more than the bytes) */
+int _relay_chunk () {
+  int chunk = g_relay_cap.rate * 1024 / (1000 / CAP_TICK_MS);
+  return (RELAY_BUF < chunk) ? RELAY_BUF : (1 > chunk) ? 1 : chunk;
+}
+
+/** _relay_topup
+    add the tokens earned since the last top up */
+void _relay_topup (relay_t *r) {
+  struct timespec now;
+  double burst = g_relay_cap.rate * 1024.0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  r->tokens += burst * ((now.tv_sec - r->refill.tv_sec) +
+			(now.tv_nsec - r->refill.tv_nsec) / 1e9);
+  if (r->tokens > burst) {
+    r->tokens = burst;
+  }
+  r->refill = now;
+}
+
+/** _relay_arm
+    the tick runs only while relays are paused */
+void _relay_arm (int on) {
+  struct itimerspec its;
+  bzero(&its, sizeof(its));
+  if (on) {
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = CAP_TICK_MS * 1000000L;
+  }
+  timerfd_settime(g_relay_tick, 0, &its, NULL);
+}
+
+/** _relay_unpause
+    take r off the paused list */
+void _relay_unpause (relay_t *r) {
+  if (!r->paused) {
+    return;
+  }
+  r->paused = 0;
+  if (NULL != r->pprev) {
+    r->pprev->pnext = r->pnext;
+  } else {
+    g_relay_paused = r->pnext;
+  }
+  if (NULL != r->pnext) {
+    r->pnext->pprev = r->pprev;
+  }
+  if (NULL == g_relay_paused) {
+    _relay_arm(0);
+  }
+}
+
+/** _relay_tick
+    event loop handler for the timer: paused relays with
+    a token again start reading their program */
+void _relay_tick (int fd, int events, void *data) {
+  relay_t *r, *next;
+  uint64_t n;
+  read(fd, &n, sizeof(n));
+  for (r = g_relay_paused; NULL != r; r = next) {
+    next = r->pnext;
+    _relay_topup(r);
+    if (_relay_chunk() <= r->tokens) {
+      _relay_unpause(r);
+      ev_mod(r->prog_out, _relay_interest(r, r->prog_out));
+    }
+  }
+}
+
+/** _relay_pause
+    stop reading r's program until it has tokens.
+    Returns -1 if it can't be (no timer), then it isn't limited */
+int _relay_pause (relay_t *r) {
+  if (-1 == g_relay_tick) {
+    g_relay_tick = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (0 > g_relay_tick || -1 == ev_add(g_relay_tick, EV_READ, _relay_tick, NULL)) {
+      if (0 <= g_relay_tick) {
+	close(g_relay_tick);
+      }
+      g_relay_tick = -1;
+      g_relay_cap.rate = 0;
+      return -1;
+    }
+  }
+  if (NULL == g_relay_paused) {
+    _relay_arm(1);
+  }
+  r->paused = 1;
+  r->pprev = NULL;
+  r->pnext = g_relay_paused;
+  if (NULL != g_relay_paused) {
+    g_relay_paused->pprev = r;
+  }
+  g_relay_paused = r;
+  return 0;
+}
+
+/** _relay_tell
+    a notice to the client, never waited on */
+void _relay_tell (relay_t *r, char *msg) {
+  send(r->cli, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/** _relay_allowance
+    how much of the program's output may be read now (-o),
+    0 if it is out of tokens */
+int _relay_allowance (relay_t *r) {
+  uint64_t left;
+  int want = RELAY_BUF;
+  if (0 < g_relay_cap.max) {
+    left = (uint64_t)g_relay_cap.max * 1024 * 1024 - r->total;
+    if (left < (uint64_t)want) {
+      want = (int)left;
+    }
+  }
+  if (0 < g_relay_cap.rate) {
+    _relay_topup(r);
+    if (r->tokens < _relay_chunk()) {
+      return 0;
+    }
+    if (r->tokens < want) {
+      want = (int)r->tokens;
+    }
+  }
+  return want;
+}
+
+/** _relay_count
+    n more bytes of the program's output were read (and will
+    be sent, or were dropped). Past the -o total the session
+    ends once what was read is written */
+void _relay_count (relay_t *r, int n, int sent) {
+  if (sent) {
+    r->tokens -= n;
+  }
+  r->total += n;
+  if (0 < g_relay_cap.max && r->total >= (uint64_t)g_relay_cap.max * 1024 * 1024) {
+    r->capped = 1;
+    r->out.eof = 1;
+  }
+}
+
+/** _relay_drop
+    drop policy, out of tokens: read the program's output and
+    throw it away (it still counts toward the total) */
+void _relay_drop (relay_t *r, relay_dir_t *d) {
+  int bytes;
+  do {
+    bytes = read(d->src, d->buf, RELAY_BUF);
+  } while (0 > bytes && EINTR == errno);
+  if (0 < bytes) {
+    if (!r->dropping) {
+      r->dropping = 1;
+      _relay_tell(r, "\n*** Too much output, some of it is being skipped ***\n");
+    }
+    _relay_count(r, bytes, 0);
+    metrics_output_dropped(bytes);
+  } else if (0 == bytes || EAGAIN != errno) {
+    d->eof = 1;
+  }
+}
+
+/** _relay_unlog
+    stop recording, the session goes on */
+void _relay_unlog (relay_t *r) {
+  log_msg("Unable to write a transcript, not recording the session");
+  ev_del(r->logp);
+  close(r->logp);
+  r->logp = -1;
+}
+
+/** _relay_log
+    tee the rest of d's chunk (its header first) to the
+    transcript, as much as the log thread's pipe takes.
+    Returns 0 if the pipe is full, -1 if it is gone */
+int _relay_log (relay_t *r, relay_dir_t *d) {
+  char hdr[64];
+  int len, n;
+  if (!d->marked) {
+    len = snprintf(hdr, sizeof(hdr), "\n[+%.3f %s %d]\n",
+		   (d->at.tv_sec - r->start.tv_sec) + (d->at.tv_nsec - r->start.tv_nsec) / 1e9,
+		   d->mark, d->len);
+    if (len != write(r->logp, hdr, len)) { /* less than PIPE_BUF, all or nothing */
+      return (EAGAIN == errno) ? 0 : -1;
+    }
+    d->marked = 1;
+  }
+  do {
+    n = tee(d->pipe[0], r->logp, d->len - d->logged, SPLICE_F_NONBLOCK);
+  } while (0 > n && EINTR == errno);
+  if (0 > n) {
+    return (EAGAIN == errno) ? 0 : -1;
+  }
+  d->logged += n;
+  return 0;
+}
+
+/** _relay_fill_pipe
+    recording: splice from src into d's pipe. Sources that
+    can't splice (a pty) are read and written instead */
+int _relay_fill_pipe (relay_dir_t *d, int want) {
+  int bytes;
+  do {
+    bytes = splice(d->src, NULL, d->pipe[1], NULL, want,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while (0 > bytes && EINTR == errno);
+  if (0 > bytes && EINVAL == errno) {
+    do {
+      bytes = read(d->src, d->buf, want);
+    } while (0 > bytes && EINTR == errno);
+    if (0 < bytes && bytes != write(d->pipe[1], d->buf, bytes)) {
+      bytes = -1; /* the pipe is empty, it holds more than RELAY_BUF */
+      errno = EIO;
+    }
+  }
+  return bytes;
+}
+
+/** _relay_fill
+    read from src, but only once the buffer has been written.
+    The program's output is read no faster than -o allows */
+void _relay_fill (relay_t *r, relay_dir_t *d) {
+  int bytes, want = RELAY_BUF;
+  if (d->eof || d->off < d->len || (d == &(r->out) && r->paused)) {
+    return;
+  }
+  if (d == &(r->out) && (0 < g_relay_cap.rate || 0 < g_relay_cap.max)) {
+    want = _relay_allowance(r);
+    if (0 == want && !g_relay_cap.drop && -1 != _relay_pause(r)) {
+      return;
+    }
+    if (0 == want) {
+      _relay_drop(r, d);
+      return;
+    }
+  }
+  if (-1 != d->pipe[0]) {
+    bytes = _relay_fill_pipe(d, want);
+    clock_gettime(CLOCK_MONOTONIC, &(d->at));
+    d->marked = d->logged = 0;
+  } else {
+    do {
+      bytes = read(d->src, d->buf, want);
+    } while (0 > bytes && EINTR == errno);
+  }
+  if (0 < bytes) {
+    if (d == &(r->out) && !r->answered) {
+      r->answered = 1;
+      metrics_first_byte(r->cli);
+    }
+    if (d == &(r->out)) {
+      _relay_count(r, bytes, 1);
+    }
+    d->off = 0;
+    d->len = bytes;
+  } else if (0 == bytes || EAGAIN != errno) {
+    d->eof = 1; /* includes EIO, which is how a pty says EOF */
+  }
+}
+
+/** _relay_flush
+    write as much of the buffer as dst will take (recording,
+    as much as is in the transcript).
+    returns -1 if dst is gone */
+int _relay_flush (relay_t *r, relay_dir_t *d) {
+  int bytes;
+  while (d->off < d->len) {
+    if (-1 != r->logp && d->off == d->logged) {
+      /* tee only works from the front of the pipe, what was tee'd has been written */
+      if (-1 == _relay_log(r, d)) {
+	_relay_unlog(r);
+      } else if (d->off == d->logged) {
+	return 0; /* wait for the log thread */
+      }
+    }
+    if (-1 != d->pipe[0]) {
+      bytes = splice(d->pipe[0], NULL, d->dst, NULL,
+		     ((-1 != r->logp) ? d->logged : d->len) - d->off,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } else {
+      bytes = write(d->dst, d->buf + d->off, d->len - d->off);
+    }
+    if (0 > bytes) {
+      if (EINTR == errno) {
+	continue;
+      }
+      return (EAGAIN == errno) ? 0 : -1;
+    }
+    d->off += bytes;
+  }
+  d->off = d->len = 0;
+  return 0;
+}
+
+/** _relay_shut_in
+    no more client input for the program: close prog_in if it
+    is its own fd (a pipe), otherwise shut down the write side
+    (or send ^D, for a pty) */
+void _relay_shut_in (relay_t *r) {
+  r->in.done = 1;
+  r->in.eof = 1;
+  r->in.off = r->in.len = 0;
+  if (r->prog_in != r->prog_out) {
+    ev_del(r->prog_in);
+    close(r->prog_in);
+    r->prog_in = r->in.dst = -1;
+  } else if (-1 == shutdown(r->prog_in, SHUT_WR) && ENOTSOCK == errno) {
+    write(r->prog_in, "\004", 1); /* a pty, EOF is ^D */
+  }
+}
+
+/** _relay_event
+    event loop handler for every fd in the relay */
+void _relay_event (int fd, int events, void *data) {
+  relay_t *r = (relay_t *)data;
+
+  /* client -> program */
+  if (!r->in.done) {
+    if (r->in.src == fd && ((EV_READ | EV_ERR) & events)) {
+      _relay_fill(r, &(r->in));
+    }
+    if (-1 == _relay_flush(r, &(r->in)) ||
+	(r->in.dst == fd && r->in.dst != r->out.src && (EV_ERR & events))) {
+      _relay_shut_in(r); /* program stopped reading */
+    } else if (r->in.eof && r->in.off == r->in.len) {
+      _relay_shut_in(r);
+    }
+  }
+
+  /* program -> client */
+  if (r->out.src == fd && ((EV_READ | EV_ERR) & events)) {
+    _relay_fill(r, &(r->out));
+  }
+  if (-1 == _relay_flush(r, &(r->out)) ||
+      (r->out.eof && r->out.off == r->out.len)) {
+    if (r->capped) {
+      char msg[96];
+      snprintf(msg, sizeof(msg), "\n*** Output limit (%d MB) reached, session ended ***\n",
+	       g_relay_cap.max);
+      _relay_tell(r, msg);
+      metrics_output_capped();
+    }
+    relay_close(r);
+    return;
+  }
+
+  ev_mod(r->cli, _relay_interest(r, r->cli));
+  ev_mod(r->prog_out, _relay_interest(r, r->prog_out));
+  if (-1 != r->prog_in && r->prog_in != r->prog_out) {
+    ev_mod(r->prog_in, _relay_interest(r, r->prog_in));
+  }
+  if (-1 != r->logp) {
+    ev_mod(r->logp, _relay_interest(r, r->logp));
+  }
+}
+
+relay_t *relay_start (int cli, int prog_in, int prog_out,
+		      void (*on_close)(relay_t *r, void *data), void *data) {
+  relay_t *r = (relay_t *)calloc(1, sizeof(relay_t));
+  if (NULL == r) {
+    return NULL;
+  }
+  r->cli = cli;
+  r->prog_in = prog_in;
+  r->prog_out = prog_out;
+  r->in.src = cli;
+  r->in.dst = prog_in;
+  r->out.src = prog_out;
+  r->out.dst = cli;
+  r->on_close = on_close;
+  r->data = data;
+  r->logp = -1;
+  r->pidfd = -1;
+  r->in.pipe[0] = r->in.pipe[1] = -1;
+  r->out.pipe[0] = r->out.pipe[1] = -1;
+  r->tokens = g_relay_cap.rate * 1024.0;
+  clock_gettime(CLOCK_MONOTONIC, &(r->refill));
+
+  if (-1 == ev_add(cli, EV_READ, _relay_event, (void *)r)) {
+    free(r);
+    return NULL;
+  }
+  if (-1 == ev_add(prog_out, EV_READ, _relay_event, (void *)r)) {
+    ev_del(cli);
+    free(r);
+    return NULL;
+  }
+  if (prog_in != prog_out && -1 == ev_add(prog_in, 0, _relay_event, (void *)r)) {
+    ev_del(cli);
+    ev_del(prog_out);
+    free(r);
+    return NULL;
+  }
+  fcntl(cli, F_SETFL, fcntl(cli, F_GETFL, 0) | O_NONBLOCK);
+  fcntl(prog_in, F_SETFL, fcntl(prog_in, F_GETFL, 0) | O_NONBLOCK);
+  fcntl(prog_out, F_SETFL, fcntl(prog_out, F_GETFL, 0) | O_NONBLOCK);
+  return r;
+}
+
+int relay_record (relay_t *r, int logfd) {
+  int *p[2] = { r->in.pipe, r->out.pipe };
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (-1 == pipe2(p[i], O_CLOEXEC | O_NONBLOCK)) {
+      break;
+    }
+  }
+  if (2 != i) {
+    close(logfd);
+  } else if (-1 != (r->logp = log_transcript(logfd)) && /* it closes logfd if not */
+	     -1 == ev_add(r->logp, 0, _relay_event, (void *)r)) {
+    close(r->logp);
+    r->logp = -1;
+  }
+  if (-1 == r->logp) {
+    while (0 <= --i) {
+      close(p[i][0]);
+      close(p[i][1]);
+      p[i][0] = p[i][1] = -1;
+    }
+    return -1;
+  }
+  r->in.mark = "in";
+  r->out.mark = "out";
+  clock_gettime(CLOCK_MONOTONIC, &(r->start));
+  return 0;
+}
+
+/** _relay_unrecord
+    close the recording pipes, the log thread finishes the transcript */
+void _relay_unrecord (relay_t *r) {
+  if (-1 == r->in.pipe[0]) {
+    return;
+  }
+  close(r->in.pipe[0]);
+  close(r->in.pipe[1]);
+  close(r->out.pipe[0]);
+  close(r->out.pipe[1]);
+  if (-1 != r->logp) {
+    ev_del(r->logp);
+    close(r->logp);
+  }
+}
+
+void relay_limit (outcap_t *cap) {
+  g_relay_cap = *cap;
+}
+
+void relay_pid (relay_t *r, pid_t pid) {
+  if (-1 == r->pidfd && 0 < pid) {
+    r->pidfd = syscall(SYS_pidfd_open, pid, 0);
+  }
+}
+
+void relay_close (relay_t *r) {
+  _relay_unpause(r);
+  if (-1 != r->pidfd) {
+    if (r->capped) {
+      syscall(SYS_pidfd_send_signal, r->pidfd, SIGKILL, NULL, 0);
+    }
+    close(r->pidfd);
+  }
+  ev_del(r->cli);
+  close(r->cli);
+  ev_del(r->prog_out);
+  close(r->prog_out);
+  if (-1 != r->prog_in && r->prog_in != r->prog_out) {
+    ev_del(r->prog_in);
+    close(r->prog_in);
+  }
+  _relay_unrecord(r);
+  if (NULL != r->on_close) {
+    r->on_close(r, r->data);
+  }
+  free(r);
+}
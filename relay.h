@@ -0,0 +1,96 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* what a session's program may send the client (-o) */
+typedef struct outcap {
+  int rate;         /* KB a second, 0 = no limit */
+  int max;          /* MB in all, 0 = no limit */
+  int drop;         /* over the rate: 1 = discard output, 0 = stop reading (throttle) */
+} outcap_t;
+
+/* one direction of a relay, bytes read from src are written to dst */
+typedef struct relay_dir {
+  int src;
+  int dst;
+  char buf[RELAY_BUF];
+  int off;          /* buf[off..len) is waiting to be written */
+  int len;
+  int eof;          /* src is finished */
+  int done;         /* eof and everything was written, dst was shut */
+  int pipe[2];      /* recording: the bytes wait here instead of buf */
+  char *mark;       /* recording: direction in the transcript */
+  struct timespec at; /* recording: when buf[0..len) was read */
+  int marked;       /* recording: its header is in the transcript */
+  int logged;       /* recording: buf[0..logged) was tee'd, only that much is written */
+} relay_dir_t;
+
+/* pumps bytes between a client and the program's side of a session
+   (a socket to a session host, a pty, pipes) from the event loop */
+typedef struct relay {
+  int cli;          /* client socket */
+  int prog_in;      /* where client input goes */
+  int prog_out;     /* where program output comes from (may be prog_in) */
+  relay_dir_t in;   /* cli -> prog_in */
+  relay_dir_t out;  /* prog_out -> cli */
+  void (*on_close)(struct relay *r, void *data);
+  void *data;
+  int logp;         /* recording (-v): the log thread's pipe to the transcript, -1 if not */
+  struct timespec start;
+  int answered;     /* the program has written something */
+  uint64_t total;   /* program output so far (-o) */
+  double tokens;    /* bytes it may send now (-o rate) */
+  struct timespec refill; /* when tokens was topped up */
+  int capped;       /* it sent the -o total, the session is ending */
+  int pidfd;        /* the session's process, killed when capped (-1 = not known) */
+  int paused;       /* out of tokens, the program isn't read (throttle) */
+  int dropping;     /* the client was told output is being discarded (drop) */
+  struct relay *pnext; /* paused relays */
+  struct relay *pprev;
+} relay_t;
+
+/** relay_start
+    relay between cli and the program until the program's output
+    ends or the client goes away. The fds are made non-blocking,
+    they are closed (and on_close called) when the relay ends.
+    Returns NULL on failure, nothing is closed in that case */
+relay_t *relay_start (int cli, int prog_in, int prog_out,
+		      void (*on_close)(relay_t *r, void *data), void *data) ;
+/** relay_record
+    record the session to logfd (the log thread owns it from now on).
+    Data is moved with splice and copied with tee to a pipe the
+    log thread writes to the transcript, it never passes through
+    the server's memory. Each chunk is written as
+    "[+SECS DIR BYTES]\n" then the bytes. While the pipe is full
+    the relay waits (neither direction is read) rather than
+    block on the disk or lose part of the transcript.
+    Returns -1 (and logfd is closed) if it can't */
+int relay_record (relay_t *r, int logfd) ;
+/** relay_pid
+    the program runs in pid. If the relay ends the session (the
+    -o total) the process is killed, a program that ignores the
+    closed socket would otherwise keep running. A pidfd is held,
+    so a pid reused after the session was reaped is never hit */
+void relay_pid (relay_t *r, pid_t pid) ;
+/** relay_limit
+    the output caps for every relay started from now on */
+void relay_limit (outcap_t *cap) ;
+/** relay_close
+    end the relay now */
+void relay_close (relay_t *r) ;
+
+#endif /* RELAY_H */
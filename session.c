@@ -0,0 +1,138 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the session table and the reaper.
+ * The SIGCHLD handler used to wait() once per signal, but
+ * signals coalesce, so when several sessions ended together
+ * zombies were left behind and the connection count drifted
+ * until every client got "Server Busy". Now SIGCHLD is read
+ * from a signalfd in the event loop and wait4(WNOHANG) runs
+ * until nothing is left, so every child is reaped no matter
+ * how many signals arrived. Only pids in the table count as
+ * sessions ending, each exactly once.
+ *
+ * The connection slots are counted here too. With -n the
+ * count lives in shared memory and is updated atomically,
+ * so all the acceptors enforce one limit.
+ *
+ */
+
+#include "session.h"
+#include "evloop.h"
+#include "logger.h"
+
+static session_t *g_sess = NULL;  /* running sessions, unordered */
+static int g_sess_len = 0;
+static int g_sess_cap = 0;
+static session_fn_t g_sess_on_end = NULL;
+static int g_slots_local = 0;
+static int *g_slots = &g_slots_local;      /* slots in use, maybe shared */
+static int g_slot_limit = MAX_CONNECTIONS; /* -c */
+static double g_sess_avg = 0;              /* moving average of session length */
+
+/** _session_secs
+    seconds since start */
+double _session_secs (struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** _session_reap
+    event loop handler for the SIGCHLD signalfd */
+void _session_reap (int fd, int events, void *data) {
+  struct signalfd_siginfo si[8];
+  session_t s;
+  pid_t pid;
+  int status, i;
+  double secs;
+  struct rusage ru;
+
+  /* drain the signalfd, the waitpid loop below finds every child */
+  while (0 < read(fd, si, sizeof(si)))
+    ;
+  while (0 < (pid = wait4(-1, &status, WNOHANG, &ru))) {
+    for (i = 0; i < g_sess_len && pid != g_sess[i].pid; i++)
+      ;
+    if (i == g_sess_len) {
+      continue; /* not a session */
+    }
+    s = g_sess[i];
+    g_sess[i] = g_sess[--g_sess_len];
+    secs = _session_secs(&(s.start));
+    g_sess_avg = (0 == g_sess_avg) ? secs : g_sess_avg + (secs - g_sess_avg) / SESSION_AVG_N;
+    g_sess_on_end(pid, status, secs, &ru, s.data);
+  }
+}
+
+int session_watch (session_fn_t on_end) {
+  g_sess_on_end = on_end;
+  if (-1 == ev_signal(SIGCHLD, _session_reap, NULL)) {
+    log_msg("Unable to watch for sessions ending");
+    return -1;
+  }
+  return 0;
+}
+
+int session_add (pid_t pid, void *data) {
+  if (g_sess_len == g_sess_cap) {
+    int cap = g_sess_cap ? 2*g_sess_cap : MAX_CONNECTIONS;
+    session_t *sess = (session_t *)realloc(g_sess, cap*sizeof(session_t));
+    if (NULL == sess) {
+      return -1;
+    }
+    g_sess = sess;
+    g_sess_cap = cap;
+  }
+  g_sess[g_sess_len].pid = pid;
+  g_sess[g_sess_len].data = data;
+  clock_gettime(CLOCK_MONOTONIC, &(g_sess[g_sess_len].start));
+  g_sess_len++;
+  return 0;
+}
+
+int session_count () {
+  return g_sess_len;
+}
+
+int session_share_slots () {
+  int *slots = (int *)mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == slots) {
+    return -1;
+  }
+  *slots = *g_slots;
+  g_slots = slots;
+  return 0;
+}
+
+int session_slot_take () {
+  int n = __atomic_load_n(g_slots, __ATOMIC_RELAXED);
+  do {
+    if (g_slot_limit <= n) {
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(g_slots, &n, n+1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+void session_slot_give () {
+  __atomic_sub_fetch(g_slots, 1, __ATOMIC_RELAXED);
+}
+
+int session_slots () {
+  return __atomic_load_n(g_slots, __ATOMIC_RELAXED);
+}
+
+void session_slot_limit (int limit) {
+  g_slot_limit = limit;
+}
+
+int session_slots_free () {
+  int n = g_slot_limit - session_slots();
+  return (0 < n) ? n : 0;
+}
+
+double session_avg_secs () {
+  return g_sess_avg;
+}
@@ -0,0 +1,65 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* a session process the server started (fork, spawn, pool worker) */
+typedef struct session {
+  pid_t pid;
+  struct timespec start;  /* CLOCK_MONOTONIC */
+  void *data;             /* whose it is, from session_add */
+} session_t;
+
+/* called for each session that ended, with its wait status,
+   how long it ran (seconds), its rusage and the data it was added with */
+typedef void (*session_fn_t)(pid_t pid, int status, double secs, struct rusage *ru, void *data);
+
+/** session_watch
+    reap children from the event loop (SIGCHLD through a signalfd),
+    calling on_end for the ones added with session_add.
+    Other children (a parked worker that died) are reaped quietly */
+int session_watch (session_fn_t on_end) ;
+/** session_add
+    pid is now a client's session (of the program data, -C) */
+int session_add (pid_t pid, void *data) ;
+/** session_count
+    sessions still running */
+int session_count () ;
+
+/** session_share_slots
+    put the slot count in shared memory, so acceptor
+    processes forked after this share one limit */
+int session_share_slots () ;
+/** session_slot_take
+    take a connection slot (atomically, the count may be
+    shared). Returns -1 if all of them (-c) are in use */
+int session_slot_take () ;
+/** session_slot_give
+    a session ended, give its slot back */
+void session_slot_give () ;
+/** session_slots
+    slots in use (by every acceptor) */
+int session_slots () ;
+/** session_slot_limit
+    how many slots there are (-c, MAX_CONNECTIONS by default) */
+void session_slot_limit (int limit) ;
+/** session_slots_free
+    slots left */
+int session_slots_free () ;
+/** session_avg_secs
+    moving average of how long sessions run, 0 until one ends */
+double session_avg_secs () ;
+
+#endif /* SESSION_H */
@@ -12,6 +12,10 @@
  */
 
 #include "set_up.h"
+#include "cds.h"
+#include "cgroup.h"
+#include "image.h"
+#include "relay.h"
 
 /** _set_var_to_int
     logic to correctly set the integer variable "var" */
@@ -61,6 +65,70 @@ void set_queue (char **argv, int *i, void *var) {
 void set_exec_args (char **argv, int *i, void *var) {
   set_var_to_int (argv, i, var, MIN_A, MAX_A, DEFAULT_A);
 }
+/** the -P flag */
+void set_pool (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_POOL, MAX_POOL, DEFAULT_POOL);
+}
+/** the -n flag */
+void set_acceptors (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_N, MAX_N, DEFAULT_N);
+}
+/** the -c flag */
+void set_connections (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_C, MAX_C, MAX_CONNECTIONS);
+}
+/** the -w flag */
+void set_waitroom (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_W, MAX_W, DEFAULT_W);
+}
+/** the -l flag */
+void set_log_rotate (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_L, MAX_L, DEFAULT_L);
+}
+/** the -L flag */
+void set_rate (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_RATE, MAX_RATE, DEFAULT_RATE);
+}
+/** the -x flag */
+void set_mux (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_P, MAX_P, DEFAULT_X);
+}
+/** the -j flag */
+void set_jobs (char **argv, int *i, void *var) {
+  set_var_to_int (argv, i, var, MIN_J, MAX_J, DEFAULT_J);
+}
+/** the -B flag */
+void set_batch (char **argv, int *i, void *var) {
+  *((char **)var) = argv[(*i)+1];
+}
+/** the -K flag */
+void set_cache (char **argv, int *i, void *var) {
+  *((char **)var) = argv[(*i)+1];
+}
+/** the -C flag */
+void set_config (char **argv, int *i, void *var) {
+  *((char **)var) = argv[(*i)+1];
+}
+/** the -z flag */
+void set_zygote (char **argv, int *i, void *var) {
+  /* set var to 1 to make it true */
+  _set_var_to_int (var, 1, 0, 1, 1);
+}
+/** the -J flag */
+void set_jvm (char **argv, int *i, void *var) {
+  /* set var to 1 to make it true */
+  _set_var_to_int (var, 1, 0, 1, 1);
+}
+/** the -T flag */
+void set_pty (char **argv, int *i, void *var) {
+  /* set var to 1 to make it true */
+  _set_var_to_int (var, 1, 0, 1, 1);
+}
+/** the -v flag */
+void set_record (char **argv, int *i, void *var) {
+  /* set var to 1 to make it true */
+  _set_var_to_int (var, 1, 0, 1, 1);
+}
 /** the -bg flag */
 void set_bg (char **argv, int *i, void *var) {
   /* set var to 1 to make it true */
@@ -141,6 +209,80 @@ void set_timeout (char **argv, int *i, void *var) {
   regfree(&preg);
   _set_var_to_int(var, val, MIN_T, MAX_T, DEFAULT_T);
 }
+/** _set_duration
+    -X5 OR -X 5 OR -X5m OR -X 5m, like -t but minutes by
+    default (s, m, h, d). Up to MAX_T, dflt if it doesn't parse */
+void _set_duration (char **argv, int *i, void *var, int dflt) {
+  char *var_str = ('\0' != argv[(*i)][2]) ? &(argv[(*i)][2]) : argv[(*i)+1];
+  char *end;
+  long val, conv = 60;
+  if (NULL == var_str) {
+    *((int *)var) = dflt;
+    return;
+  }
+  errno = 0;
+  val = strtol(var_str, &end, 10);
+  switch (*end) {
+  case 'd' :
+    conv = 24 * 60 * 60;
+    break;
+  case 'h' :
+    conv = 60 * 60;
+    break;
+  case 's' :
+    conv = 1;
+    break;
+  }
+  if (end == var_str || 0 != errno || 0 > val || MAX_T / conv < val ||
+      ('\0' != *end && ('\0' != end[1] || NULL == strchr("smhd", *end)))) {
+    val = dflt;
+    conv = 1;
+  }
+  *((int *)var) = (int)(val * conv);
+}
+/** the -g flag
+    cpu=PCT (of one CPU), mem=MB, pids=N, comma separated.
+    A bad value leaves that one unlimited */
+void set_limits (char **argv, int *i, void *var) {
+  limits_t *lim = (limits_t *)var;
+  char *val = ('\0' != argv[(*i)][2]) ? &(argv[(*i)][2]) : argv[(*i)+1];
+  char key[8];
+  int n, len;
+  while (NULL != val && 2 == sscanf(val, "%7[a-z]=%d%n", key, &n, &len)) {
+    if (0 == strcmp(key, "cpu")) {
+      _set_var_to_int(&(lim->cpu), n, 1, MAX_G_CPU, 0);
+    } else if (0 == strcmp(key, "mem")) {
+      _set_var_to_int(&(lim->mem), n, 1, MAX_G_MEM, 0);
+    } else if (0 == strcmp(key, "pids")) {
+      _set_var_to_int(&(lim->pids), n, 1, MAX_G_PIDS, 0);
+    }
+    val = (',' == val[len]) ? val+len+1 : NULL;
+  }
+}
+/** the -o flag
+    KB a second, then optionally the MB total and "drop".
+    A bad number leaves that one unlimited */
+void set_outcap (char **argv, int *i, void *var) {
+  outcap_t *cap = (outcap_t *)var;
+  char *val = ('\0' != argv[(*i)][2]) ? &(argv[(*i)][2]) : argv[(*i)+1];
+  char *end;
+  if (NULL == val) {
+    return;
+  }
+  _set_var_to_int(&(cap->rate), (int)strtol(val, &end, 10), 0, MAX_O_RATE, 0);
+  if (',' == *end && '0' <= end[1] && '9' >= end[1]) {
+    _set_var_to_int(&(cap->max), (int)strtol(end+1, &end, 10), 0, MAX_O_MB, 0);
+  }
+  cap->drop = (',' == *end && 0 == strcmp(end+1, "drop"));
+}
+/** the -i flag, idle limit */
+void set_idle (char **argv, int *i, void *var) {
+  _set_duration (argv, i, var, DEFAULT_IDLE);
+}
+/** the -I flag, lifetime limit */
+void set_lifetime (char **argv, int *i, void *var) {
+  _set_duration (argv, i, var, DEFAULT_LIFE);
+}
 /** the -r flag */
 void set_run (char **argv, int *i, void *var) {
   *((char **)var) = argv[(*i)+1];
@@ -149,6 +291,36 @@ void set_run (char **argv, int *i, void *var) {
 void set_mode (char **argv, int *i, void *var) {
   *((char **)var) = argv[(*i)+1];
 }
+/** the -M flag */
+void set_metrics (char **argv, int *i, void *var) {
+  *((char **)var) = argv[(*i)+1];
+}
+/** the -s flag
+    -s fork (the default)  OR  -s spawn  OR  -s vfork */
+void set_spawn (char **argv, int *i, void *var) {
+  char *val = argv[(*i)+1];
+  if (NULL != val && 0 == strcmp(val, "spawn")) {
+    *((int *)var) = SPAWN_POSIX;
+  } else if (NULL != val && 0 == strcmp(val, "vfork")) {
+    *((int *)var) = SPAWN_VFORK;
+  } else {
+    *((int *)var) = DEFAULT_S;
+  }
+}
+/** the -e flag
+    -e select  OR  -e epoll (the default)  OR  -e uring */
+void set_event_backend (char **argv, int *i, void *var) {
+  char *val = argv[(*i)+1];
+  if (NULL != val && 0 == strcmp(val, "select")) {
+    *((int *)var) = EV_SELECT;
+  } else if (NULL != val && 0 == strcmp(val, "epoll")) {
+    *((int *)var) = EV_EPOLL;
+  } else if (NULL != val && 0 == strcmp(val, "uring")) {
+    *((int *)var) = EV_URING;
+  } else {
+    *((int *)var) = DEFAULT_E;
+  }
+}
 
 
 /* void test_execv_all (char *abs_path, char **argv) { */
@@ -156,20 +328,27 @@ void set_mode (char **argv, int *i, void *var) {
 /* } */
 
 /** interpreter could be any python interpreter on PATH
-    (i.e., python, python2, python3) */
+    (i.e., python, python2, python3), image.c found it once */
 void execvp_python_i (void *interpreter, void *arg2, void *argv) {
+  image_exec((char *)interpreter, (char **)argv);
   execvp((char *)interpreter, (char **)argv);
 }
 /** python file should be interpreter file
     (i.e., first line looks like: #!/usr/bin/python3) */
 void execvp_python (void *abs_path, void *arg2, void *argv) {
+  image_exec((char *)abs_path, (char **)argv);
   execvp((char *)abs_path, (char **)argv);
 }
+/** the program's sealed image (image.c), by path if it's gone */
 void execvp_c (void *abs_path, void *arg2, void *argv) {
+  image_exec((char *)abs_path, (char **)argv);
   execvp((char *)abs_path, (char **)argv);
 }
+/** java uses the AppCDS archive once it has been built */
 void execvp_java (void *arg1, void *arg2, void *argv) {
-  execvp("java", (char **)argv);
+  char **jargv = cds_java_argv((char **)argv);
+  image_exec("java", jargv);
+  execvp("java", jargv);
 }
 
 /** set_exec_fn
@@ -220,3 +399,84 @@ void *set_exec_fn (char *name, char *mode, int *m) {
   regfree(&preg);
   return exec_fn;
 }
+
+/** exec_file
+    mirrors the execvp_ functions above */
+char *exec_file (void (*exec_fn)(void *, void *, void *), char *abs_path, char ***argv) {
+  if (execvp_java == exec_fn) {
+    *argv = cds_java_argv(*argv);
+    return image_file("java", argv);
+  }
+  return image_file(abs_path, argv);
+}
+
+/** config_read
+    each line split into words, like the shell would without
+    quotes. The lines are kept, the argvs point into them */
+char ***config_read (char *path, int *n) {
+  FILE *f = fopen(path, "r");
+  char ***lines;
+  char **argv;
+  char *line = NULL, *word, *hash;
+  size_t size = 0;
+  int nwords;
+
+  *n = 0;
+  if (NULL == f || NULL == (lines = (char ***)calloc(MAX_PROGS, sizeof(char **)))) {
+    if (NULL != f) {
+      fclose(f);
+    }
+    return NULL;
+  }
+  while (-1 != getline(&line, &size, f)) {
+    if (NULL != (hash = strchr(line, '#'))) {
+      *hash = '\0';
+    }
+    if (NULL == (word = strtok(line, " \t\r\n"))) {
+      continue; /* blank */
+    }
+    if (MAX_PROGS == *n) {
+      dprintf(STDERR_FILENO, "%s: more than %d programs\n", path, MAX_PROGS);
+    }
+    if (MAX_PROGS == *n || NULL == (argv = (char **)calloc(MAX_CONF_ARGS + 2, sizeof(char *)))) {
+      fclose(f);
+      return NULL;
+    }
+    argv[0] = path;
+    for (nwords = 1; NULL != word && nwords <= MAX_CONF_ARGS; nwords++) {
+      argv[nwords] = word;
+      word = strtok(NULL, " \t\r\n");
+    }
+    lines[(*n)++] = argv;
+    line = NULL; /* the words are in it */
+    size = 0;
+  }
+  free(line);
+  fclose(f);
+  return lines;
+}
+
+/** get_args_for_exec
+    build argv that will be passed to the exec function,
+    from the args gathered from the client (see gather.c).
+    The strings aren't copied, only the array is malloc'd */
+char **get_args_for_exec (char *name, int interpreter, char **args, int nargs) {
+  /* make room for prog name, null pointer, (and maybe "-m") */
+  char **argv = (char**)malloc((nargs + (interpreter ? 3 : 2))*sizeof(char*));
+  int i = 0;
+  int user_arg;
+  if (NULL == argv) {
+    return NULL;
+  }
+  if (interpreter) {
+    argv[i] = "-m";
+    i++;
+  }
+  argv[i] = name;
+  i++;
+  for (user_arg = 0; user_arg < nargs; i++, user_arg++) {
+    argv[i] = args[user_arg];
+  }
+  argv[i] = NULL;
+  return argv;
+}
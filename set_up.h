@@ -7,10 +7,66 @@
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "defs.h"
 
+struct pool;
+struct zygote;
+struct jvm;
+struct cds;
+struct waitroom;
+
+/* what may differ from one program to the next: the command
+   line's, and each line of the -C file starts from those */
+typedef struct opts {
+  char *name;        /* -r */
+  char *mode;        /* -m */
+  int port;          /* -p, the server's port. In a -C line the
+			program's own (0 = only on the menu) */
+  int num_args;      /* -a */
+  int pool;          /* -P */
+  int zygote;        /* -z */
+  int jvm;           /* -J */
+  int spawn;         /* -s */
+  int pty;           /* -T */
+  int record;        /* -v */
+  int waiting;       /* -w */
+  int idle;          /* -i */
+  int life;          /* -I */
+} opts_t;
+
+/* everything needed to launch the program for a client */
+typedef struct prog {
+  char *abs_path;    /* full path to the program */
+  char *name;        /* program name (extension removed for .c/.java) */
+  char *title;       /* as given to -r, for the menu and the log */
+  int id;            /* its place in the table of programs (-C) */
+  int port;          /* its own port (-C), 0 = none */
+  int num_args;      /* number of args to gather from the client */
+  int interpreter;   /* 1 = argv starts with "-m" */
+  void (*exec_fn)(void *, void *, void *); /* how to exec the program */
+  int spawn;         /* SPAWN_FORK, SPAWN_POSIX or SPAWN_VFORK */
+  int pty;           /* 1 = run the program on a pty (-T) */
+  int record;        /* 1 = record each session (-v) */
+  int pool_size;     /* -P */
+  struct pool *pool; /* parked workers, NULL = fork per client */
+  char **park;       /* what the workers exec to park (zygote.py, .py only), NULL = nothing */
+  int wait_size;     /* -w */
+  struct waitroom *waitroom; /* its clients waiting for a slot, NULL = none */
+  struct zygote *zygote; /* python fork-server, NULL = exec per client */
+  struct jvm *jvm;   /* resident JVM, NULL = exec per client */
+  struct cds *cds;   /* AppCDS archive for java, NULL = none */
+  int entryfd;       /* listening socket (the server's, or its own port),
+			closed in forked sessions */
+  char *metrics;     /* -M port or socket, only the first server serves them */
+  int idle;          /* -i, seconds a session may go without input (0 = no limit) */
+  int life;          /* -I, seconds a session may run (0 = no limit) */
+  int capped;        /* -o, relay the output to meter it */
+  int mux;           /* -x, port for the framed protocol (-1 = none) */
+} prog_t;
+
 /** _set_var_to_int
     logic to correctly set the integer variable "var" */
 void _set_var_to_int (void *var, int val, int min, int max, int dflt) ;
@@ -25,6 +81,21 @@ void set_port (char **argv, int *i, void *var) ;
 void set_queue (char **argv, int *i, void *var) ;
 void set_exec_args (char **argv, int *i, void *var) ;
 void set_bg (char **argv, int *i, void *var) ;
+void set_pool (char **argv, int *i, void *var) ;
+void set_acceptors (char **argv, int *i, void *var) ;
+void set_connections (char **argv, int *i, void *var) ;
+void set_waitroom (char **argv, int *i, void *var) ;
+void set_log_rotate (char **argv, int *i, void *var) ;
+void set_rate (char **argv, int *i, void *var) ;
+void set_mux (char **argv, int *i, void *var) ;
+void set_jobs (char **argv, int *i, void *var) ;
+void set_batch (char **argv, int *i, void *var) ;
+void set_cache (char **argv, int *i, void *var) ;
+void set_config (char **argv, int *i, void *var) ;
+void set_zygote (char **argv, int *i, void *var) ;
+void set_jvm (char **argv, int *i, void *var) ;
+void set_pty (char **argv, int *i, void *var) ;
+void set_record (char **argv, int *i, void *var) ;
 
 /** _set_timeout
     a helper function to find the value for timeout
@@ -40,10 +111,35 @@ int _set_timeout (char **argv, int i,  regmatch_t matchDigits, regmatch_t matchC
     get the timeout number
     convert to seconds if needed */
 void set_timeout (char **argv, int *i, void *var) ;
+/** _set_duration
+    a length of time for var in seconds, given in minutes
+    unless there is a measurement character (s, m, h, d) */
+void _set_duration (char **argv, int *i, void *var, int dflt) ;
+/** set_limits
+    the -g flag, var is a limits_t (cgroup.h):
+    -g cpu=50,mem=256,pids=64 (any of them, in any order) */
+void set_limits (char **argv, int *i, void *var) ;
+/** set_outcap
+    the -o flag, var is an outcap_t (relay.h):
+    -o KBPS[,MB][,drop]  (-o 64  OR  -o 64,10  OR  -o 64,10,drop  OR  -o 0,10) */
+void set_outcap (char **argv, int *i, void *var) ;
+void set_idle (char **argv, int *i, void *var) ;
+void set_lifetime (char **argv, int *i, void *var) ;
 void set_run (char **argv, int *i, void *var) ;
 void set_mode (char **argv, int *i, void *var) ;
+/** set_event_backend
+    the -e flag, "select", "epoll" or "uring" */
+void set_event_backend (char **argv, int *i, void *var) ;
+/** set_metrics
+    the -M flag, a port or the path of a Unix socket */
+void set_metrics (char **argv, int *i, void *var) ;
+/** set_spawn
+    the -s flag, "fork", "spawn" or "vfork" */
+void set_spawn (char **argv, int *i, void *var) ;
 
 
+void execvp_python_i (void *, void *, void *);
+void execvp_python (void *, void *, void *);
 void execvp_java(void *, void *, void *);
 /* void execlp_python (char *interpreter, char *name) ; */
 /* void execl_python (char *abs_path, char *name) ; */
@@ -52,6 +148,22 @@ void execvp_java(void *, void *, void *);
 /** set_exec_fn
     determine which exec to use based on the file name */
 void *set_exec_fn (char *name, char *mode, int *m) ;
+/** exec_file
+    the file exec_fn would hand to execvp, and the argv it would
+    use (*argv may be replaced). For spawn backends, which can't
+    call exec_fn in the child */
+char *exec_file (void (*exec_fn)(void *, void *, void *), char *abs_path, char ***argv) ;
+/** config_read
+    the -C file: one program a line, in the same flags as the
+    command line (-r PROG and any of -m -p -a -P -z -J -s -T -v
+    -w -i -I), # to the end of a line is a comment. Each line is
+    returned as an argv (argv[0] is path) in a malloc'd array of
+    *n. NULL if the file can't be read or has too many lines */
+char ***config_read (char *path, int *n) ;
+/** get_args_for_exec
+    argv for exec_fn: the program name (after "-m" for an
+    interpreter) and the client's args. Only the array is malloc'd */
+char **get_args_for_exec (char *name, int interpreter, char **args, int nargs) ;
 
 
 #endif /* SET_UP_H */
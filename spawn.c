@@ -0,0 +1,108 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the spawn backends (-s spawn, -s vfork).
+ * fork() copies the server's page tables for every client, which
+ * gets slower as the server grows. These backends share the
+ * server's memory until the exec, so the cost stays flat. The
+ * argv is built in the server first, the child only redirects
+ * stdin/stdout/stderr, resets its signals, and execs.
+ *
+ */
+
+#define _GNU_SOURCE  /* clone */
+#include <sched.h>
+#include "spawn.h"
+#include "cgroup.h"
+#include "evloop.h"
+#include "ptyrelay.h"
+
+/* the vfork child runs on this stack, the server is
+   suspended until it execs so one stack is enough */
+static char g_spawn_stack[SPAWN_STACK] __attribute__ ((aligned (16)));
+
+/* what the vfork child needs */
+typedef struct spawn_req {
+  int clientfd;
+  char *file;
+  char **argv;
+  char *cgroup;
+  sigset_t mask;
+} spawn_req_t;
+
+/** _spawn_posix
+    posix_spawnp with the dup2's done as file actions */
+pid_t _spawn_posix (spawn_req_t *req) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t dflt;
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  char tty[64];
+  pid_t pid = -1;
+  extern char **environ;
+
+  posix_spawn_file_actions_init(&fa);
+  if (isatty(req->clientfd) && 0 == ttyname_r(req->clientfd, tty, sizeof(tty))) {
+    /* -T: in a new session, the first tty opened becomes
+       the controlling terminal (what pty_take_ctty does) */
+    flags |= POSIX_SPAWN_SETSID;
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, tty, O_RDWR, 0);
+  } else {
+    posix_spawn_file_actions_adddup2(&fa, req->clientfd, STDIN_FILENO);
+  }
+  posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDERR_FILENO);
+
+  sigemptyset(&dflt);
+  sigaddset(&dflt, SIGPIPE);
+  sigaddset(&dflt, SIGCHLD);
+  sigaddset(&dflt, SIGALRM);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigdefault(&attr, &dflt);
+  posix_spawnattr_setsigmask(&attr, &(req->mask));
+  posix_spawnattr_setflags(&attr, flags);
+
+  if (0 != posix_spawnp(&pid, req->file, &fa, &attr, req->argv, environ)) {
+    pid = -1;
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  return pid;
+}
+
+/** _spawn_vfork_child
+    runs on g_spawn_stack in the server's memory, so it
+    must not touch anything but its own fds and signals */
+int _spawn_vfork_child (void *arg) {
+  spawn_req_t *req = (spawn_req_t *)arg;
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGALRM, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  sigprocmask(SIG_SETMASK, &(req->mask), NULL);
+  cgroup_enter(req->cgroup);
+  pty_take_ctty(req->clientfd);
+  dup2(req->clientfd, STDIN_FILENO);
+  dup2(req->clientfd, STDOUT_FILENO);
+  dup2(req->clientfd, STDERR_FILENO);
+  execvp(req->file, req->argv);
+  _exit(12);
+}
+
+/** _spawn_vfork
+    clone(CLONE_VM|CLONE_VFORK), returns once the child has exec'd */
+pid_t _spawn_vfork (spawn_req_t *req) {
+  return clone(_spawn_vfork_child, g_spawn_stack + SPAWN_STACK,
+	       CLONE_VM | CLONE_VFORK | SIGCHLD, (void *)req);
+}
+
+pid_t spawn_session (int backend, int clientfd, char *file, char **argv, char *cgroup) {
+  spawn_req_t req;
+  req.clientfd = clientfd;
+  req.file = file;
+  req.argv = argv;
+  req.cgroup = cgroup;
+  ev_child_sigmask(&(req.mask));
+  if (SPAWN_VFORK == backend || NULL != cgroup) {
+    return _spawn_vfork(&req);
+  }
+  return _spawn_posix(&req);
+}
@@ -0,0 +1,28 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/** spawn_session
+    start file with argv, stdin/stdout/stderr on clientfd, using
+    SPAWN_POSIX (posix_spawn with dup2 file actions) or
+    SPAWN_VFORK (clone(CLONE_VM|CLONE_VFORK), straight to exec).
+    Neither copies the server's page tables the way fork does.
+    On a pty (-T) the child gets a session of its own with the pty
+    as its controlling terminal, either way.
+    With a cgroup leaf (-g, see cgroup_enter) the child joins it
+    before the exec, posix_spawn has no way to, so it is SPAWN_VFORK.
+    Returns the child's pid, or -1 (the caller can still fork) */
+pid_t spawn_session (int backend, int clientfd, char *file, char **argv, char *cgroup) ;
+
+#endif /* SPAWN_H */
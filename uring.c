@@ -0,0 +1,110 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains a bare io_uring, for the event loop's
+ * uring backend (-e uring). The rings are set up with the raw
+ * syscalls and one mmap, submissions are queued in memory and
+ * handed to the kernel in the same io_uring_enter that waits
+ * for completions, so a round of the loop is one syscall.
+ *
+ */
+
+#include "uring.h"
+
+int uring_init (uring_t *u, unsigned entries) {
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  char *ring;
+
+  bzero(u, sizeof(uring_t));
+  bzero(&p, sizeof(p));
+  u->fd = syscall(SYS_io_uring_setup, entries, &p);
+  if (0 > u->fd) {
+    return -1;
+  }
+  /* one mapping for both rings (5.4), and no lost completions (5.5) */
+  if (!(IORING_FEAT_SINGLE_MMAP & p.features) || !(IORING_FEAT_NODROP & p.features)) {
+    close(u->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring = (char *)mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (MAP_FAILED == ring || MAP_FAILED == u->sqes) {
+    if (MAP_FAILED != ring) {
+      munmap(ring, u->ring_size);
+    }
+    if (MAP_FAILED != u->sqes) {
+      munmap(u->sqes, u->sqes_size);
+    }
+    close(u->fd);
+    return -1;
+  }
+  u->ring = ring;
+  u->sq_head = (unsigned *)(ring + p.sq_off.head);
+  u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(ring + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+  u->tail = *(u->sq_tail);
+  u->cq_head = (unsigned *)(ring + p.cq_off.head);
+  u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+  return 0;
+}
+
+struct io_uring_sqe *uring_sqe (uring_t *u) {
+  struct io_uring_sqe *sqe;
+  unsigned i;
+  if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries &&
+      -1 == uring_enter(u, 0, NULL)) {
+    return NULL;
+  }
+  if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+    return NULL;
+  }
+  i = u->tail & *(u->sq_mask);
+  sqe = &(u->sqes[i]);
+  bzero(sqe, sizeof(struct io_uring_sqe));
+  u->sq_array[i] = i;
+  u->tail++;
+  return sqe;
+}
+
+int uring_enter (uring_t *u, int wait, sigset_t *mask) {
+  unsigned queued;
+  int n;
+  __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+  queued = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (0 == queued && !wait) {
+    return 0;
+  }
+  n = syscall(SYS_io_uring_enter, u->fd, queued, wait ? 1 : 0,
+	      wait ? IORING_ENTER_GETEVENTS : 0, mask, _NSIG / 8);
+  return (0 > n) ? -1 : 0;
+}
+
+int uring_cqe (uring_t *u, struct io_uring_cqe *cqe) {
+  unsigned head = *(u->cq_head);
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  *cqe = u->cqes[head & *(u->cq_mask)];
+  __atomic_store_n(u->cq_head, head+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void uring_exit (uring_t *u) {
+  if (NULL != u->ring) {
+    munmap(u->ring, u->ring_size);
+    munmap(u->sqes, u->sqes_size);
+    close(u->fd);
+    u->ring = NULL;
+  }
+}
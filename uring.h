@@ -0,0 +1,55 @@
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* an io_uring, mapped by hand (there is no liburing here) */
+typedef struct uring {
+  int fd;
+  void *ring;                   /* SQ and CQ rings, one mapping */
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;            /* the kernel's */
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned tail;                /* ours, published at uring_enter */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} uring_t;
+
+/** uring_init
+    set up a ring of entries submissions.
+    Returns -1 if the kernel has no (usable) io_uring */
+int uring_init (uring_t *u, unsigned entries) ;
+/** uring_sqe
+    the next submission, zeroed. If the ring is full what's
+    queued is submitted first. Returns NULL if that fails */
+struct io_uring_sqe *uring_sqe (uring_t *u) ;
+/** uring_enter
+    submit everything queued, then (if wait) wait for a completion
+    with mask as the signal mask, like pselect. Returns -1 with
+    errno EINTR if a signal came */
+int uring_enter (uring_t *u, int wait, sigset_t *mask) ;
+/** uring_cqe
+    copy out the next completion. Returns 0 if there is none */
+int uring_cqe (uring_t *u, struct io_uring_cqe *cqe) ;
+/** uring_exit
+    unmap and close the ring */
+void uring_exit (uring_t *u) ;
+
+#endif /* URING_H */
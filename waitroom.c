@@ -0,0 +1,192 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the waiting room (-w). When every slot
+ * is taken a client used to get "Server Busy" and be dropped,
+ * and students just reconnected in a loop. Now they queue, in
+ * order, and are told their place in line and roughly how long
+ * it will be (from the average session length). They are
+ * admitted as sessions end.
+ *
+ * A waiting client's socket isn't read, anything it types is
+ * left for the program. Every WAIT_TICK seconds the room is
+ * checked: clients that hung up are dropped, slots given back
+ * by other acceptors (-n) are used, and the estimates updated.
+ *
+ * Each program (-C) has its own room, they share the slots.
+ *
+ */
+
+#include "waitroom.h"
+#include "evloop.h"
+#include "logger.h"
+#include "metrics.h"
+#include "session.h"
+
+static int g_waiting = 0; /* in every room */
+
+/** _waitroom_at
+    the i'th client in line */
+waiter_t *_waitroom_at (waitroom_t *w, int i) {
+  return &(w->q[(w->head + i) % w->size]);
+}
+
+/** _waitroom_len
+    there are len in line now */
+void _waitroom_len (waitroom_t *w, int len) {
+  g_waiting += len - w->len;
+  w->len = len;
+  metrics_waiting(g_waiting);
+}
+
+/** _waitroom_arm
+    the tick only runs while someone is waiting */
+void _waitroom_arm (waitroom_t *w, int on) {
+  struct itimerspec its;
+  bzero(&its, sizeof(its));
+  if (on) {
+    its.it_value.tv_sec = WAIT_TICK;
+    its.it_interval.tv_sec = WAIT_TICK;
+  }
+  timerfd_settime(w->tick, 0, &its, NULL);
+}
+
+/** _waitroom_tell
+    "you are number N in line", with the estimate.
+    Returns -1 if the client is gone */
+int _waitroom_tell (waiter_t *c, int pos) {
+  char msg[128];
+  int len;
+  double avg = session_avg_secs();
+  int slots = session_slots() + session_slots_free();
+  if (0 < avg) {
+    len = snprintf(msg, sizeof(msg), "Server full, you are number %d in line (about %ds)\n",
+		   pos, 1 + (int)(pos * avg / (slots ? slots : 1)));
+  } else {
+    len = snprintf(msg, sizeof(msg), "Server full, you are number %d in line\n", pos);
+  }
+  c->told_pos = pos;
+  c->told_at = time(NULL);
+  return (len == send(c->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL)) ? 0 : -1;
+}
+
+/** _waitroom_gone
+    peek at the socket, 0 bytes means the client hung up */
+int _waitroom_gone (waiter_t *c) {
+  char b;
+  int bytes = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+  return 0 == bytes || (0 > bytes && EAGAIN != errno && EWOULDBLOCK != errno);
+}
+
+/** _waitroom_drop
+    forget a client (closing it) */
+void _waitroom_drop (waiter_t *c) {
+  close(c->fd);
+  free(c->args);
+  c->args = NULL;
+}
+
+/** _waitroom_check
+    drop clients that left, and send new estimates to those
+    that moved up (or haven't heard anything for a while) */
+void _waitroom_check (waitroom_t *w) {
+  waiter_t keep;
+  time_t now = time(NULL);
+  int i, n = 0;
+  for (i = 0; i < w->len; i++) {
+    keep = *_waitroom_at(w, i);
+    if (_waitroom_gone(&keep) ||
+	((n+1 != keep.told_pos || WAIT_UPDATE <= now - keep.told_at) &&
+	 -1 == _waitroom_tell(&keep, n+1))) {
+      _waitroom_drop(&keep);
+      continue;
+    }
+    *_waitroom_at(w, n++) = keep;
+  }
+  _waitroom_len(w, n);
+}
+
+/** _waitroom_tick
+    event loop handler for the timerfd */
+void _waitroom_tick (int fd, int events, void *data) {
+  waitroom_t *w = (waitroom_t *)data;
+  uint64_t n;
+  read(fd, &n, sizeof(n));
+  waitroom_admit(w);
+  _waitroom_check(w);
+}
+
+waitroom_t *waitroom_create (int size, gather_fn_t admit, void *data) {
+  waitroom_t *w;
+  if (0 >= size || NULL == (w = (waitroom_t *)calloc(1, sizeof(waitroom_t)))) {
+    return NULL;
+  }
+  w->size = size;
+  w->admit = admit;
+  w->data = data;
+  w->q = (waiter_t *)calloc(size, sizeof(waiter_t));
+  w->tick = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (NULL == w->q || 0 > w->tick ||
+      -1 == ev_add(w->tick, EV_READ, _waitroom_tick, (void *)w)) {
+    log_msg("Unable to create the waiting room");
+    if (0 <= w->tick) {
+      close(w->tick);
+    }
+    free(w->q);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+int waitroom_add (waitroom_t *w, int clientfd, char **args, int nargs) {
+  char buf[MAX_PACKED_ARGS];
+  waiter_t *c;
+  if (w->len == w->size) {
+    return -1;
+  }
+  c = _waitroom_at(w, w->len);
+  bzero(c, sizeof(waiter_t));
+  c->fd = clientfd;
+  c->len = gather_pack(args, nargs, buf, sizeof(buf));
+  if (0 < c->len) {
+    if (NULL == (c->args = (char *)malloc(c->len))) {
+      return -1;
+    }
+    memcpy(c->args, buf, c->len);
+  }
+  if (-1 == _waitroom_tell(c, w->len + 1)) {
+    _waitroom_drop(c);
+    return 0; /* gone already, nothing to reject */
+  }
+  if (0 == w->len) {
+    _waitroom_arm(w, 1);
+  }
+  _waitroom_len(w, w->len + 1);
+  return 0;
+}
+
+void waitroom_admit (waitroom_t *w) {
+  char *args[MAX_A+1];
+  waiter_t c;
+  int nargs;
+  while (0 < w->len && 0 == session_slot_take()) {
+    c = *_waitroom_at(w, 0);
+    w->head = (w->head + 1) % w->size;
+    _waitroom_len(w, w->len - 1);
+    if (_waitroom_gone(&c)) {
+      session_slot_give();
+      _waitroom_drop(&c);
+      continue;
+    }
+    nargs = gather_unpack(c.args, c.len, args, MAX_A);
+    w->admit(c.fd, args, nargs, w->data);
+    free(c.args);
+  }
+  if (0 == w->len) {
+    _waitroom_arm(w, 0);
+  }
+}
+
+int waitroom_waiting () {
+  return g_waiting;
+}
@@ -0,0 +1,55 @@
+#ifndef WAITROOM_H
+#define WAITROOM_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "gather.h"
+
+/* a client waiting for a slot, args already gathered */
+typedef struct waiter {
+  int fd;
+  int len;                  /* packed args (gather_pack) */
+  char *args;
+  int told_pos;             /* last position sent to the client */
+  time_t told_at;
+} waiter_t;
+
+/* bounded FIFO of clients waiting for a connection slot */
+typedef struct waitroom {
+  int size;                 /* -w */
+  int head;                 /* ring of size waiters */
+  int len;
+  waiter_t *q;
+  int tick;                 /* timerfd, armed while anyone waits */
+  gather_fn_t admit;        /* start a session, the slot is already taken */
+  void *data;
+} waitroom_t;
+
+/** waitroom_create
+    a waiting room for size clients. admit(fd, args, nargs, data)
+    is called with a slot already taken for the client.
+    Returns NULL if size is 0 (reject with "Server Busy") */
+waitroom_t *waitroom_create (int size, gather_fn_t admit, void *data) ;
+/** waitroom_add
+    queue clientfd (and its args) and tell it where it stands.
+    Returns -1 if the room is full */
+int waitroom_add (waitroom_t *w, int clientfd, char **args, int nargs) ;
+/** waitroom_admit
+    admit waiting clients while there are free slots, call it
+    when a session ends (it also runs every WAIT_TICK seconds,
+    for slots given back by other acceptors) */
+void waitroom_admit (waitroom_t *w) ;
+/** waitroom_waiting
+    clients waiting, in every room */
+int waitroom_waiting () ;
+
+#endif /* WAITROOM_H */
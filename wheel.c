@@ -0,0 +1,172 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the timer wheel, for deadlines that are
+ * per session (see expire.c). Thousands of them can be pending,
+ * so there is no sorted list or heap: a timer goes in the slot
+ * for the tick it expires on, in one of WHEEL_LEVELS wheels of
+ * WHEEL_SLOTS slots (each level's slot covers a whole turn of the
+ * level below). Adding and removing are O(1). When the first
+ * wheel completes a turn, the next level's slot for the coming
+ * turn is spread into it (a cascade), so each timer moves at most
+ * WHEEL_LEVELS times.
+ *
+ * One timerfd in the event loop drives it, and only ticks while
+ * something is scheduled.
+ *
+ */
+
+#include "wheel.h"
+#include "evloop.h"
+#include "logger.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+static wtimer_t g_wheel[WHEEL_LEVELS][WHEEL_SLOTS]; /* list heads */
+static uint64_t g_wheel_now = 0;   /* ticks, CLOCK_MONOTONIC / WHEEL_TICK */
+static int g_wheel_count = 0;      /* timers scheduled */
+static int g_wheel_fd = -1;
+
+/** _wheel_clock
+    the current tick */
+uint64_t _wheel_clock () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec / WHEEL_TICK;
+}
+
+/** _wheel_arm
+    the timerfd only runs while timers are scheduled */
+void _wheel_arm (int on) {
+  struct itimerspec its;
+  bzero(&its, sizeof(its));
+  if (on) {
+    its.it_value.tv_sec = WHEEL_TICK;
+    its.it_interval.tv_sec = WHEEL_TICK;
+  }
+  timerfd_settime(g_wheel_fd, 0, &its, NULL);
+}
+
+/** _wheel_link
+    put t at the end of the list head */
+void _wheel_link (wtimer_t *head, wtimer_t *t) {
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+/** _wheel_unlink
+    take t out of its list */
+void _wheel_unlink (wtimer_t *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+/** _wheel_place
+    the slot for t->expires, at the lowest level that reaches it */
+void _wheel_place (wtimer_t *t) {
+  uint64_t delta = t->expires - g_wheel_now;
+  int level = 0;
+  while (level < WHEEL_LEVELS-1 && delta >= (1ULL << (WHEEL_BITS * (level+1)))) {
+    level++;
+  }
+  _wheel_link(&(g_wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK]), t);
+}
+
+/** _wheel_cascade
+    move the timers in slot of level into the levels below */
+void _wheel_cascade (int level, int slot) {
+  wtimer_t *head = &(g_wheel[level][slot]);
+  wtimer_t *t;
+  while (head->next != head) {
+    t = head->next;
+    _wheel_unlink(t);
+    _wheel_place(t);
+  }
+}
+
+/** _wheel_step
+    advance one tick, calling the timers that expire on it */
+void _wheel_step () {
+  wtimer_t *head, *t;
+  int level;
+  g_wheel_now++;
+  for (level = 1; level < WHEEL_LEVELS; level++) {
+    if (0 != (g_wheel_now & ((1ULL << (WHEEL_BITS * level)) - 1))) {
+      break; /* the level below hasn't finished a turn */
+    }
+    _wheel_cascade(level, (g_wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+  }
+  head = &(g_wheel[0][g_wheel_now & WHEEL_MASK]);
+  while (head->next != head) {
+    t = head->next;
+    _wheel_unlink(t);
+    g_wheel_count--;
+    t->fn(t); /* may schedule t (or others) again */
+  }
+}
+
+/** _wheel_tick
+    event loop handler for the timerfd */
+void _wheel_tick (int fd, int events, void *data) {
+  uint64_t n;
+  uint64_t now = _wheel_clock();
+  read(fd, &n, sizeof(n));
+  while (g_wheel_now < now && 0 < g_wheel_count) {
+    _wheel_step();
+  }
+  g_wheel_now = now;
+  if (0 == g_wheel_count) {
+    _wheel_arm(0);
+  }
+}
+
+int wheel_init () {
+  int level, slot;
+  if (0 <= g_wheel_fd) {
+    return 0; /* already running (the prompts and the session limits share it) */
+  }
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+      g_wheel[level][slot].next = g_wheel[level][slot].prev = &(g_wheel[level][slot]);
+    }
+  }
+  g_wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (0 > g_wheel_fd || -1 == ev_add(g_wheel_fd, EV_READ, _wheel_tick, NULL)) {
+    log_msg("Unable to start the session timers");
+    if (0 <= g_wheel_fd) {
+      close(g_wheel_fd);
+      g_wheel_fd = -1;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+void wheel_add (wtimer_t *t, long secs) {
+  long ticks = (secs + WHEEL_TICK - 1) / WHEEL_TICK;
+  long most = (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  wheel_del(t);
+  if (0 == g_wheel_count) {
+    g_wheel_now = _wheel_clock();
+    _wheel_arm(1);
+  }
+  t->expires = g_wheel_now + ((1 > ticks) ? 1 : (most < ticks) ? most : ticks);
+  _wheel_place(t);
+  g_wheel_count++;
+}
+
+void wheel_del (wtimer_t *t) {
+  if (NULL == t->prev) {
+    return;
+  }
+  _wheel_unlink(t);
+  if (0 == --g_wheel_count) {
+    _wheel_arm(0);
+  }
+}
+
+int wheel_pending (wtimer_t *t) {
+  return NULL != t->prev;
+}
@@ -0,0 +1,37 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* a deadline, kept in the caller's own struct */
+typedef struct wtimer {
+  struct wtimer *next;       /* slot list, NULL prev = not scheduled */
+  struct wtimer *prev;
+  uint64_t expires;          /* tick */
+  void (*fn)(struct wtimer *t);
+} wtimer_t;
+
+/** wheel_init
+    the timer wheel, driven by a timerfd in the event loop that
+    ticks every WHEEL_TICK seconds while any timer is scheduled */
+int wheel_init () ;
+/** wheel_add
+    call t->fn(t) in secs seconds (rounded up to a tick).
+    Replaces any earlier schedule of t. O(1) */
+void wheel_add (wtimer_t *t, long secs) ;
+/** wheel_del
+    unschedule t (it is fine if it isn't scheduled). O(1) */
+void wheel_del (wtimer_t *t) ;
+/** wheel_pending
+    1 if t is scheduled */
+int wheel_pending (wtimer_t *t) ;
+
+#endif /* WHEEL_H */
@@ -0,0 +1,237 @@
+/* -*- Mode: C -*- */
+/**
+ * This file contains the server side of the python zygote (-z).
+ * zygote.py is started once, preloads the imports of the .py
+ * program, and forks a child per client. The server hands it
+ * the client fd over a unix socket, and the zygote reports back
+ * the pid of each session it forks ("S PID", in handoff order)
+ * and when each one ends ("X PID STATUS").
+ *
+ */
+
+#include "zygote.h"
+#include "evloop.h"
+#include "gather.h"
+#include "logger.h"
+#include "netwrk.h"
+
+#define ZYGOTE_MAX_ARGV 16
+
+/** _zygote_script
+    zygote.py lives next to the server executable */
+int _zygote_script (char *buf, int len) {
+  char exe[PATH_MAX];
+  bzero(exe, sizeof(exe));
+  if (0 >= readlink("/proc/self/exe", exe, sizeof(exe)-1)) {
+    return -1;
+  }
+  char *slash = strrchr(exe, '/');
+  if (NULL == slash) {
+    return -1;
+  }
+  *slash = '\0';
+  snprintf(buf, len, "%s/zygote.py", exe);
+  return access(buf, R_OK);
+}
+
+/** _zygote_interp
+    split the interpreter into argv. If there is no -m
+    interpreter use the program's #! line, or python3.
+    Returns the number of words put in argv */
+int _zygote_interp (char *abs_path, char *interp, char *line, int len, char **argv) {
+  int n = 0;
+  char *tok, *save;
+  bzero(line, len);
+  if (NULL != interp) {
+    strncpy(line, interp, len-1);
+  } else {
+    FILE *f = fopen(abs_path, "r");
+    if (NULL != f) {
+      if (NULL == fgets(line, len, f) || 0 != strncmp(line, "#!", 2)) {
+	line[0] = '\0';
+      } else {
+	memmove(line, line+2, strlen(line+2)+1);
+      }
+      fclose(f);
+    }
+    if ('\0' == line[0]) {
+      strncpy(line, "python3", len-1);
+    }
+  }
+  for (tok = strtok_r(line, " \t\n", &save); NULL != tok && n < ZYGOTE_MAX_ARGV-6;
+       tok = strtok_r(NULL, " \t\n", &save)) {
+    argv[n++] = tok;
+  }
+  return n;
+}
+
+char **zygote_park_argv (char *abs_path, char *interp, int fd) {
+  char **argv = (char **)malloc(ZYGOTE_MAX_ARGV * sizeof(char *) + 2*PATH_MAX + 16);
+  char *script, *line, *fdstr;
+  int n;
+  if (NULL == argv) {
+    return NULL;
+  }
+  script = (char *)(argv + ZYGOTE_MAX_ARGV);
+  line = script + PATH_MAX;
+  fdstr = line + PATH_MAX;
+  if (-1 == _zygote_script(script, PATH_MAX) ||
+      0 == (n = _zygote_interp(abs_path, interp, line, PATH_MAX, argv))) {
+    free(argv);
+    return NULL;
+  }
+  snprintf(fdstr, 16, "%d", fd);
+  argv[n++] = script;
+  argv[n++] = "--park";
+  argv[n++] = fdstr;
+  argv[n++] = abs_path;
+  argv[n] = NULL;
+  return argv;
+}
+
+zygote_t *zygote_create (char *abs_path, char *interp) {
+  char script[PATH_MAX];
+  char line[PATH_MAX];
+  char fdstr[16];
+  char *argv[ZYGOTE_MAX_ARGV];
+  int sv[2];
+  int n, status;
+
+  if (-1 == _zygote_script(script, sizeof(script))) {
+    log_msg("zygote.py not found next to the server");
+    return NULL;
+  }
+  n = _zygote_interp(abs_path, interp, line, sizeof(line), argv);
+  if (0 == n) {
+    return NULL;
+  }
+  if (-1 == socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+    return NULL;
+  }
+  snprintf(fdstr, sizeof(fdstr), "%d", sv[1]);
+  argv[n++] = script;
+  argv[n++] = fdstr;
+  argv[n++] = abs_path;
+  argv[n] = NULL;
+
+  /* double fork, the zygote is reparented so its exit
+     doesn't look like a session ending */
+  pid_t chid = fork ();
+  if (0 > chid) {
+    close(sv[0]);
+    close(sv[1]);
+    return NULL;
+  }
+  if (0 == chid) {
+    close(sv[0]);
+    if (0 != fork ()) {
+      _exit(0);
+    }
+    fcntl(sv[1], F_SETFD, 0); /* the zygote keeps its end */
+    execvp(argv[0], argv);
+    dprintf(STDERR_FILENO, "Unable to start the zygote (%s)\n", argv[0]);
+    _exit(12);
+  }
+  close(sv[1]);
+  waitpid(chid, &status, 0);
+
+  zygote_t *z = (zygote_t *)calloc(1, sizeof(zygote_t));
+  if (NULL == z) {
+    close(sv[0]);
+    return NULL;
+  }
+  z->pid = -1; /* grandchild, not known */
+  z->chan = sv[0];
+  return z;
+}
+
+/** _zygote_started
+    the oldest handoff was forked as pid (-1 = it wasn't) */
+void _zygote_started (zygote_t *z, pid_t pid) {
+  zpending_t *p = z->head;
+  if (NULL == p) {
+    return;
+  }
+  z->head = p->next;
+  if (NULL == z->head) {
+    z->tail = NULL;
+  }
+  if (0 > pid) {
+    /* there won't be an "X" for it */
+    z->sessions--;
+    z->on_exit(-1, 0);
+  }
+  z->on_start(pid, p->leaf, p->data);
+  free(p);
+}
+
+/** _zygote_gone
+    the zygote exited. Sessions it had running can't be
+    tracked anymore, so their slots are given back */
+void _zygote_gone (zygote_t *z) {
+  log_msg("zygote exited, new sessions will exec the program");
+  ev_del(z->chan);
+  close(z->chan);
+  z->chan = -1;
+  while (NULL != z->head) {
+    _zygote_started(z, -1);
+  }
+  while (0 < z->sessions) {
+    z->sessions--;
+    z->on_exit(-1, 0);
+  }
+}
+
+/** _zygote_read
+    event loop handler for the control socket */
+void _zygote_read (int fd, int events, void *data) {
+  zygote_t *z = (zygote_t *)data;
+  char buf[64];
+  int bytes, pid, status;
+  while (0 < (bytes = recv(fd, buf, sizeof(buf)-1, MSG_DONTWAIT))) {
+    buf[bytes] = '\0';
+    if (2 == sscanf(buf, "X %d %d", &pid, &status)) {
+      z->sessions--;
+      z->on_exit((pid_t)pid, status);
+    } else if (1 == sscanf(buf, "S %d", &pid)) {
+      _zygote_started(z, (pid_t)pid);
+    }
+  }
+  if (0 == bytes || (EAGAIN != errno && EINTR != errno)) {
+    _zygote_gone(z);
+  }
+}
+
+int zygote_watch (zygote_t *z, void (*on_start)(pid_t pid, cgleaf_t *leaf, void *data),
+		  void (*on_exit)(pid_t pid, int status)) {
+  z->on_start = on_start;
+  z->on_exit = on_exit;
+  return ev_add(z->chan, EV_READ, _zygote_read, (void *)z);
+}
+
+int zygote_handoff (zygote_t *z, int clientfd, cgleaf_t *leaf,
+		    char **args, int nargs, void *data) {
+  char buf[1+PATH_MAX+MAX_PACKED_ARGS];
+  zpending_t *p;
+  if (-1 == z->chan || NULL == (p = (zpending_t *)calloc(1, sizeof(zpending_t)))) {
+    return -1;
+  }
+  /* "LEAF\0ARG\0...", the args the server gathered */
+  snprintf(buf, PATH_MAX, "%s", (NULL == leaf) ? "" : leaf->path);
+  int len = strlen(buf) + 1;
+  len += gather_pack(args, nargs, buf+len, MAX_PACKED_ARGS);
+  if (-1 == send_fd(z->chan, clientfd, buf, len)) {
+    free(p);
+    return -1;
+  }
+  p->leaf = leaf;
+  p->data = data;
+  if (NULL == z->tail) {
+    z->head = p;
+  } else {
+    z->tail->next = p;
+  }
+  z->tail = p;
+  z->sessions++;
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "defs.h"
+
+/* a handoff the zygote hasn't forked yet */
+typedef struct zpending {
+  cgleaf_t *leaf;      /* the session's cgroup leaf (-g), or NULL */
+  void *data;
+  struct zpending *next;
+} zpending_t;
+
+/* a long lived python process (zygote.py) that forks the sessions */
+typedef struct zygote {
+  pid_t pid;           /* the zygote (not a child of the server) */
+  int chan;            /* control socket, -1 once the zygote is gone */
+  int sessions;        /* sessions forked by the zygote still running */
+  zpending_t *head;    /* handoffs waiting for their "S PID", oldest first */
+  zpending_t *tail;
+  void (*on_start)(pid_t pid, cgleaf_t *leaf, void *data); /* a session was forked */
+  void (*on_exit)(pid_t pid, int status); /* a session ended */
+} zygote_t;
+
+/** zygote_create
+    start "INTERP zygote.py FD path" for the .py program.
+    interp is the -m interpreter, or NULL to use the #! line.
+    Must be called before SIGCHLD is handled (the zygote is
+    double forked so it never sends the server SIGCHLD) */
+zygote_t *zygote_create (char *abs_path, char *interp) ;
+/** zygote_park_argv
+    what a -P pool worker for the .py program execs, "INTERP
+    zygote.py --park FD path" (one malloc). The worker waits in
+    the interpreter, the program's imports done, for a client
+    on fd. NULL if zygote.py isn't there */
+char **zygote_park_argv (char *abs_path, char *interp, int fd) ;
+/** zygote_watch
+    register the control socket with the event loop.
+    on_start is called with each session's pid once it is forked
+    (pid -1 if it never was), with the leaf and data given to zygote_handoff.
+    on_exit is called as sessions end */
+int zygote_watch (zygote_t *z, void (*on_start)(pid_t pid, cgleaf_t *leaf, void *data),
+		  void (*on_exit)(pid_t pid, int status)) ;
+/** zygote_handoff
+    ask the zygote to run a session on clientfd with the args
+    the server gathered. Its child joins the cgroup leaf (NULL
+    for none) before it runs the program. Returns -1 if the
+    zygote is gone (the caller should fall back to exec) */
+int zygote_handoff (zygote_t *z, int clientfd, cgleaf_t *leaf,
+		    char **args, int nargs, void *data) ;
+
+#endif /* ZYGOTE_H */
@@ -0,0 +1,231 @@
+# -*- Mode: Python -*-
+#
+# Python fork-server (zygote) for ./main -z
+#
+#   $ python3 zygote.py CTL_FD program.py
+#   $ python3 zygote.py --park FD program.py   (a -P pool worker, see park)
+#
+# Started once by the server. It imports everything program.py
+# imports, then waits on the control socket CTL_FD. For each
+# client the server sends the client socket (SCM_RIGHTS) and a
+# request, the zygote forks, and the child binds stdin/stdout/stderr
+# to the socket and runs program.py as __main__. The interpreter,
+# and every module already imported, are shared copy-on-write.
+#
+# server -> zygote:  "LEAF\0ARG\0ARG\0..." + client fd
+#                    (the child joins the cgroup leaf LEAF, if it isn't
+#                    empty, and runs program.py with the args)
+# zygote -> server:  "S PID"  for each request, once it is forked
+#                    ("S -1" if it couldn't be)
+#                    "X PID STATUS"  when a session ends
+#
+
+import array
+import ast
+import errno
+import fcntl
+import gc
+import io
+import os
+import select
+import signal
+import socket
+import sys
+import termios
+import traceback
+
+
+def preload(path):
+    """import every module program.py imports at the top level"""
+    try:
+        with open(path, "rb") as f:
+            tree = ast.parse(f.read(), path)
+    except (OSError, SyntaxError):
+        return
+    for node in tree.body:
+        if isinstance(node, ast.Import):
+            names = [a.name for a in node.names]
+        elif isinstance(node, ast.ImportFrom) and 0 == node.level and node.module:
+            names = [node.module]
+        else:
+            continue
+        for name in names:
+            try:
+                __import__(name)
+            except Exception:
+                pass  # the program will report it when it runs
+
+
+def recv_msg(ctl):
+    """returns (client fd, message), or None if the server is gone"""
+    fds = array.array("i")
+    while True:
+        try:
+            msg, anc, flags, addr = ctl.recvmsg(4096, socket.CMSG_LEN(fds.itemsize))
+            break
+        except InterruptedError:
+            pass
+    if not msg:
+        return None
+    for level, kind, data in anc:
+        if socket.SOL_SOCKET == level and socket.SCM_RIGHTS == kind:
+            fds.frombytes(data[:fds.itemsize])
+    return (fds[0] if len(fds) else -1, msg)
+
+
+def recv_request(ctl):
+    """returns (client fd, leaf, args), or None if the server is gone"""
+    req = recv_msg(ctl)
+    if req is None:
+        return None
+    fd, msg = req
+    if 0 > fd:
+        return (-1, b"", [])
+    fields = msg.split(b"\0")
+    return (fd, fields[0], [f.decode("utf-8", "replace") for f in fields[1:-1]])
+
+
+def enter_cgroup(leaf):
+    """join the session's cgroup leaf (-g) before anything runs"""
+    if not leaf:
+        return
+    try:
+        with open(os.path.join(leaf, b"cgroup.procs"), "wb", buffering=0) as f:
+            f.write(b"0")
+    except OSError:
+        pass  # the server moves it in when it hears "S PID"
+
+
+def run_session(path, clientfd, leaf, args):
+    """runs in the forked child, never returns"""
+    status = 0
+    try:
+        enter_cgroup(leaf)
+        signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+        signal.set_wakeup_fd(-1)
+        if os.isatty(clientfd):
+            # -T: the pty becomes the session's controlling terminal
+            os.setsid()
+            fcntl.ioctl(clientfd, termios.TIOCSCTTY, 0)
+        os.dup2(clientfd, 0)
+        os.dup2(clientfd, 1)
+        os.dup2(clientfd, 2)
+        os.close(clientfd)
+        # fresh streams on the socket, buffered like a new interpreter's
+        sys.stdin = io.TextIOWrapper(io.open(0, "rb", closefd=False))
+        sys.stdout = io.TextIOWrapper(io.open(1, "wb", closefd=False))
+        sys.stderr = io.TextIOWrapper(io.open(2, "wb", closefd=False),
+                                      errors="backslashreplace", line_buffering=True)
+        sys.argv = [path] + args
+        import runpy
+        runpy.run_path(path, run_name="__main__")
+    except SystemExit as e:
+        if e.code is None:
+            status = 0
+        elif isinstance(e.code, int):
+            status = e.code
+        else:
+            sys.stderr.write(str(e.code) + "\n")
+            status = 1
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    try:
+        sys.stdout.flush()
+        sys.stderr.flush()
+    except Exception:
+        pass
+    os._exit(status & 0xff)
+
+
+def reap(ctl):
+    """collect finished sessions and report them to the server"""
+    while True:
+        try:
+            pid, status = os.waitpid(-1, os.WNOHANG)
+        except ChildProcessError:
+            return
+        if 0 == pid:
+            return
+        try:
+            ctl.send(b"X %d %d" % (pid, status))
+        except OSError:
+            pass
+
+
+def started(ctl, pid):
+    """tell the server the pid of the session it just handed over"""
+    try:
+        ctl.send(b"S %d" % pid)
+    except OSError:
+        pass
+
+
+def park(ctl, path):
+    """a pool worker (-P): an interpreter started ahead of time, with
+    program.py's imports done, waiting for one client. The pool sends
+    "c" LEAF "\0" ARG "\0" ... with the client fd"""
+    preload(path)
+    req = recv_msg(ctl)
+    if req is None or 0 > req[0]:
+        os._exit(0)  # server is gone
+    clientfd, msg = req
+    ctl.close()
+    fields = msg[1:].split(b"\0")
+    run_session(path, clientfd, fields[0],
+                [f.decode("utf-8", "replace") for f in fields[1:-1]])
+
+
+def main():
+    if "--park" == sys.argv[1]:
+        path = os.path.abspath(sys.argv[3])
+        sys.path[0] = os.path.dirname(path)
+        park(socket.socket(fileno=int(sys.argv[2])), path)
+    ctl = socket.socket(fileno=int(sys.argv[1]))
+    path = os.path.abspath(sys.argv[2])
+    sys.path[0] = os.path.dirname(path)
+    preload(path)
+    gc.freeze()  # keep the preloaded objects' pages shared after fork
+
+    # SIGCHLD wakes up select through a pipe
+    rd, wr = os.pipe()
+    os.set_blocking(rd, False)
+    os.set_blocking(wr, False)
+    signal.set_wakeup_fd(wr)
+    signal.signal(signal.SIGCHLD, lambda signo, frame: None)
+
+    while True:
+        try:
+            ready, _, _ = select.select([ctl, rd], [], [])
+        except InterruptedError:
+            continue
+        if rd in ready:
+            try:
+                os.read(rd, 512)
+            except OSError as e:
+                if errno.EAGAIN != e.errno:
+                    raise
+            reap(ctl)
+        if ctl in ready:
+            req = recv_request(ctl)
+            if req is None:
+                break  # server is gone
+            clientfd, leaf, args = req
+            if 0 > clientfd:
+                started(ctl, -1)
+                continue
+            try:
+                pid = os.fork()
+            except OSError:
+                pid = -1
+            if 0 == pid:
+                ctl.close()
+                os.close(rd)
+                os.close(wr)
+                run_session(path, clientfd, leaf, args)
+            os.close(clientfd)
+            started(ctl, pid)
+
+
+if __name__ == "__main__":
+    main()